@@ -0,0 +1,1072 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Micro-benchmark of the read path of vfs_rdirect, outside of samba.
+ *
+ * The module is linked against a shim of samba (see shim/), and driven the way smbd does it: the share is
+ * connected with the `rdirect:` options given, the file opened via the module, and reads are issued via
+ * pread_send/pread_recv from a single threaded event loop, keeping a given number of requests in flight.
+ * Request size, buffer misalignment, offset, engine and queue depth are swept, and throughput, IOPS and
+ * p50/p99 latency are reported for each combination. Engine `buffered` is the baseline: the reads go to the
+ * module below (modelled after vfs_default, reading via page cache in the worker threads) directly.
+ *
+ * Build (from the repository root):
+ *    cc -O2 -D_GNU_SOURCE -Ibench/shim -o rdirect_bench bench/rdirect_bench.c bench/shim.c vfs_rdirect.c -lpthread
+ * With the io_uring engine, add: -DHAVE_LIBURING -luring
+ *
+ * Usage: rdirect_bench -f <file or block device> [options], see rdirect_bench -h
+ *
+ * With -W, the write path is checked instead: unaligned writes into, at and past the last partial block of a
+ * scratch file are issued via pwrite and pwrite_send of the module, and the file is compared with the expected
+ * size and content afterwards. Reads filling the block cache are raced against a write of their range, and a write
+ * via one file handle must drop the chunks read ahead via another one.
+ */
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "includes.h"
+#include "system/filesys.h"
+#include "smbd/smbd.h"
+#include "lib/util/tevent_unix.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
+
+static_decl_vfs;
+
+#define BENCH_VALUES 16 //max. number of values per swept parameter
+#define BENCH_OPTIONS 32 //max. number of rdirect options
+#define BENCH_MAX_DEPTH 1024
+#define BENCH_ALIGN 4096 //alignment of the buffers (before misalignment) and of random offsets
+
+#ifdef HAVE_LIBURING
+#define BENCH_ENGINES_DEFAULT "buffered,sync,threadpool,io_uring"
+#else
+#define BENCH_ENGINES_DEFAULT "buffered,sync,threadpool"
+#endif
+
+struct bench_list {
+   unsigned int count;
+   uint64_t values[BENCH_VALUES];
+   char *names[BENCH_VALUES]; //engines only
+};
+
+struct bench;
+
+struct bench_slot {
+   struct bench *bench;
+   uint8_t *memory; //aligned allocation
+   uint8_t *buffer; //misaligned buffer in it
+   off_t offset;
+   struct timespec start;
+};
+
+struct bench {
+   struct tevent_context *ev;
+   const struct vfs_fn_pointers *fns;
+   vfs_handle_struct *handle;
+   files_struct *fsp;
+   size_t size;
+   off_t shift;
+   bool sequential;
+   off_t fileSize;
+   off_t next; //next sequential offset
+   uint64_t rng;
+   struct timespec deadline;
+   unsigned int inFlight;
+   bool stop;
+   uint64_t *latencies; //[ns]
+   size_t numLatencies;
+   size_t maxLatencies;
+   uint64_t bytes;
+   unsigned int errors;
+   int verifyFd; //buffered descriptor to verify the data with (-1: no verification)
+   uint8_t *verifyBuffer;
+   unsigned int mismatches;
+};
+
+static void bench_issue(struct bench_slot *slot);
+
+
+
+static void bench_usage(void)
+{
+   fprintf(stderr,
+         "usage: rdirect_bench -f <file> [options]\n"
+         "  -f <path>     file or block device to read from\n"
+         "  -c <size>     create (or extend) the file to <size> bytes first\n"
+         "  -s <sizes>    request sizes (default 4K,64K,1M)\n"
+         "  -m <bytes>    misalignments of the request buffer (default 0)\n"
+         "  -a <bytes>    offsets added to the request offsets (default 0)\n"
+         "  -e <engines>  engines: buffered (baseline), sync, threadpool, io_uring (default " BENCH_ENGINES_DEFAULT ")\n"
+         "  -q <depths>   queue depths, i.e. requests kept in flight (default 1,8,32)\n"
+         "  -t <seconds>  duration of each run (default 3)\n"
+         "  -p <pattern>  rand or seq (default rand)\n"
+         "  -o <opt=val>  rdirect option, e.g. -o 'readahead=4' (repeatable)\n"
+         "  -T <threads>  max. number of worker threads (default 64)\n"
+         "  -v            verify the data read (against a buffered read)\n"
+         "  -d <level>    debug level of the module\n"
+         "  -W <file>     check the write path on the scratch file <file> (overwritten), and exit\n"
+         "Lists are comma separated. Sizes take the suffixes K, M, G.\n");
+}
+
+
+
+static bool bench_parse_size(const char * const str, uint64_t * const value)
+{
+   if (conv_str_size_error(str, value))
+   {
+      return true;
+   }
+   fprintf(stderr, "rdirect_bench: invalid size %s\n", str);
+   return false;
+}
+
+
+
+static bool bench_parse_list(const char * const str, struct bench_list * const list, const bool names)
+{
+   char *copy = strdup(str);
+   list->count = 0;
+   for (char *save = NULL, *token = strtok_r(copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+   {
+      if (list->count == BENCH_VALUES)
+      {
+         fprintf(stderr, "rdirect_bench: too many values in %s\n", str);
+         free(copy);
+         return false;
+      }
+      if (names)
+      {
+         list->names[list->count] = strdup(token);
+      }
+      else if (!bench_parse_size(token, &list->values[list->count]))
+      {
+         free(copy);
+         return false;
+      }
+      ++list->count;
+   }
+   free(copy);
+   return list->count > 0;
+}
+
+
+
+static const char *bench_format_size(const uint64_t value, char * const buffer, const size_t len)
+{
+   static const char suffixes[] = { 'K', 'M', 'G' };
+   if (value != 0)
+   {
+      uint64_t scaled = value;
+      int i = -1;
+      while ((i < 2) && ((scaled % 1024) == 0))
+      {
+         scaled /= 1024;
+         ++i;
+      }
+      if (i >= 0)
+      {
+         snprintf(buffer, len, "%llu%c", (unsigned long long)scaled, suffixes[i]);
+         return buffer;
+      }
+   }
+   snprintf(buffer, len, "%llu", (unsigned long long)value);
+   return buffer;
+}
+
+
+
+static off_t bench_file_size(const int fd)
+{
+   struct stat st;
+   if (fstat(fd, &st) != 0)
+   {
+      return -1;
+   }
+   if (S_ISBLK(st.st_mode))
+   {
+      uint64_t size = 0;
+      return (ioctl(fd, BLKGETSIZE64, &size) == 0) ? (off_t)size : -1;
+   }
+   return st.st_size;
+}
+
+
+
+//create the file, or extend it to `size`. Each 64 bit word holds its own offset, so misplaced data is detected
+static bool bench_create(const char * const path, const off_t size)
+{
+   const int fd = open(path, O_WRONLY | O_CREAT, 0644);
+   if (fd < 0)
+   {
+      fprintf(stderr, "rdirect_bench: can't create %s: %s\n", path, strerror(errno));
+      return false;
+   }
+   const size_t chunk = 1024 * 1024;
+   uint64_t *buffer = malloc(chunk);
+   off_t offset = bench_file_size(fd);
+   offset -= offset % (off_t)chunk;
+   bool ok = (buffer != NULL) && (offset >= 0);
+   while (ok && (offset < size))
+   {
+      for (size_t i = 0; i < chunk / sizeof(uint64_t); ++i)
+      {
+         buffer[i] = (uint64_t)offset + i * sizeof(uint64_t);
+      }
+      const size_t len = (size_t)MIN((off_t)chunk, size - offset);
+      ok = (pwrite(fd, buffer, len, offset) == (ssize_t)len);
+      offset += (off_t)len;
+   }
+   ok = ok && (fsync(fd) == 0);
+   if (!ok)
+   {
+      fprintf(stderr, "rdirect_bench: can't write %s: %s\n", path, strerror(errno));
+   }
+   free(buffer);
+   close(fd);
+   return ok;
+}
+
+
+
+static off_t bench_next_offset(struct bench * const bench)
+{
+   off_t base;
+   if (bench->sequential)
+   {
+      if (bench->next + (off_t)bench->size + bench->shift > bench->fileSize)
+      {
+         bench->next = 0;
+      }
+      base = bench->next;
+      bench->next += (off_t)bench->size;
+   }
+   else
+   {
+      //xorshift64
+      bench->rng ^= bench->rng << 13;
+      bench->rng ^= bench->rng >> 7;
+      bench->rng ^= bench->rng << 17;
+      const uint64_t blocks = (uint64_t)(bench->fileSize - (off_t)bench->size - bench->shift) / BENCH_ALIGN + 1;
+      base = (off_t)((bench->rng % blocks) * BENCH_ALIGN);
+   }
+   return base + bench->shift;
+}
+
+
+
+static void bench_record(struct bench * const bench, const uint64_t latency)
+{
+   if (bench->numLatencies == bench->maxLatencies)
+   {
+      const size_t max = MAX(bench->maxLatencies * 2, (size_t)65536);
+      uint64_t *latencies = realloc(bench->latencies, max * sizeof(uint64_t));
+      if (latencies == NULL)
+      {
+         return;
+      }
+      bench->latencies = latencies;
+      bench->maxLatencies = max;
+   }
+   bench->latencies[bench->numLatencies++] = latency;
+}
+
+
+
+static void bench_done(struct tevent_req *req)
+{
+   struct bench_slot *slot = tevent_req_callback_data(req, struct bench_slot);
+   struct bench *bench = slot->bench;
+   struct vfs_aio_state vfs_aio_state = { 0 };
+
+   const ssize_t count = bench->fns->pread_recv_fn(req, &vfs_aio_state);
+   TALLOC_FREE(req);
+   struct timespec now;
+   PROFILE_TIMESTAMP(&now);
+   --bench->inFlight;
+
+   if (count < 0)
+   {
+      if (bench->errors++ == 0)
+      {
+         fprintf(stderr, "rdirect_bench: read of %zu bytes at %lld failed: %s\n", bench->size,
+               (long long)slot->offset, strerror(vfs_aio_state.error));
+      }
+   }
+   else
+   {
+      bench_record(bench, (uint64_t)nsec_time_diff(&now, &slot->start));
+      bench->bytes += (uint64_t)count;
+      if ((bench->verifyFd >= 0) && ((pread(bench->verifyFd, bench->verifyBuffer, bench->size, slot->offset) != count)
+            || (memcmp(bench->verifyBuffer, slot->buffer, (size_t)count) != 0)))
+      {
+         if (bench->mismatches++ == 0)
+         {
+            fprintf(stderr, "rdirect_bench: data of %zu bytes at %lld differs\n", bench->size,
+                  (long long)slot->offset);
+         }
+      }
+   }
+
+   if ((now.tv_sec > bench->deadline.tv_sec)
+         || ((now.tv_sec == bench->deadline.tv_sec) && (now.tv_nsec >= bench->deadline.tv_nsec)))
+   {
+      bench->stop = true;
+   }
+   if (!bench->stop)
+   {
+      bench_issue(slot);
+   }
+}
+
+
+
+static void bench_issue(struct bench_slot *slot)
+{
+   struct bench *bench = slot->bench;
+
+   slot->offset = bench_next_offset(bench);
+   PROFILE_TIMESTAMP(&slot->start);
+   struct tevent_req *req = bench->fns->pread_send_fn(bench->handle, bench->fsp, bench->ev, bench->fsp,
+         slot->buffer, bench->size, slot->offset);
+   if (req == NULL)
+   {
+      fprintf(stderr, "rdirect_bench: out of memory\n");
+      bench->stop = true;
+      return;
+   }
+   ++bench->inFlight;
+   tevent_req_set_callback(req, bench_done, slot);
+}
+
+
+
+static int bench_compare(const void *a, const void *b)
+{
+   const uint64_t x = *(const uint64_t *)a;
+   const uint64_t y = *(const uint64_t *)b;
+   return (x > y) - (x < y);
+}
+
+
+
+/*
+ * Connect the share with the engine given, open the file and read from it for `seconds`.
+ * Returns false, if the share or the file can't be opened.
+ */
+static bool bench_run(struct smbd_server_connection * const sconn, const char * const path, const char * const engine,
+         char * const * const options, const unsigned int numOptions, struct bench * const bench,
+         const size_t misalign, const unsigned int depth, const unsigned int seconds)
+{
+   const bool buffered = (strcmp(engine, "buffered") == 0);
+   bench->fns = buffered ? &shim_default_fns : shim_find_vfs("rdirect");
+
+   shim_clear_parms();
+   for (unsigned int i = 0; i < numOptions; ++i)
+   {
+      char name[128];
+      const char *value = strchr(options[i], '=');
+      snprintf(name, sizeof(name), "rdirect:%.*s", (int)(value - options[i]), options[i]);
+      shim_set_parm(name, value + 1);
+   }
+   shim_set_parm("rdirect:engine", buffered ? "threadpool" : engine);
+
+   connection_struct *conn = talloc_zero(sconn, connection_struct);
+   conn->sconn = sconn;
+   conn->params = talloc_zero(conn, struct share_params);
+   conn->read_only = true; //the benchmark only reads through the module
+   bench->handle = talloc_zero(conn, vfs_handle_struct);
+   bench->handle->conn = conn;
+   if (bench->fns->connect_fn(bench->handle, "bench", "bench") != 0)
+   {
+      fprintf(stderr, "rdirect_bench: connect failed: %s\n", strerror(errno));
+      talloc_free(conn);
+      return false;
+   }
+
+   files_struct *fsp = talloc_zero(conn, files_struct);
+   fsp->conn = conn;
+   fsp->fsp_name = talloc_zero(fsp, struct smb_filename);
+   fsp->fsp_name->base_name = (char *)path;
+   fsp->fsp_flags.can_read = true;
+   fsp->fd = bench->fns->openat_fn(bench->handle, NULL, fsp->fsp_name, fsp, O_RDONLY, 0);
+   struct stat st;
+   if ((fsp->fd < 0) || (fstat(fsp->fd, &st) != 0))
+   {
+      fprintf(stderr, "rdirect_bench: can't open %s: %s\n", path, strerror(errno));
+      talloc_free(conn);
+      return false;
+   }
+   init_stat_ex_from_stat(&fsp->fsp_name->st, &st, false);
+   fsp->file_id.devid = (uint64_t)st.st_dev;
+   fsp->file_id.inode = (uint64_t)st.st_ino;
+   bench->fsp = fsp;
+
+   //start cold, for every engine
+   (void)posix_fadvise(fsp->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+   struct bench_slot slots[BENCH_MAX_DEPTH];
+   for (unsigned int i = 0; i < depth; ++i)
+   {
+      slots[i].bench = bench;
+      slots[i].memory = NULL;
+      if (posix_memalign((void **)&slots[i].memory, BENCH_ALIGN, bench->size + misalign + BENCH_ALIGN) != 0)
+      {
+         fprintf(stderr, "rdirect_bench: out of memory\n");
+         exit(1);
+      }
+      slots[i].buffer = slots[i].memory + misalign;
+   }
+
+   bench->inFlight = 0;
+   bench->stop = false;
+   bench->numLatencies = 0;
+   bench->bytes = 0;
+   bench->errors = 0;
+   bench->mismatches = 0;
+   bench->next = 0;
+   bench->rng = 0x9E3779B97F4A7C15ULL;
+   struct timespec start, end;
+   PROFILE_TIMESTAMP(&start);
+   bench->deadline = start;
+   bench->deadline.tv_sec += seconds;
+   for (unsigned int i = 0; (i < depth) && !bench->stop; ++i)
+   {
+      bench_issue(&slots[i]);
+   }
+   while ((bench->inFlight > 0) && (tevent_loop_once(bench->ev) == 0))
+   {
+   }
+   PROFILE_TIMESTAMP(&end);
+
+   bench->fns->close_fn(bench->handle, fsp);
+   talloc_free(conn);
+   for (unsigned int i = 0; i < depth; ++i)
+   {
+      free(slots[i].memory);
+   }
+
+   const double elapsed = (double)nsec_time_diff(&end, &start) / 1e9;
+   double p50 = 0.0, p99 = 0.0;
+   if (bench->numLatencies > 0)
+   {
+      qsort(bench->latencies, bench->numLatencies, sizeof(uint64_t), bench_compare);
+      p50 = (double)bench->latencies[bench->numLatencies / 2] / 1000.0;
+      p99 = (double)bench->latencies[(bench->numLatencies * 99) / 100] / 1000.0;
+   }
+   char sizeText[24];
+   printf("%-10s %6s %8zu %8lld %5u %10.1f %10.0f %9.1f %9.1f%s\n", engine,
+         bench_format_size(bench->size, sizeText, sizeof(sizeText)), misalign, (long long)bench->shift, depth,
+         (double)bench->bytes / elapsed / (1024.0 * 1024.0), (double)bench->numLatencies / elapsed, p50, p99,
+         (bench->errors > 0) ? "  (errors)" : ((bench->mismatches > 0) ? "  (mismatch)" : ""));
+   fflush(stdout);
+   return true;
+}
+
+
+
+struct bench_write {
+   bool done;
+   ssize_t count;
+   int error;
+};
+
+
+
+static void bench_write_done(struct tevent_req *req)
+{
+   struct bench_write *write = tevent_req_callback_data(req, struct bench_write);
+   struct vfs_aio_state vfs_aio_state = { 0 };
+   write->count = shim_find_vfs("rdirect")->pwrite_recv_fn(req, &vfs_aio_state);
+   write->error = vfs_aio_state.error;
+   write->done = true;
+   TALLOC_FREE(req);
+}
+
+
+
+static void bench_read_done(struct tevent_req *req)
+{
+   struct bench_write *read = tevent_req_callback_data(req, struct bench_write);
+   struct vfs_aio_state vfs_aio_state = { 0 };
+   read->count = shim_find_vfs("rdirect")->pread_recv_fn(req, &vfs_aio_state);
+   read->error = vfs_aio_state.error;
+   read->done = true;
+   TALLOC_FREE(req);
+}
+
+
+
+//connect a share with the engine and options given, and open the file `path` via the module for read and write
+static files_struct *bench_check_open(struct smbd_server_connection * const sconn, const char * const path,
+         const char * const engine, char * const * const options, const unsigned int numOptions,
+         vfs_handle_struct ** const handle)
+{
+   shim_clear_parms();
+   for (unsigned int i = 0; i < numOptions; ++i)
+   {
+      char name[128];
+      const char *value = strchr(options[i], '=');
+      snprintf(name, sizeof(name), "rdirect:%.*s", (int)(value - options[i]), options[i]);
+      shim_set_parm(name, value + 1);
+   }
+   shim_set_parm("rdirect:engine", engine);
+
+   const struct vfs_fn_pointers *fns = shim_find_vfs("rdirect");
+   connection_struct *conn = talloc_zero(sconn, connection_struct);
+   conn->sconn = sconn;
+   conn->params = talloc_zero(conn, struct share_params);
+   *handle = talloc_zero(conn, vfs_handle_struct);
+   (*handle)->conn = conn;
+   if (fns->connect_fn(*handle, "bench", "bench") != 0)
+   {
+      fprintf(stderr, "rdirect_bench: connect failed: %s\n", strerror(errno));
+      exit(1);
+   }
+   files_struct *fsp = talloc_zero(conn, files_struct);
+   fsp->conn = conn;
+   fsp->fsp_name = talloc_zero(fsp, struct smb_filename);
+   fsp->fsp_name->base_name = (char *)path;
+   fsp->fsp_flags.can_read = true;
+   fsp->fsp_flags.can_write = true;
+   fsp->fd = fns->openat_fn(*handle, NULL, fsp->fsp_name, fsp, O_RDWR, 0);
+   struct stat st;
+   if ((fsp->fd < 0) || (fstat(fsp->fd, &st) != 0))
+   {
+      fprintf(stderr, "rdirect_bench: can't open %s: %s\n", path, strerror(errno));
+      exit(1);
+   }
+   init_stat_ex_from_stat(&fsp->fsp_name->st, &st, false);
+   fsp->file_id.devid = (uint64_t)st.st_dev;
+   fsp->file_id.inode = (uint64_t)st.st_ino;
+   return fsp;
+}
+
+
+
+//read via pread_send of the module, and wait for the read to complete. Returns the result of the read
+static ssize_t bench_check_pread(struct smbd_server_connection * const sconn, vfs_handle_struct * const handle,
+         files_struct * const fsp, void * const data, const size_t n, const off_t offset)
+{
+   struct bench_write read = { .count = -1 };
+   struct tevent_req *req = shim_find_vfs("rdirect")->pread_send_fn(handle, fsp, sconn->ev_ctx, fsp, data, n, offset);
+   if (req == NULL)
+   {
+      fprintf(stderr, "rdirect_bench: out of memory\n");
+      exit(1);
+   }
+   tevent_req_set_callback(req, bench_read_done, &read);
+   while (!read.done && (tevent_loop_once(sconn->ev_ctx) == 0))
+   {
+   }
+   return read.count;
+}
+
+
+
+/*
+ * Write `len` bytes at `offset` (from a buffer misaligned by `misalign`) through the module, into the scratch file
+ * `path` of `size` bytes, and compare the file with the expected result.
+ * Returns false, if it differs.
+ */
+static bool bench_check_write(struct smbd_server_connection * const sconn, const char * const path,
+         const char * const engine, char * const * const options, const unsigned int numOptions, const off_t size,
+         const off_t offset, const size_t len, const size_t misalign, const bool async)
+{
+   const off_t end = MAX(size, offset + (off_t)len);
+   uint8_t *expected = calloc(1, (size_t)end), *actual = malloc((size_t)end);
+   uint8_t *memory = NULL;
+   if ((expected == NULL) || (actual == NULL) || (posix_memalign((void **)&memory, BENCH_ALIGN, len + misalign) != 0))
+   {
+      fprintf(stderr, "rdirect_bench: out of memory\n");
+      exit(1);
+   }
+   for (off_t i = 0; i < size; ++i)
+   {
+      expected[i] = (uint8_t)(i % 251 + 1);
+   }
+   for (size_t i = 0; i < len; ++i)
+   {
+      memory[misalign + i] = (uint8_t)(~i | 0x80);
+   }
+   memcpy(expected + offset, memory + misalign, len);
+
+   int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if ((fd < 0) || (pwrite(fd, expected, (size_t)size, 0) != (ssize_t)size))
+   {
+      fprintf(stderr, "rdirect_bench: can't create %s: %s\n", path, strerror(errno));
+      exit(1);
+   }
+   close(fd);
+
+   const struct vfs_fn_pointers *fns = shim_find_vfs("rdirect");
+   vfs_handle_struct *handle = NULL;
+   files_struct *fsp = bench_check_open(sconn, path, engine, options, numOptions, &handle);
+
+   struct bench_write write = { .done = !async, .count = -1 };
+   if (async)
+   {
+      struct tevent_req *req = fns->pwrite_send_fn(handle, fsp, sconn->ev_ctx, fsp, memory + misalign, len, offset);
+      if (req == NULL)
+      {
+         fprintf(stderr, "rdirect_bench: out of memory\n");
+         exit(1);
+      }
+      tevent_req_set_callback(req, bench_write_done, &write);
+      while (!write.done && (tevent_loop_once(sconn->ev_ctx) == 0))
+      {
+      }
+   }
+   else
+   {
+      write.count = fns->pwrite_fn(handle, fsp, memory + misalign, len, offset);
+      write.error = errno;
+   }
+   //read the file back through the module
+   const ssize_t readBack = fns->pread_fn(handle, fsp, actual, (size_t)end, 0);
+   fns->close_fn(handle, fsp);
+   talloc_free(handle->conn);
+
+   fd = open(path, O_RDONLY);
+   const off_t actualSize = (fd >= 0) ? bench_file_size(fd) : -1;
+   const bool read = (fd >= 0) && (pread(fd, actual, (size_t)end, 0) == (ssize_t)end);
+   if (fd >= 0)
+   {
+      close(fd);
+   }
+   const bool ok = (write.count == (ssize_t)len) && (readBack == (ssize_t)end) && (actualSize == end) && read
+         && (memcmp(actual, expected, (size_t)end) == 0);
+   if (!ok)
+   {
+      fprintf(stderr, "rdirect_bench: %s %s write of %zu bytes at %lld (misaligned by %zu) into %lld bytes: ", engine,
+            async ? "async" : "sync", len, (long long)offset, misalign, (long long)size);
+      if (write.count != (ssize_t)len)
+      {
+         fprintf(stderr, "returned %zd (%s)\n", write.count, strerror(write.error));
+      }
+      else if (readBack != (ssize_t)end)
+      {
+         fprintf(stderr, "read back %zd bytes through the module instead of %lld\n", readBack, (long long)end);
+      }
+      else if (actualSize != end)
+      {
+         fprintf(stderr, "file has %lld bytes instead of %lld\n", (long long)actualSize, (long long)end);
+      }
+      else
+      {
+         fprintf(stderr, "content differs\n");
+      }
+   }
+   free(memory);
+   free(actual);
+   free(expected);
+   return ok;
+}
+
+
+
+#define BENCH_RACE_SIZE    (8 * 1024 * 1024) //range written by a racing write
+#define BENCH_RACE_READS   8                 //reads issued while it is in flight
+#define BENCH_RACE_READ    (64 * 1024)       //size of a read (a block of the block cache)
+#define BENCH_RACE_ROUNDS  16
+#define BENCH_RACE_DELAY   (20 * 1000)       //microseconds the write is held in flight
+
+/*
+ * Race reads, that fill the block cache, against an asynchronous write of the range they read, in the scratch
+ * file `path`. Afterwards, the range must read as written: the cache must not keep the data read before the write.
+ * Returns the number of rounds, that read stale data.
+ */
+static unsigned int bench_check_cache_write(struct smbd_server_connection * const sconn, const char * const path,
+         const char * const engine, char * const * const options, const unsigned int numOptions)
+{
+   char *raceOptions[BENCH_OPTIONS + 2];
+   memcpy(raceOptions, options, numOptions * sizeof(char *));
+   raceOptions[numOptions] = (char *)"cache size=64M";
+   raceOptions[numOptions + 1] = (char *)"cache range=16M";
+
+   uint8_t *data = NULL, *buffers = NULL;
+   if ((posix_memalign((void **)&data, BENCH_ALIGN, BENCH_RACE_SIZE) != 0)
+         || (posix_memalign((void **)&buffers, BENCH_ALIGN, BENCH_RACE_READS * BENCH_RACE_READ) != 0))
+   {
+      fprintf(stderr, "rdirect_bench: out of memory\n");
+      exit(1);
+   }
+   memset(data, 0x5a, BENCH_RACE_SIZE);
+   int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if ((fd < 0) || (pwrite(fd, data, BENCH_RACE_SIZE, 0) != BENCH_RACE_SIZE))
+   {
+      fprintf(stderr, "rdirect_bench: can't create %s: %s\n", path, strerror(errno));
+      exit(1);
+   }
+   close(fd);
+
+   const struct vfs_fn_pointers *fns = shim_find_vfs("rdirect");
+   vfs_handle_struct *handle = NULL;
+   files_struct *fsp = bench_check_open(sconn, path, engine, raceOptions, numOptions + 2, &handle);
+   unsigned int stale = 0;
+   for (unsigned int round = 0; round < BENCH_RACE_ROUNDS; ++round)
+   {
+      //the write first (unaligned, so via the delayed page cache write of the next module), then the reads of the tail
+      //of its range, which read the data before the write lands
+      memset(data, (int)(round + 1), BENCH_RACE_SIZE);
+      struct bench_write write = { .count = -1 };
+      struct bench_write reads[BENCH_RACE_READS];
+      shim_write_delay = BENCH_RACE_DELAY;
+      struct tevent_req *req = fns->pwrite_send_fn(handle, fsp, sconn->ev_ctx, fsp, data, BENCH_RACE_SIZE - 1, 1);
+      if (req != NULL)
+      {
+         tevent_req_set_callback(req, bench_write_done, &write);
+      }
+      for (unsigned int i = 0; (i < BENCH_RACE_READS) && (req != NULL); ++i)
+      {
+         reads[i] = (struct bench_write){ .count = -1 };
+         req = fns->pread_send_fn(handle, fsp, sconn->ev_ctx, fsp, buffers + i * BENCH_RACE_READ, BENCH_RACE_READ,
+               BENCH_RACE_SIZE - (off_t)(BENCH_RACE_READS - i) * BENCH_RACE_READ);
+         if (req != NULL)
+         {
+            tevent_req_set_callback(req, bench_read_done, &reads[i]);
+         }
+      }
+      if (req == NULL)
+      {
+         fprintf(stderr, "rdirect_bench: out of memory\n");
+         exit(1);
+      }
+      bool done = false;
+      while (!done && (tevent_loop_once(sconn->ev_ctx) == 0))
+      {
+         done = write.done;
+         for (unsigned int i = 0; i < BENCH_RACE_READS; ++i)
+         {
+            done = done && reads[i].done;
+         }
+      }
+      shim_write_delay = 0;
+
+      //read the range again (from the cache, where filled)
+      const ssize_t count = bench_check_pread(sconn, handle, fsp, buffers, BENCH_RACE_READS * BENCH_RACE_READ,
+            BENCH_RACE_SIZE - BENCH_RACE_READS * BENCH_RACE_READ);
+      if ((write.count != BENCH_RACE_SIZE - 1) || (count != BENCH_RACE_READS * BENCH_RACE_READ)
+            || (memcmp(buffers, data, BENCH_RACE_READS * BENCH_RACE_READ) != 0))
+      {
+         if (stale++ == 0)
+         {
+            fprintf(stderr, "rdirect_bench: %s read after a racing write returns the data before it\n", engine);
+         }
+      }
+   }
+   fns->close_fn(handle, fsp);
+   talloc_free(handle->conn);
+   free(buffers);
+   free(data);
+   return stale;
+}
+
+
+
+#define BENCH_RA_SIZE      (4 * 1024 * 1024) //size of the file read ahead
+#define BENCH_RA_READS     8                 //sequential reads, that start the read-ahead
+#define BENCH_RA_READ      (64 * 1024)
+#define BENCH_RA_WRITE     ((BENCH_RA_READS + 1) * BENCH_RA_READ) //offset of the write, into the chunks read ahead
+#define BENCH_RA_SETTLE    (50 * 1000)       //microseconds to let the chunks land
+
+static void bench_settled(struct tevent_context *ev, struct tevent_timer *te, struct timeval now, void *private_data)
+{
+   *(bool *)private_data = true;
+}
+
+/*
+ * Read the scratch file `path` sequentially via one file handle, so its read-ahead gets ahead of the reads, write
+ * into the chunks read ahead via another file handle, and read the written range via the first one again. It must
+ * read as written. Returns false, if it doesn't.
+ */
+static bool bench_check_readahead_write(struct smbd_server_connection * const sconn, const char * const path,
+         const char * const engine, char * const * const options, const unsigned int numOptions)
+{
+   char *raOptions[BENCH_OPTIONS + 2];
+   memcpy(raOptions, options, numOptions * sizeof(char *));
+   raOptions[numOptions] = (char *)"readahead=4";
+   raOptions[numOptions + 1] = (char *)"readahead size=256K";
+
+   uint8_t *data = NULL;
+   if (posix_memalign((void **)&data, BENCH_ALIGN, BENCH_RA_SIZE) != 0)
+   {
+      fprintf(stderr, "rdirect_bench: out of memory\n");
+      exit(1);
+   }
+   memset(data, 0x5a, BENCH_RA_SIZE);
+   int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if ((fd < 0) || (pwrite(fd, data, BENCH_RA_SIZE, 0) != BENCH_RA_SIZE))
+   {
+      fprintf(stderr, "rdirect_bench: can't create %s: %s\n", path, strerror(errno));
+      exit(1);
+   }
+   close(fd);
+
+   const struct vfs_fn_pointers *fns = shim_find_vfs("rdirect");
+   vfs_handle_struct *reader = NULL, *writer = NULL;
+   files_struct *readFsp = bench_check_open(sconn, path, engine, raOptions, numOptions + 2, &reader);
+   files_struct *writeFsp = bench_check_open(sconn, path, engine, raOptions, numOptions + 2, &writer);
+   bool ok = true;
+   for (unsigned int i = 0; ok && (i < BENCH_RA_READS); ++i)
+   {
+      ok = (bench_check_pread(sconn, reader, readFsp, data, BENCH_RA_READ, (off_t)i * BENCH_RA_READ)
+            == BENCH_RA_READ);
+   }
+   bool settled = false;
+   if (tevent_add_timer(sconn->ev_ctx, sconn, tevent_timeval_current_ofs(0, BENCH_RA_SETTLE), bench_settled,
+         &settled) == NULL)
+   {
+      fprintf(stderr, "rdirect_bench: out of memory\n");
+      exit(1);
+   }
+   while (!settled && (tevent_loop_once(sconn->ev_ctx) == 0))
+   {
+   }
+
+   memset(data, 0xa5, BENCH_RA_READ);
+   ok = ok && (fns->pwrite_fn(writer, writeFsp, data, BENCH_RA_READ, BENCH_RA_WRITE) == BENCH_RA_READ);
+   memset(data + BENCH_RA_READ, 0, BENCH_RA_READ);
+   ok = ok && (bench_check_pread(sconn, reader, readFsp, data + BENCH_RA_READ, BENCH_RA_READ, BENCH_RA_WRITE)
+         == BENCH_RA_READ);
+   ok = ok && (memcmp(data, data + BENCH_RA_READ, BENCH_RA_READ) == 0);
+   if (!ok)
+   {
+      fprintf(stderr, "rdirect_bench: %s read ahead via another file handle returns the data before a write\n",
+            engine);
+   }
+   fns->close_fn(writer, writeFsp);
+   fns->close_fn(reader, readFsp);
+   talloc_free(writer->conn);
+   talloc_free(reader->conn);
+   free(data);
+   return ok;
+}
+
+
+
+/*
+ * Check the write path on the scratch file `path`, with each engine (but the baseline).
+ * Returns the number of failed checks.
+ */
+static unsigned int bench_check_writes(struct smbd_server_connection * const sconn, const char * const path,
+         const struct bench_list * const engines, char * const * const options, const unsigned int numOptions)
+{
+   static const off_t sizes[] = { 5000, 8192, 12289 };
+   //(offset, length) relative to the end of file: into, up to, across and past the last partial block
+   static const struct {
+      off_t offset;
+      size_t len;
+   } writes[] = {
+      { -300, 100 }, { -200, 100 }, { -100, 100 }, { -100, 200 }, { -1, 1 }, { 0, 10 }, { 100, 50 },
+      { -5000, 100 }, { -4097, 4096 }, { -4999, 4998 }, { -4096, 4096 },
+   };
+   static const size_t misaligns[] = { 0, 1 };
+   unsigned int checks = 0, failures = 0;
+
+   for (unsigned int e = 0; e < engines->count; ++e)
+   {
+      if (strcmp(engines->names[e], "buffered") == 0)
+      {
+         continue;
+      }
+      for (int async = 0; async < 2; ++async)
+      {
+         for (size_t s = 0; s < ARRAY_SIZE(sizes); ++s)
+         {
+            for (size_t w = 0; w < ARRAY_SIZE(writes); ++w)
+            {
+               for (size_t m = 0; m < ARRAY_SIZE(misaligns); ++m)
+               {
+                  const off_t offset = sizes[s] + writes[w].offset;
+                  if (offset < 0)
+                  {
+                     continue;
+                  }
+                  ++checks;
+                  if (!bench_check_write(sconn, path, engines->names[e], options, numOptions, sizes[s], offset,
+                        writes[w].len, misaligns[m], async != 0))
+                  {
+                     ++failures;
+                  }
+               }
+            }
+         }
+      }
+      ++checks;
+      if (bench_check_cache_write(sconn, path, engines->names[e], options, numOptions) > 0)
+      {
+         ++failures;
+      }
+      ++checks;
+      if (!bench_check_readahead_write(sconn, path, engines->names[e], options, numOptions))
+      {
+         ++failures;
+      }
+   }
+   unlink(path);
+   printf("write checks: %u, failed: %u\n", checks, failures);
+   return failures;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+   const char *path = NULL;
+   const char *writeCheck = NULL;
+   uint64_t createSize = 0;
+   struct bench_list sizes, misaligns, shifts, engines, depths;
+   bench_parse_list("4K,64K,1M", &sizes, false);
+   bench_parse_list("0", &misaligns, false);
+   bench_parse_list("0", &shifts, false);
+   bench_parse_list(BENCH_ENGINES_DEFAULT, &engines, true);
+   bench_parse_list("1,8,32", &depths, false);
+   unsigned int seconds = 3;
+   unsigned int maxThreads = 64;
+   bool sequential = false;
+   bool verify = false;
+   char *options[BENCH_OPTIONS];
+   unsigned int numOptions = 0;
+
+   int opt;
+   while ((opt = getopt(argc, argv, "f:c:s:m:a:e:q:t:p:o:T:vd:W:h")) != -1)
+   {
+      bool ok = true;
+      switch (opt)
+      {
+      case 'f': path = optarg; break;
+      case 'c': ok = bench_parse_size(optarg, &createSize); break;
+      case 's': ok = bench_parse_list(optarg, &sizes, false); break;
+      case 'm': ok = bench_parse_list(optarg, &misaligns, false); break;
+      case 'a': ok = bench_parse_list(optarg, &shifts, false); break;
+      case 'e': ok = bench_parse_list(optarg, &engines, true); break;
+      case 'q': ok = bench_parse_list(optarg, &depths, false); break;
+      case 't': seconds = (unsigned int)atoi(optarg); break;
+      case 'p': sequential = (strcmp(optarg, "seq") == 0); ok = sequential || (strcmp(optarg, "rand") == 0); break;
+      case 'o':
+         ok = (numOptions < BENCH_OPTIONS) && (strchr(optarg, '=') != NULL);
+         if (ok)
+         {
+            options[numOptions++] = optarg;
+         }
+         break;
+      case 'T': maxThreads = (unsigned int)atoi(optarg); break;
+      case 'v': verify = true; break;
+      case 'd': shim_debuglevel = atoi(optarg); break;
+      case 'W': writeCheck = optarg; break;
+      default: ok = false; break;
+      }
+      if (!ok)
+      {
+         bench_usage();
+         return 1;
+      }
+   }
+   if ((path == NULL) && (writeCheck == NULL))
+   {
+      bench_usage();
+      return 1;
+   }
+   for (unsigned int i = 0; i < engines.count; ++i)
+   {
+      if ((strcmp(engines.names[i], "buffered") != 0) && (strcmp(engines.names[i], "sync") != 0)
+            && (strcmp(engines.names[i], "threadpool") != 0) && (strcmp(engines.names[i], "io_uring") != 0))
+      {
+         fprintf(stderr, "rdirect_bench: unknown engine %s\n", engines.names[i]);
+         return 1;
+      }
+   }
+   for (unsigned int i = 0; i < depths.count; ++i)
+   {
+      if ((depths.values[i] == 0) || (depths.values[i] > BENCH_MAX_DEPTH))
+      {
+         fprintf(stderr, "rdirect_bench: queue depth must be 1..%d\n", BENCH_MAX_DEPTH);
+         return 1;
+      }
+   }
+   if ((createSize > 0) && (path != NULL) && !bench_create(path, (off_t)createSize))
+   {
+      return 1;
+   }
+
+   vfs_rdirect_init(NULL);
+   struct smbd_server_connection *sconn = talloc_zero(NULL, struct smbd_server_connection);
+   sconn->ev_ctx = tevent_context_init(sconn);
+   if ((sconn->ev_ctx == NULL) || (pthreadpool_tevent_init(sconn, maxThreads, &sconn->pool) != 0))
+   {
+      fprintf(stderr, "rdirect_bench: can't set up the event loop\n");
+      return 1;
+   }
+   if (writeCheck != NULL)
+   {
+      return (bench_check_writes(sconn, writeCheck, &engines, options, numOptions) == 0) ? 0 : 1;
+   }
+
+   struct bench bench = { .ev = sconn->ev_ctx, .sequential = sequential, .verifyFd = -1 };
+   const int fd = open(path, O_RDONLY);
+   bench.fileSize = (fd >= 0) ? bench_file_size(fd) : -1;
+   if (bench.fileSize < 0)
+   {
+      fprintf(stderr, "rdirect_bench: can't open %s: %s\n", path, strerror(errno));
+      return 1;
+   }
+   if (verify)
+   {
+      bench.verifyFd = fd;
+   }
+   else
+   {
+      close(fd);
+   }
+
+   printf("%-10s %6s %8s %8s %5s %10s %10s %9s %9s\n",
+         "engine", "size", "misalign", "offset", "depth", "MiB/s", "IOPS", "p50[us]", "p99[us]");
+   for (unsigned int s = 0; s < sizes.count; ++s)
+   {
+      bench.size = (size_t)sizes.values[s];
+      free(bench.verifyBuffer);
+      bench.verifyBuffer = verify ? malloc(bench.size) : NULL;
+      for (unsigned int a = 0; a < shifts.count; ++a)
+      {
+         bench.shift = (off_t)shifts.values[a];
+         if ((off_t)bench.size + bench.shift > bench.fileSize)
+         {
+            fprintf(stderr, "rdirect_bench: file too small for %zu bytes at %lld, skipped\n", bench.size,
+                  (long long)bench.shift);
+            continue;
+         }
+         for (unsigned int m = 0; m < misaligns.count; ++m)
+         {
+            for (unsigned int q = 0; q < depths.count; ++q)
+            {
+               for (unsigned int e = 0; e < engines.count; ++e)
+               {
+                  if (!bench_run(sconn, path, engines.names[e], options, numOptions, &bench,
+                        (size_t)misaligns.values[m], (unsigned int)depths.values[q], seconds))
+                  {
+                     return 1;
+                  }
+               }
+            }
+         }
+      }
+   }
+   free(bench.verifyBuffer);
+   free(bench.latencies);
+   return 0;
+}
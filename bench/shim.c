@@ -0,0 +1,1603 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Implementation of the samba shim (see shim/includes.h and shim/smbd/smbd.h).
+ */
+#include <ctype.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "includes.h"
+#include "system/filesys.h"
+#include "smbd/smbd.h"
+#include "lib/util/tevent_unix.h"
+#include "lib/util/dlinklist.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
+
+
+
+/*
+ * Misc.
+ */
+int shim_debuglevel = 0;
+unsigned int shim_write_delay = 0;
+
+void shim_dbgtext(const char *format, ...)
+{
+   va_list ap;
+   va_start(ap, format);
+   vfprintf(stderr, format, ap);
+   va_end(ap);
+}
+
+
+
+void smb_panic(const char *why)
+{
+   fprintf(stderr, "PANIC: %s\n", why);
+   abort();
+}
+
+
+
+void become_root(void)
+{
+}
+
+
+
+void unbecome_root(void)
+{
+}
+
+
+
+size_t shim_strlcpy(char *dest, const char *src, size_t size)
+{
+   const size_t len = strlen(src);
+   if (size > 0)
+   {
+      const size_t n = MIN(len, size - 1);
+      memcpy(dest, src, n);
+      dest[n] = '\0';
+   }
+   return len;
+}
+
+
+
+int64_t nsec_time_diff(const struct timespec *end, const struct timespec *start)
+{
+   return ((int64_t)end->tv_sec - (int64_t)start->tv_sec) * 1000000000LL
+         + ((int64_t)end->tv_nsec - (int64_t)start->tv_nsec);
+}
+
+
+
+/*
+ * talloc.
+ */
+struct shim_talloc {
+   struct shim_talloc *parent;
+   struct shim_talloc *child; //first child
+   struct shim_talloc *prev, *next; //siblings
+   int (*destructor)(void *ptr);
+   bool freeing;
+};
+
+#define SHIM_TALLOC_HDR ((sizeof(struct shim_talloc) + 15) & ~(size_t)15)
+#define SHIM_TC(ptr) ((struct shim_talloc *)((uint8_t *)(ptr) - SHIM_TALLOC_HDR))
+#define SHIM_PTR(tc) ((void *)((uint8_t *)(tc) + SHIM_TALLOC_HDR))
+
+
+
+static void shim_talloc_unlink(struct shim_talloc * const tc)
+{
+   if (tc->parent != NULL)
+   {
+      if (tc->parent->child == tc)
+      {
+         tc->parent->child = tc->next;
+      }
+      if (tc->prev != NULL)
+      {
+         tc->prev->next = tc->next;
+      }
+      if (tc->next != NULL)
+      {
+         tc->next->prev = tc->prev;
+      }
+   }
+   tc->parent = tc->prev = tc->next = NULL;
+}
+
+
+
+void *_talloc_zero(const void *ctx, size_t size)
+{
+   struct shim_talloc *tc = calloc(1, SHIM_TALLOC_HDR + size);
+   if (tc == NULL)
+   {
+      return NULL;
+   }
+   if (ctx != NULL)
+   {
+      struct shim_talloc *parent = SHIM_TC(ctx);
+      tc->parent = parent;
+      tc->next = parent->child;
+      if (parent->child != NULL)
+      {
+         parent->child->prev = tc;
+      }
+      parent->child = tc;
+   }
+   return SHIM_PTR(tc);
+}
+
+
+
+int talloc_free(void *ptr)
+{
+   if (ptr == NULL)
+   {
+      return -1;
+   }
+   struct shim_talloc *tc = SHIM_TC(ptr);
+   if (tc->freeing)
+   {
+      return -1;
+   }
+   tc->freeing = true;
+   if ((tc->destructor != NULL) && (tc->destructor(ptr) == -1))
+   {
+      tc->freeing = false;
+      return -1;
+   }
+   while (tc->child != NULL)
+   {
+      struct shim_talloc *child = tc->child;
+      if (talloc_free(SHIM_PTR(child)) == -1)
+      {
+         shim_talloc_unlink(child); //denied -> move to the NULL context
+      }
+   }
+   shim_talloc_unlink(tc);
+   free(tc);
+   return 0;
+}
+
+
+
+void _talloc_set_destructor(const void *ptr, int (*destructor)(void *))
+{
+   SHIM_TC(ptr)->destructor = destructor;
+}
+
+
+
+void *talloc_parent(const void *ptr)
+{
+   struct shim_talloc *tc = SHIM_TC(ptr);
+   return (tc->parent != NULL) ? SHIM_PTR(tc->parent) : NULL;
+}
+
+
+
+/*
+ * tevent.
+ */
+struct shim_immediate {
+   struct shim_immediate *prev, *next;
+   struct tevent_context *ev; //context scheduled at (NULL: not scheduled)
+   void (*handler)(struct shim_immediate *im);
+};
+
+struct tevent_fd {
+   struct tevent_fd *prev, *next;
+   struct tevent_context *ev;
+   int fd;
+   uint16_t flags;
+   tevent_fd_handler_t handler;
+   void *private_data;
+};
+
+struct tevent_timer {
+   struct tevent_timer *prev, *next;
+   struct tevent_context *ev;
+   struct timeval when;
+   tevent_timer_handler_t handler;
+   void *private_data;
+};
+
+struct tevent_context {
+   struct shim_immediate *immediates;
+   struct tevent_fd *fdes;
+   struct tevent_timer *timers; //ordered by due time
+};
+
+struct tevent_req {
+   void *data; //state
+   tevent_req_fn fn; //callback
+   void *private_data;
+   tevent_req_cleanup_fn cleanupFn;
+   enum tevent_req_state cleanupState; //state the cleanup function was called for last
+   tevent_req_cancel_fn cancelFn;
+   enum tevent_req_state state;
+   uint64_t error;
+   struct tevent_context *deferEv; //context to defer the callback to (NULL: call it right away)
+   struct shim_immediate post;
+};
+
+
+
+static void shim_immediate_schedule(struct shim_immediate * const im, struct tevent_context * const ev)
+{
+   if (im->ev == NULL)
+   {
+      im->ev = ev;
+      DLIST_ADD_END(ev->immediates, im);
+   }
+}
+
+
+
+static void shim_immediate_cancel(struct shim_immediate * const im)
+{
+   if (im->ev != NULL)
+   {
+      DLIST_REMOVE(im->ev->immediates, im);
+      im->ev = NULL;
+   }
+}
+
+
+
+struct tevent_context *tevent_context_init(TALLOC_CTX *mem_ctx)
+{
+   return talloc_zero(mem_ctx, struct tevent_context);
+}
+
+
+
+//get the time until `when` [ms], rounded up (0: due)
+static int shim_timeval_until(const struct timeval * const when)
+{
+   struct timeval now;
+   gettimeofday(&now, NULL);
+   const int64_t us = ((int64_t)when->tv_sec - now.tv_sec) * 1000000 + (when->tv_usec - now.tv_usec);
+   return (us > 0) ? (int)((us + 999) / 1000) : 0;
+}
+
+
+
+//run a single event: an immediate, a timer due, or else the handler of a descriptor ready (blocking until there
+//is one, or the next timer is due)
+int tevent_loop_once(struct tevent_context *ev)
+{
+   if (ev->immediates != NULL)
+   {
+      struct shim_immediate *im = ev->immediates;
+      shim_immediate_cancel(im);
+      im->handler(im);
+      return 0;
+   }
+   const int timeout = (ev->timers != NULL) ? shim_timeval_until(&ev->timers->when) : -1;
+   if (timeout == 0)
+   {
+      //one-shot: the timer is freed after its handler (like tevent does it)
+      struct tevent_timer *te = ev->timers;
+      DLIST_REMOVE(ev->timers, te);
+      te->ev = NULL;
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      te->handler(ev, te, now, te->private_data);
+      talloc_free(te);
+      return 0;
+   }
+
+   nfds_t count = 0;
+   struct pollfd pfds[16];
+   for (struct tevent_fd *fde = ev->fdes; (fde != NULL) && (count < ARRAY_SIZE(pfds)); fde = fde->next)
+   {
+      pfds[count].fd = fde->fd;
+      pfds[count].events = ((fde->flags & TEVENT_FD_READ) ? POLLIN : 0) | ((fde->flags & TEVENT_FD_WRITE) ? POLLOUT : 0);
+      pfds[count].revents = 0;
+      ++count;
+   }
+   if ((count == 0) && (timeout < 0))
+   {
+      errno = ENOENT; //nothing to wait for
+      return -1;
+   }
+   int ret;
+   do
+   {
+      ret = poll(pfds, count, timeout);
+   } while ((ret < 0) && (errno == EINTR));
+   if (ret < 0)
+   {
+      return -1;
+   }
+
+   for (nfds_t i = 0; i < count; ++i)
+   {
+      if (pfds[i].revents == 0)
+      {
+         continue;
+      }
+      for (struct tevent_fd *fde = ev->fdes; fde != NULL; fde = fde->next)
+      {
+         if (fde->fd == pfds[i].fd)
+         {
+            const uint16_t flags = ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) ? TEVENT_FD_READ : 0)
+                  | ((pfds[i].revents & POLLOUT) ? TEVENT_FD_WRITE : 0);
+            fde->handler(ev, fde, flags & fde->flags, fde->private_data);
+            return 0;
+         }
+      }
+   }
+   return 0;
+}
+
+
+
+static int shim_fde_destructor(struct tevent_fd *fde)
+{
+   DLIST_REMOVE(fde->ev->fdes, fde);
+   return 0;
+}
+
+
+
+struct tevent_fd *tevent_add_fd(struct tevent_context *ev, TALLOC_CTX *mem_ctx, int fd, uint16_t flags,
+      tevent_fd_handler_t handler, void *private_data)
+{
+   struct tevent_fd *fde = talloc_zero(mem_ctx, struct tevent_fd);
+   if (fde == NULL)
+   {
+      return NULL;
+   }
+   fde->ev = ev;
+   fde->fd = fd;
+   fde->flags = flags;
+   fde->handler = handler;
+   fde->private_data = private_data;
+   DLIST_ADD_END(ev->fdes, fde);
+   talloc_set_destructor(fde, shim_fde_destructor);
+   return fde;
+}
+
+
+
+static int shim_timer_destructor(struct tevent_timer *te)
+{
+   if (te->ev != NULL)
+   {
+      DLIST_REMOVE(te->ev->timers, te);
+      te->ev = NULL;
+   }
+   return 0;
+}
+
+
+
+struct tevent_timer *tevent_add_timer(struct tevent_context *ev, TALLOC_CTX *mem_ctx, struct timeval next_event,
+      tevent_timer_handler_t handler, void *private_data)
+{
+   struct tevent_timer *te = talloc_zero(mem_ctx, struct tevent_timer);
+   if (te == NULL)
+   {
+      return NULL;
+   }
+   te->ev = ev;
+   te->when = next_event;
+   te->handler = handler;
+   te->private_data = private_data;
+   struct tevent_timer *prev = NULL;
+   for (struct tevent_timer *t = ev->timers; t != NULL; t = t->next)
+   {
+      if (timercmp(&t->when, &next_event, >))
+      {
+         break;
+      }
+      prev = t;
+   }
+   DLIST_ADD_AFTER(ev->timers, te, prev);
+   talloc_set_destructor(te, shim_timer_destructor);
+   return te;
+}
+
+
+
+struct timeval tevent_timeval_current_ofs(uint32_t secs, uint32_t usecs)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   tv.tv_sec += secs + usecs / 1000000;
+   tv.tv_usec += usecs % 1000000;
+   if (tv.tv_usec >= 1000000)
+   {
+      tv.tv_usec -= 1000000;
+      ++tv.tv_sec;
+   }
+   return tv;
+}
+
+
+
+static void shim_req_cleanup(struct tevent_req * const req)
+{
+   if ((req->cleanupFn == NULL) || (req->cleanupState >= req->state))
+   {
+      return;
+   }
+   req->cleanupState = req->state;
+   req->cleanupFn(req, req->state);
+}
+
+
+
+static void shim_req_notify(struct tevent_req * const req)
+{
+   if (req->deferEv != NULL)
+   {
+      struct tevent_context *ev = req->deferEv;
+      req->deferEv = NULL;
+      tevent_req_post(req, ev);
+      return;
+   }
+   if (req->fn != NULL)
+   {
+      req->fn(req);
+   }
+}
+
+
+
+static void shim_req_post_handler(struct shim_immediate *im)
+{
+   struct tevent_req *req = (struct tevent_req *)((uint8_t *)im - offsetof(struct tevent_req, post));
+   shim_req_notify(req);
+}
+
+
+
+static void shim_req_finish(struct tevent_req * const req, const enum tevent_req_state state)
+{
+   req->state = state;
+   req->cancelFn = NULL;
+   shim_req_cleanup(req);
+   shim_req_notify(req);
+}
+
+
+
+static int shim_req_destructor(struct tevent_req *req)
+{
+   tevent_req_received(req);
+   return 0;
+}
+
+
+
+struct tevent_req *_tevent_req_create(TALLOC_CTX *mem_ctx, void *pstate, size_t state_size)
+{
+   struct tevent_req *req = talloc_zero(mem_ctx, struct tevent_req);
+   if (req == NULL)
+   {
+      return NULL;
+   }
+   req->data = _talloc_zero(req, state_size);
+   if (req->data == NULL)
+   {
+      talloc_free(req);
+      return NULL;
+   }
+   req->state = TEVENT_REQ_IN_PROGRESS;
+   req->post.handler = shim_req_post_handler;
+   talloc_set_destructor(req, shim_req_destructor);
+   *(void **)pstate = req->data;
+   return req;
+}
+
+
+
+void *_tevent_req_data(struct tevent_req *req)
+{
+   return req->data;
+}
+
+
+
+void *_tevent_req_callback_data(struct tevent_req *req)
+{
+   return req->private_data;
+}
+
+
+
+void tevent_req_set_callback(struct tevent_req *req, tevent_req_fn fn, void *pvt)
+{
+   req->fn = fn;
+   req->private_data = pvt;
+}
+
+
+
+void tevent_req_set_cleanup_fn(struct tevent_req *req, tevent_req_cleanup_fn fn)
+{
+   req->cleanupState = req->state;
+   req->cleanupFn = fn;
+}
+
+
+
+void tevent_req_set_cancel_fn(struct tevent_req *req, tevent_req_cancel_fn fn)
+{
+   req->cancelFn = fn;
+}
+
+
+
+bool tevent_req_cancel(struct tevent_req *req)
+{
+   return (req->cancelFn != NULL) && req->cancelFn(req);
+}
+
+
+
+void tevent_req_done(struct tevent_req *req)
+{
+   shim_req_finish(req, TEVENT_REQ_DONE);
+}
+
+
+
+bool tevent_req_error(struct tevent_req *req, uint64_t error)
+{
+   if (error == 0)
+   {
+      return false;
+   }
+   req->error = error;
+   shim_req_finish(req, TEVENT_REQ_USER_ERROR);
+   return true;
+}
+
+
+
+bool tevent_req_nomem(const void *p, struct tevent_req *req)
+{
+   if (p != NULL)
+   {
+      return false;
+   }
+   shim_req_finish(req, TEVENT_REQ_NO_MEMORY);
+   return true;
+}
+
+
+
+struct tevent_req *tevent_req_post(struct tevent_req *req, struct tevent_context *ev)
+{
+   shim_immediate_schedule(&req->post, ev);
+   return req;
+}
+
+
+
+void tevent_req_defer_callback(struct tevent_req *req, struct tevent_context *ev)
+{
+   req->deferEv = ev;
+}
+
+
+
+bool tevent_req_is_in_progress(struct tevent_req *req)
+{
+   return req->state == TEVENT_REQ_IN_PROGRESS;
+}
+
+
+
+bool tevent_req_is_error(struct tevent_req *req, enum tevent_req_state *state, uint64_t *error)
+{
+   if (req->state == TEVENT_REQ_DONE)
+   {
+      return false;
+   }
+   if (req->state == TEVENT_REQ_USER_ERROR)
+   {
+      *error = req->error;
+   }
+   *state = req->state;
+   return true;
+}
+
+
+
+bool tevent_req_is_unix_error(struct tevent_req *req, int *perrno)
+{
+   enum tevent_req_state state;
+   uint64_t error = 0;
+   if (!tevent_req_is_error(req, &state, &error))
+   {
+      return false;
+   }
+   switch (state)
+   {
+   case TEVENT_REQ_NO_MEMORY:
+      *perrno = ENOMEM;
+      break;
+   case TEVENT_REQ_TIMED_OUT:
+      *perrno = ETIMEDOUT;
+      break;
+   case TEVENT_REQ_USER_ERROR:
+      *perrno = (int)error;
+      break;
+   default:
+      *perrno = EINVAL;
+      break;
+   }
+   return true;
+}
+
+
+
+void tevent_req_received(struct tevent_req *req)
+{
+   talloc_set_destructor(req, NULL);
+   shim_immediate_cancel(&req->post);
+   req->deferEv = NULL;
+   req->state = TEVENT_REQ_RECEIVED;
+   shim_req_cleanup(req);
+   TALLOC_FREE(req->data);
+}
+
+
+
+/*
+ * pthreadpool_tevent.
+ * The pool is never freed (like the one of an smbd process, it lives as long as the process).
+ */
+struct shim_job {
+   struct shim_job *next;
+   void (*fn)(void *private_data);
+   void *private_data;
+   struct tevent_req *req; //NULL, if the request has gone (orphaned job)
+};
+
+struct pthreadpool_tevent {
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   struct shim_job *head, *tail; //jobs queued
+   struct shim_job *finished; //jobs completed, not handled by the event loop yet (latest first)
+   unsigned int maxThreads;
+   unsigned int numThreads;
+   unsigned int idleThreads;
+   int signalFds[2]; //pipe, workers signal completions to the event loop with
+   struct tevent_fd *fde;
+};
+
+struct shim_job_state {
+   struct pthreadpool_tevent *pool;
+   struct tevent_context *ev;
+   struct shim_job *job; //NULL, when completed
+};
+
+
+
+static void *shim_pool_worker(void *arg)
+{
+   struct pthreadpool_tevent *pool = (struct pthreadpool_tevent *)arg;
+
+   pthread_mutex_lock(&pool->mutex);
+   while (true)
+   {
+      while (pool->head == NULL)
+      {
+         ++pool->idleThreads;
+         pthread_cond_wait(&pool->cond, &pool->mutex);
+         --pool->idleThreads;
+      }
+      struct shim_job *job = pool->head;
+      pool->head = job->next;
+      if (pool->head == NULL)
+      {
+         pool->tail = NULL;
+      }
+      pthread_mutex_unlock(&pool->mutex);
+
+      job->fn(job->private_data);
+
+      pthread_mutex_lock(&pool->mutex);
+      job->next = pool->finished;
+      pool->finished = job;
+      const char c = 0;
+      (void)!write(pool->signalFds[1], &c, 1); //pipe full: a signal is pending anyway
+   }
+   return NULL;
+}
+
+
+
+static void shim_pool_handler(struct tevent_context *ev, struct tevent_fd *fde, uint16_t flags, void *private_data)
+{
+   struct pthreadpool_tevent *pool = (struct pthreadpool_tevent *)private_data;
+   char buffer[64];
+   while (read(pool->signalFds[0], buffer, sizeof(buffer)) > 0)
+   {
+   }
+
+   pthread_mutex_lock(&pool->mutex);
+   struct shim_job *finished = pool->finished;
+   pool->finished = NULL;
+   pthread_mutex_unlock(&pool->mutex);
+
+   //complete in submission order
+   struct shim_job *jobs = NULL;
+   while (finished != NULL)
+   {
+      struct shim_job *job = finished;
+      finished = job->next;
+      job->next = jobs;
+      jobs = job;
+   }
+   //a callback may free the requests of jobs still in the list. that orphans them (see shim_job_state_destructor)
+   while (jobs != NULL)
+   {
+      struct shim_job *job = jobs;
+      jobs = job->next;
+      struct tevent_req *req = job->req;
+      if (req != NULL)
+      {
+         tevent_req_data(req, struct shim_job_state)->job = NULL;
+      }
+      free(job);
+      if (req != NULL)
+      {
+         tevent_req_done(req);
+      }
+   }
+}
+
+
+
+//remove the job of `state` from the queue, if not started yet. Returns false, if started (or completed) already
+static bool shim_job_dequeue(struct shim_job_state *state)
+{
+   if (state->job == NULL)
+   {
+      return false;
+   }
+   struct pthreadpool_tevent *pool = state->pool;
+   pthread_mutex_lock(&pool->mutex);
+   struct shim_job *prev = NULL;
+   for (struct shim_job *job = pool->head; job != NULL; prev = job, job = job->next)
+   {
+      if (job == state->job)
+      {
+         if (prev != NULL)
+         {
+            prev->next = job->next;
+         }
+         else
+         {
+            pool->head = job->next;
+         }
+         if (pool->tail == job)
+         {
+            pool->tail = prev;
+         }
+         free(job);
+         state->job = NULL;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&pool->mutex);
+   return (state->job == NULL);
+}
+
+
+
+//the request has gone: cancel the job, if not started yet. Otherwise it is orphaned
+static int shim_job_state_destructor(struct shim_job_state *state)
+{
+   if (!shim_job_dequeue(state) && (state->job != NULL))
+   {
+      pthread_mutex_lock(&state->pool->mutex);
+      state->job->req = NULL;
+      state->job = NULL;
+      pthread_mutex_unlock(&state->pool->mutex);
+   }
+   return 0;
+}
+
+
+
+//cancel the job, if not started yet (like samba's pthreadpool_tevent_job_cancel)
+static bool shim_job_cancel(struct tevent_req *req)
+{
+   struct shim_job_state *state = tevent_req_data(req, struct shim_job_state);
+   if (!shim_job_dequeue(state))
+   {
+      return false;
+   }
+   tevent_req_defer_callback(req, state->ev);
+   tevent_req_error(req, ECANCELED);
+   return true;
+}
+
+
+
+int pthreadpool_tevent_init(TALLOC_CTX *mem_ctx, unsigned max_threads, struct pthreadpool_tevent **presult)
+{
+   struct pthreadpool_tevent *pool = talloc_zero(mem_ctx, struct pthreadpool_tevent);
+   if (pool == NULL)
+   {
+      return ENOMEM;
+   }
+   if (pipe2(pool->signalFds, O_NONBLOCK | O_CLOEXEC) != 0)
+   {
+      const int err = errno;
+      talloc_free(pool);
+      return err;
+   }
+   pthread_mutex_init(&pool->mutex, NULL);
+   pthread_cond_init(&pool->cond, NULL);
+   pool->maxThreads = MAX(max_threads, 1);
+   *presult = pool;
+   return 0;
+}
+
+
+
+struct tevent_req *pthreadpool_tevent_job_send(TALLOC_CTX *mem_ctx, struct tevent_context *ev,
+      struct pthreadpool_tevent *pool, void (*fn)(void *private_data), void *private_data)
+{
+   struct shim_job_state *state = NULL;
+   struct tevent_req *req = tevent_req_create(mem_ctx, &state, struct shim_job_state);
+   if (req == NULL)
+   {
+      return NULL;
+   }
+   if (pool->fde == NULL)
+   {
+      pool->fde = tevent_add_fd(ev, pool, pool->signalFds[0], TEVENT_FD_READ, shim_pool_handler, pool);
+      if (pool->fde == NULL)
+      {
+         talloc_free(req);
+         return NULL;
+      }
+   }
+   struct shim_job *job = calloc(1, sizeof(*job));
+   if (job == NULL)
+   {
+      talloc_free(req);
+      return NULL;
+   }
+   job->fn = fn;
+   job->private_data = private_data;
+   job->req = req;
+   state->pool = pool;
+   state->ev = ev;
+   state->job = job;
+   talloc_set_destructor(state, shim_job_state_destructor);
+   tevent_req_set_cancel_fn(req, shim_job_cancel);
+
+   pthread_mutex_lock(&pool->mutex);
+   if (pool->tail != NULL)
+   {
+      pool->tail->next = job;
+   }
+   else
+   {
+      pool->head = job;
+   }
+   pool->tail = job;
+   if ((pool->idleThreads == 0) && (pool->numThreads < pool->maxThreads))
+   {
+      pthread_attr_t attr;
+      pthread_t thread;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      if (pthread_create(&thread, &attr, shim_pool_worker, pool) == 0)
+      {
+         ++pool->numThreads;
+      }
+      pthread_attr_destroy(&attr);
+   }
+   pthread_cond_signal(&pool->cond);
+   const bool stalled = (pool->numThreads == 0);
+   pthread_mutex_unlock(&pool->mutex);
+
+   if (stalled)
+   {
+      //no thread at all -> the caller processes the job itself
+      talloc_set_destructor(state, NULL);
+      shim_job_state_destructor(state);
+      tevent_req_error(req, EAGAIN);
+      return tevent_req_post(req, ev);
+   }
+   return req;
+}
+
+
+
+int pthreadpool_tevent_job_recv(struct tevent_req *req)
+{
+   int err = 0;
+   if (!tevent_req_is_unix_error(req, &err))
+   {
+      err = 0;
+   }
+   tevent_req_received(req);
+   return err;
+}
+
+
+
+/*
+ * loadparm.
+ */
+#define SHIM_PARMS 64
+
+static struct {
+   char *name;
+   char *value;
+   char **list; //value split by lp_parm_string_list
+} shim_parms[SHIM_PARMS];
+static unsigned int shim_numParms = 0;
+
+
+
+//compare case insensitive, ignoring whitespace (like samba's strwicmp)
+static int shim_strwicmp(const char *a, const char *b)
+{
+   while (true)
+   {
+      while (isspace((unsigned char)*a))
+      {
+         ++a;
+      }
+      while (isspace((unsigned char)*b))
+      {
+         ++b;
+      }
+      if ((*a == '\0') || (tolower((unsigned char)*a) != tolower((unsigned char)*b)))
+      {
+         return tolower((unsigned char)*a) - tolower((unsigned char)*b);
+      }
+      ++a;
+      ++b;
+   }
+}
+
+
+
+//set parameter `name` (e.g. "rdirect:engine") of the share
+void shim_set_parm(const char *name, const char *value)
+{
+   for (unsigned int i = 0; i < shim_numParms; ++i)
+   {
+      if (shim_strwicmp(shim_parms[i].name, name) == 0)
+      {
+         free(shim_parms[i].value);
+         free(shim_parms[i].list);
+         shim_parms[i].value = strdup(value);
+         shim_parms[i].list = NULL;
+         return;
+      }
+   }
+   if (shim_numParms < SHIM_PARMS)
+   {
+      shim_parms[shim_numParms].name = strdup(name);
+      shim_parms[shim_numParms].value = strdup(value);
+      ++shim_numParms;
+   }
+}
+
+
+
+void shim_clear_parms(void)
+{
+   for (unsigned int i = 0; i < shim_numParms; ++i)
+   {
+      free(shim_parms[i].name);
+      free(shim_parms[i].value);
+      free(shim_parms[i].list);
+      shim_parms[i].list = NULL;
+   }
+   shim_numParms = 0;
+}
+
+
+
+const char *lp_parm_const_string(int snum, const char *type, const char *option, const char *def)
+{
+   char name[256];
+   snprintf(name, sizeof(name), "%s:%s", type, option);
+   for (unsigned int i = 0; i < shim_numParms; ++i)
+   {
+      if (shim_strwicmp(shim_parms[i].name, name) == 0)
+      {
+         return shim_parms[i].value;
+      }
+   }
+   return def;
+}
+
+
+
+//split like loadparm does (separators: whitespace, `,` and `;`). The list is kept with the parameter
+const char **lp_parm_string_list(int snum, const char *type, const char *option, const char **def)
+{
+   char name[256];
+   snprintf(name, sizeof(name), "%s:%s", type, option);
+   for (unsigned int i = 0; i < shim_numParms; ++i)
+   {
+      if (shim_strwicmp(shim_parms[i].name, name) != 0)
+      {
+         continue;
+      }
+      if (shim_parms[i].list == NULL)
+      {
+         //pointers (at most one per two characters) followed by a copy of the value
+         const size_t len = strlen(shim_parms[i].value);
+         const size_t numPtrs = len / 2 + 2;
+         shim_parms[i].list = malloc(numPtrs * sizeof(char *) + len + 1);
+         if (shim_parms[i].list == NULL)
+         {
+            return def;
+         }
+         char *copy = (char *)(shim_parms[i].list + numPtrs);
+         memcpy(copy, shim_parms[i].value, len + 1);
+         unsigned int count = 0;
+         char *saveptr = NULL;
+         for (char *token = strtok_r(copy, " \t\n\r,;", &saveptr); token != NULL;
+               token = strtok_r(NULL, " \t\n\r,;", &saveptr))
+         {
+            shim_parms[i].list[count++] = token;
+         }
+         shim_parms[i].list[count] = NULL;
+      }
+      return (const char **)shim_parms[i].list;
+   }
+   return def;
+}
+
+
+
+int lp_parm_int(int snum, const char *type, const char *option, int def)
+{
+   const char *value = lp_parm_const_string(snum, type, option, NULL);
+   return ((value != NULL) && (*value != '\0')) ? (int)strtol(value, NULL, 0) : def;
+}
+
+
+
+bool lp_parm_bool(int snum, const char *type, const char *option, bool def)
+{
+   const char *value = lp_parm_const_string(snum, type, option, NULL);
+   if (value == NULL)
+   {
+      return def;
+   }
+   if ((shim_strwicmp(value, "yes") == 0) || (shim_strwicmp(value, "true") == 0)
+         || (shim_strwicmp(value, "on") == 0) || (shim_strwicmp(value, "1") == 0))
+   {
+      return true;
+   }
+   if ((shim_strwicmp(value, "no") == 0) || (shim_strwicmp(value, "false") == 0)
+         || (shim_strwicmp(value, "off") == 0) || (shim_strwicmp(value, "0") == 0))
+   {
+      return false;
+   }
+   DEBUG(0, ("lp_parm_bool: invalid boolean value %s for %s:%s\n", value, type, option));
+   return def;
+}
+
+
+
+int lp_parm_enum(int snum, const char *type, const char *option, const struct enum_list *_enum, int def)
+{
+   const char *value = lp_parm_const_string(snum, type, option, NULL);
+   if ((value == NULL) || (*value == '\0'))
+   {
+      return def;
+   }
+   for (unsigned int i = 0; _enum[i].name != NULL; ++i)
+   {
+      if (shim_strwicmp(_enum[i].name, value) == 0)
+      {
+         return _enum[i].value;
+      }
+   }
+   DEBUG(0, ("lp_parm_enum: value %s for %s:%s is not in the enum\n", value, type, option));
+   return -1;
+}
+
+
+
+const char *lp_const_servicename(int snum)
+{
+   return "bench";
+}
+
+
+
+bool conv_str_size_error(const char *str, uint64_t *val)
+{
+   if ((str == NULL) || (*str == '\0'))
+   {
+      return false;
+   }
+   char *end = NULL;
+   errno = 0;
+   unsigned long long value = strtoull(str, &end, 10);
+   if ((errno != 0) || (end == str))
+   {
+      return false;
+   }
+   if (*end != '\0')
+   {
+      static const char * const suffixes[] = { "K", "M", "G", "T", "P" };
+      unsigned int i = 0;
+      while ((i < ARRAY_SIZE(suffixes)) && (shim_strwicmp(end, suffixes[i]) != 0))
+      {
+         ++i;
+      }
+      if (i == ARRAY_SIZE(suffixes))
+      {
+         return false;
+      }
+      for (unsigned int k = 0; k <= i; ++k)
+      {
+         value *= 1024ULL;
+      }
+   }
+   *val = (uint64_t)value;
+   return true;
+}
+
+
+
+/*
+ * VFS modules and fsp extensions.
+ */
+#define SHIM_MODULES 4
+
+static struct {
+   const char *name;
+   const struct vfs_fn_pointers *fns;
+} shim_modules[SHIM_MODULES];
+
+
+
+NTSTATUS smb_register_vfs(int version, const char *name, const struct vfs_fn_pointers *fns)
+{
+   if (version != SMB_VFS_INTERFACE_VERSION)
+   {
+      return NT_STATUS_NO_MEMORY;
+   }
+   for (unsigned int i = 0; i < SHIM_MODULES; ++i)
+   {
+      if (shim_modules[i].name == NULL)
+      {
+         shim_modules[i].name = name;
+         shim_modules[i].fns = fns;
+         return NT_STATUS_OK;
+      }
+   }
+   return NT_STATUS_NO_MEMORY;
+}
+
+
+
+const struct vfs_fn_pointers *shim_find_vfs(const char *name)
+{
+   for (unsigned int i = 0; (i < SHIM_MODULES) && (shim_modules[i].name != NULL); ++i)
+   {
+      if (strcmp(shim_modules[i].name, name) == 0)
+      {
+         return shim_modules[i].fns;
+      }
+   }
+   return NULL;
+}
+
+
+
+struct vfs_fsp_data {
+   struct vfs_fsp_data *next;
+   vfs_handle_struct *owner;
+   void (*destroy)(void *p_data);
+};
+
+#define SHIM_EXT_HDR ((sizeof(struct vfs_fsp_data) + 15) & ~(size_t)15)
+#define SHIM_EXT_DATA(ext) ((void *)((uint8_t *)(ext) + SHIM_EXT_HDR))
+
+
+
+void *vfs_add_fsp_extension_notype(vfs_handle_struct *handle, files_struct *fsp, size_t ext_size,
+      void (*destroy_fn)(void *p_data))
+{
+   void *data = vfs_fetch_fsp_extension(handle, fsp);
+   if (data != NULL)
+   {
+      return data;
+   }
+   struct vfs_fsp_data *ext = talloc_zero_size(handle->conn, SHIM_EXT_HDR + ext_size);
+   if (ext == NULL)
+   {
+      return NULL;
+   }
+   ext->owner = handle;
+   ext->destroy = destroy_fn;
+   ext->next = fsp->vfs_extension;
+   fsp->vfs_extension = ext;
+   return SHIM_EXT_DATA(ext);
+}
+
+
+
+void *vfs_fetch_fsp_extension(vfs_handle_struct *handle, const files_struct *fsp)
+{
+   for (struct vfs_fsp_data *ext = fsp->vfs_extension; ext != NULL; ext = ext->next)
+   {
+      if (ext->owner == handle)
+      {
+         return SHIM_EXT_DATA(ext);
+      }
+   }
+   return NULL;
+}
+
+
+
+void vfs_remove_fsp_extension(vfs_handle_struct *handle, files_struct *fsp)
+{
+   for (struct vfs_fsp_data **ext = &fsp->vfs_extension; *ext != NULL; ext = &(*ext)->next)
+   {
+      if ((*ext)->owner == handle)
+      {
+         struct vfs_fsp_data *remove = *ext;
+         *ext = remove->next;
+         if (remove->destroy != NULL)
+         {
+            remove->destroy(SHIM_EXT_DATA(remove));
+         }
+         talloc_free(remove);
+         return;
+      }
+   }
+}
+
+
+
+/*
+ * The module below, modelled after vfs_default.
+ */
+static int shim_default_connect(vfs_handle_struct *handle, const char *service, const char *user)
+{
+   return 0;
+}
+
+
+
+static void shim_default_disconnect(vfs_handle_struct *handle)
+{
+}
+
+
+
+static int shim_default_openat(vfs_handle_struct *handle, const struct files_struct *dirfsp,
+      const struct smb_filename *smb_fname, files_struct *fsp, int flags, mode_t mode)
+{
+   return openat((dirfsp != NULL) ? fsp_get_pathref_fd(dirfsp) : AT_FDCWD, smb_fname->base_name, flags, mode);
+}
+
+
+
+static int shim_default_close(vfs_handle_struct *handle, files_struct *fsp)
+{
+   const int ret = close(fsp->fd);
+   fsp->fd = -1;
+   return ret;
+}
+
+
+
+static ssize_t shim_default_pread(vfs_handle_struct *handle, files_struct *fsp, void *data, size_t n, off_t offset)
+{
+   ssize_t ret;
+   do
+   {
+      ret = pread(fsp_get_io_fd(fsp), data, n, offset);
+   } while ((ret < 0) && (errno == EINTR));
+   return ret;
+}
+
+
+
+static ssize_t shim_default_pwrite(vfs_handle_struct *handle, files_struct *fsp, const void *data, size_t n,
+      off_t offset)
+{
+   ssize_t ret;
+   do
+   {
+      ret = pwrite(fsp_get_io_fd(fsp), data, n, offset);
+   } while ((ret < 0) && (errno == EINTR));
+   return ret;
+}
+
+
+
+//like sys_sendfile: header (corked), then the file range via sendfile(2)
+static ssize_t shim_default_sendfile(vfs_handle_struct *handle, int tofd, files_struct *fromfsp,
+      const DATA_BLOB *header, off_t offset, size_t count)
+{
+   size_t done = 0;
+   while ((header != NULL) && (done < header->length))
+   {
+      const ssize_t ret = send(tofd, header->data + done, header->length - done, MSG_MORE);
+      if (ret < 0)
+      {
+         return -1;
+      }
+      done += (size_t)ret;
+   }
+   size_t left = count;
+   while (left > 0)
+   {
+      const ssize_t ret = sendfile(tofd, fsp_get_io_fd(fromfsp), &offset, left);
+      if ((ret < 0) && (errno == EINTR))
+      {
+         continue;
+      }
+      if (ret < 0)
+      {
+         return -1;
+      }
+      if (ret == 0)
+      {
+         break; //end of file
+      }
+      left -= (size_t)ret;
+   }
+   return (ssize_t)(done + count - left);
+}
+
+
+
+struct shim_default_io_state {
+   struct tevent_req *req; //NULL, when the request was freed while the job was in flight
+   bool write;
+   int fd;
+   void *buf;
+   size_t count;
+   off_t offset;
+   ssize_t ret;
+   struct vfs_aio_state vfs_aio_state;
+};
+
+
+
+static void shim_default_io_do(void *private_data)
+{
+   struct shim_default_io_state *state = (struct shim_default_io_state *)private_data;
+   struct timespec start, end;
+   PROFILE_TIMESTAMP(&start);
+   if (state->write && (shim_write_delay > 0))
+   {
+      usleep(shim_write_delay);
+   }
+   do
+   {
+      state->ret = state->write ? pwrite(state->fd, state->buf, state->count, state->offset)
+            : pread(state->fd, state->buf, state->count, state->offset);
+   } while ((state->ret < 0) && (errno == EINTR));
+   if (state->ret == -1)
+   {
+      state->vfs_aio_state.error = errno;
+   }
+   PROFILE_TIMESTAMP(&end);
+   state->vfs_aio_state.duration = nsec_time_diff(&end, &start);
+}
+
+
+
+static int shim_default_io_state_destructor(struct shim_default_io_state *state)
+{
+   //in flight: the job would write to the state. deny, and free it when the job is done
+   state->req = NULL;
+   return -1;
+}
+
+
+
+static void shim_default_io_done(struct tevent_req *subreq)
+{
+   struct shim_default_io_state *state = tevent_req_callback_data(subreq, struct shim_default_io_state);
+   struct tevent_req *req = state->req;
+
+   const int ret = pthreadpool_tevent_job_recv(subreq);
+   TALLOC_FREE(subreq);
+   talloc_set_destructor(state, NULL);
+   if (req == NULL)
+   {
+      TALLOC_FREE(state);
+      return;
+   }
+   if (ret != 0)
+   {
+      if (ret != EAGAIN)
+      {
+         tevent_req_error(req, ret);
+         return;
+      }
+      shim_default_io_do(state);
+   }
+   if (state->ret == -1)
+   {
+      tevent_req_error(req, state->vfs_aio_state.error);
+      return;
+   }
+   tevent_req_done(req);
+}
+
+
+
+static struct tevent_req *shim_default_io_send(vfs_handle_struct *handle, TALLOC_CTX *mem_ctx,
+      struct tevent_context *ev, files_struct *fsp, const bool write, void *data, size_t n, off_t offset)
+{
+   struct shim_default_io_state *state = NULL;
+   struct tevent_req *req = tevent_req_create(mem_ctx, &state, struct shim_default_io_state);
+   if (req == NULL)
+   {
+      return NULL;
+   }
+   state->req = req;
+   state->write = write;
+   state->fd = fsp_get_io_fd(fsp);
+   state->buf = data;
+   state->count = n;
+   state->offset = offset;
+
+   struct tevent_req *subreq = pthreadpool_tevent_job_send(state, ev, handle->conn->sconn->pool,
+         shim_default_io_do, state);
+   if (tevent_req_nomem(subreq, req))
+   {
+      return tevent_req_post(req, ev);
+   }
+   tevent_req_set_callback(subreq, shim_default_io_done, state);
+   talloc_set_destructor(state, shim_default_io_state_destructor);
+   return req;
+}
+
+
+
+static ssize_t shim_default_io_recv(struct tevent_req *req, struct vfs_aio_state *vfs_aio_state)
+{
+   struct shim_default_io_state *state = tevent_req_data(req, struct shim_default_io_state);
+   if (tevent_req_is_unix_error(req, &vfs_aio_state->error))
+   {
+      tevent_req_received(req);
+      return -1;
+   }
+   *vfs_aio_state = state->vfs_aio_state;
+   const ssize_t ret = state->ret;
+   tevent_req_received(req);
+   return ret;
+}
+
+
+
+static struct tevent_req *shim_default_pread_send(vfs_handle_struct *handle, TALLOC_CTX *mem_ctx,
+      struct tevent_context *ev, files_struct *fsp, void *data, size_t n, off_t offset)
+{
+   return shim_default_io_send(handle, mem_ctx, ev, fsp, false, data, n, offset);
+}
+
+
+
+static struct tevent_req *shim_default_pwrite_send(vfs_handle_struct *handle, TALLOC_CTX *mem_ctx,
+      struct tevent_context *ev, files_struct *fsp, const void *data, size_t n, off_t offset)
+{
+   return shim_default_io_send(handle, mem_ctx, ev, fsp, true, (void *)data, n, offset);
+}
+
+
+
+static int shim_default_ftruncate(vfs_handle_struct *handle, files_struct *fsp, off_t offset)
+{
+   return ftruncate(fsp_get_io_fd(fsp), offset);
+}
+
+
+
+void init_stat_ex_from_stat(struct stat_ex *dst, const struct stat *src, bool fake_dir_create_times)
+{
+   dst->st_ex_dev = src->st_dev;
+   dst->st_ex_ino = src->st_ino;
+   dst->st_ex_mode = src->st_mode;
+   dst->st_ex_size = src->st_size;
+   dst->st_ex_blksize = src->st_blksize;
+   dst->st_ex_blocks = src->st_blocks;
+}
+
+
+
+static int shim_default_stat(vfs_handle_struct *handle, struct smb_filename *smb_fname)
+{
+   struct stat st;
+   const int ret = stat(smb_fname->base_name, &st);
+   if (ret == 0)
+   {
+      init_stat_ex_from_stat(&smb_fname->st, &st, false);
+   }
+   return ret;
+}
+
+
+
+static int shim_default_lstat(vfs_handle_struct *handle, struct smb_filename *smb_fname)
+{
+   struct stat st;
+   const int ret = lstat(smb_fname->base_name, &st);
+   if (ret == 0)
+   {
+      init_stat_ex_from_stat(&smb_fname->st, &st, false);
+   }
+   return ret;
+}
+
+
+
+static int shim_default_fstat(vfs_handle_struct *handle, files_struct *fsp, SMB_STRUCT_STAT *sbuf)
+{
+   struct stat st;
+   const int ret = fstat(fsp_get_io_fd(fsp), &st);
+   if (ret == 0)
+   {
+      init_stat_ex_from_stat(sbuf, &st, false);
+   }
+   return ret;
+}
+
+
+
+const struct vfs_fn_pointers shim_default_fns = {
+   .connect_fn = shim_default_connect,
+   .disconnect_fn = shim_default_disconnect,
+   .openat_fn = shim_default_openat,
+   .close_fn = shim_default_close,
+   .pread_fn = shim_default_pread,
+   .pread_send_fn = shim_default_pread_send,
+   .pread_recv_fn = shim_default_io_recv,
+   .sendfile_fn = shim_default_sendfile,
+   .pwrite_fn = shim_default_pwrite,
+   .pwrite_send_fn = shim_default_pwrite_send,
+   .pwrite_recv_fn = shim_default_io_recv,
+   .ftruncate_fn = shim_default_ftruncate,
+   .stat_fn = shim_default_stat,
+   .lstat_fn = shim_default_lstat,
+   .fstat_fn = shim_default_fstat
+};
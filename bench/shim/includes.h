@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shim of samba's includes.h, to build vfs_rdirect.c outside of the samba tree (see rdirect_bench.c).
+ *
+ * It provides just the parts of talloc, tevent, debug and loadparm the module uses, with the same names and
+ * semantics. The event loop is single threaded, like the one of an smbd process.
+ */
+#ifndef _SHIM_INCLUDES_H
+#define _SHIM_INCLUDES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define PRINTF_ATTRIBUTE(a, b) __attribute__((format(printf, a, b)))
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef uint32_t NTSTATUS;
+#define NT_STATUS_OK ((NTSTATUS)0)
+#define NT_STATUS_NO_MEMORY ((NTSTATUS)0xC0000017)
+
+typedef struct datablob {
+   uint8_t *data;
+   size_t length;
+} DATA_BLOB;
+
+static inline bool strequal(const char *s1, const char *s2)
+{
+   return ((s1 == NULL) || (s2 == NULL)) ? (s1 == s2) : (strcasecmp(s1, s2) == 0);
+}
+
+size_t shim_strlcpy(char *dest, const char *src, size_t size);
+#define strlcpy shim_strlcpy
+
+void smb_panic(const char *why) __attribute__((noreturn));
+
+//the benchmark runs with the privileges it was started with
+void become_root(void);
+void unbecome_root(void);
+
+/*
+ * Debug.
+ */
+extern int shim_debuglevel;
+void shim_dbgtext(const char *format, ...) PRINTF_ATTRIBUTE(1, 2);
+
+#define DEBUG(level, body) \
+   do { if ((level) <= shim_debuglevel) { shim_dbgtext body; } } while (0)
+
+/*
+ * Delay (in microseconds) of the writes of the default module, to race reads against writes in flight.
+ */
+extern unsigned int shim_write_delay;
+#define DBG_ERR(...)       DEBUG(0, (__VA_ARGS__))
+#define DBG_WARNING(...)   DEBUG(1, (__VA_ARGS__))
+#define DBG_NOTICE(...)    DEBUG(3, (__VA_ARGS__))
+#define DBG_INFO(...)      DEBUG(5, (__VA_ARGS__))
+#define DBG_DEBUG(...)     DEBUG(10, (__VA_ARGS__))
+
+/*
+ * Time.
+ */
+#define PROFILE_TIMESTAMP(x) clock_gettime(CLOCK_MONOTONIC, x)
+int64_t nsec_time_diff(const struct timespec *end, const struct timespec *start);
+
+/*
+ * talloc: hierarchical allocator with destructors.
+ * Freeing a chunk frees its children. A destructor returning -1 denies the free; a child denying it, is moved
+ * to the NULL context instead.
+ */
+typedef void TALLOC_CTX;
+
+void *_talloc_zero(const void *ctx, size_t size);
+int talloc_free(void *ptr);
+void _talloc_set_destructor(const void *ptr, int (*destructor)(void *));
+void *talloc_parent(const void *ptr);
+
+#define talloc_zero(ctx, type) ((type *)_talloc_zero((ctx), sizeof(type)))
+#define talloc_zero_size(ctx, size) _talloc_zero((ctx), (size))
+#define talloc_zero_array(ctx, type, count) ((type *)_talloc_zero((ctx), sizeof(type) * (count)))
+#define talloc_array(ctx, type, count) talloc_zero_array((ctx), type, (count))
+#define talloc_new(ctx) _talloc_zero((ctx), 0)
+#define talloc_set_destructor(ptr, function) \
+   _talloc_set_destructor((ptr), (int (*)(void *))(function))
+#define talloc_get_type_abort(ptr, type) ((type *)(ptr))
+#define TALLOC_FREE(ctx) do { if ((ctx) != NULL) { talloc_free(ctx); (ctx) = NULL; } } while (0)
+
+/*
+ * tevent: event loop (fd events, timers and immediates) and async requests.
+ */
+struct tevent_context;
+struct tevent_fd;
+struct tevent_timer;
+struct tevent_req;
+
+#define TEVENT_FD_READ 1
+#define TEVENT_FD_WRITE 2
+
+enum tevent_req_state {
+   TEVENT_REQ_INIT,
+   TEVENT_REQ_IN_PROGRESS,
+   TEVENT_REQ_DONE,
+   TEVENT_REQ_USER_ERROR,
+   TEVENT_REQ_TIMED_OUT,
+   TEVENT_REQ_NO_MEMORY,
+   TEVENT_REQ_RECEIVED
+};
+
+typedef void (*tevent_fd_handler_t)(struct tevent_context *ev, struct tevent_fd *fde, uint16_t flags,
+      void *private_data);
+typedef void (*tevent_timer_handler_t)(struct tevent_context *ev, struct tevent_timer *te,
+      struct timeval current_time, void *private_data);
+typedef void (*tevent_req_fn)(struct tevent_req *req);
+typedef void (*tevent_req_cleanup_fn)(struct tevent_req *req, enum tevent_req_state req_state);
+typedef bool (*tevent_req_cancel_fn)(struct tevent_req *req);
+
+struct tevent_context *tevent_context_init(TALLOC_CTX *mem_ctx);
+int tevent_loop_once(struct tevent_context *ev);
+struct tevent_fd *tevent_add_fd(struct tevent_context *ev, TALLOC_CTX *mem_ctx, int fd, uint16_t flags,
+      tevent_fd_handler_t handler, void *private_data);
+struct tevent_timer *tevent_add_timer(struct tevent_context *ev, TALLOC_CTX *mem_ctx, struct timeval next_event,
+      tevent_timer_handler_t handler, void *private_data);
+struct timeval tevent_timeval_current_ofs(uint32_t secs, uint32_t usecs);
+
+struct tevent_req *_tevent_req_create(TALLOC_CTX *mem_ctx, void *pstate, size_t state_size);
+void *_tevent_req_data(struct tevent_req *req);
+void *_tevent_req_callback_data(struct tevent_req *req);
+void tevent_req_set_callback(struct tevent_req *req, tevent_req_fn fn, void *pvt);
+void tevent_req_set_cleanup_fn(struct tevent_req *req, tevent_req_cleanup_fn fn);
+void tevent_req_set_cancel_fn(struct tevent_req *req, tevent_req_cancel_fn fn);
+bool tevent_req_cancel(struct tevent_req *req);
+void tevent_req_done(struct tevent_req *req);
+bool tevent_req_error(struct tevent_req *req, uint64_t error);
+bool tevent_req_nomem(const void *p, struct tevent_req *req);
+struct tevent_req *tevent_req_post(struct tevent_req *req, struct tevent_context *ev);
+void tevent_req_defer_callback(struct tevent_req *req, struct tevent_context *ev);
+bool tevent_req_is_in_progress(struct tevent_req *req);
+bool tevent_req_is_error(struct tevent_req *req, enum tevent_req_state *state, uint64_t *error);
+void tevent_req_received(struct tevent_req *req);
+
+#define tevent_req_create(mem_ctx, pstate, type) _tevent_req_create((mem_ctx), (pstate), sizeof(type))
+#define tevent_req_data(req, type) ((type *)_tevent_req_data(req))
+#define tevent_req_callback_data(req, type) ((type *)_tevent_req_callback_data(req))
+
+/*
+ * loadparm: parametric options (`type:option = value`) of the one and only share (snum 0).
+ */
+struct enum_list {
+   int value;
+   const char *name;
+};
+
+void shim_set_parm(const char *name, const char *value);
+void shim_clear_parms(void);
+
+const char *lp_parm_const_string(int snum, const char *type, const char *option, const char *def);
+const char **lp_parm_string_list(int snum, const char *type, const char *option, const char **def);
+int lp_parm_int(int snum, const char *type, const char *option, int def);
+bool lp_parm_bool(int snum, const char *type, const char *option, bool def);
+int lp_parm_enum(int snum, const char *type, const char *option, const struct enum_list *_enum, int def);
+const char *lp_const_servicename(int snum);
+bool conv_str_size_error(const char *str, uint64_t *val);
+
+#endif /* _SHIM_INCLUDES_H */
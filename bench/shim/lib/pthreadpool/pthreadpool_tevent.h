@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shim of samba's lib/pthreadpool/pthreadpool_tevent.h (see ../../includes.h).
+ * Jobs are run by worker threads, their completion is signalled to the event loop the first job was sent with.
+ */
+#ifndef _SHIM_PTHREADPOOL_TEVENT_H
+#define _SHIM_PTHREADPOOL_TEVENT_H
+
+#include "includes.h"
+
+struct pthreadpool_tevent;
+
+int pthreadpool_tevent_init(TALLOC_CTX *mem_ctx, unsigned max_threads, struct pthreadpool_tevent **presult);
+struct tevent_req *pthreadpool_tevent_job_send(TALLOC_CTX *mem_ctx, struct tevent_context *ev,
+      struct pthreadpool_tevent *pool, void (*fn)(void *private_data), void *private_data);
+int pthreadpool_tevent_job_recv(struct tevent_req *req);
+
+#endif /* _SHIM_PTHREADPOOL_TEVENT_H */
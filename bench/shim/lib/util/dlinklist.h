@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shim of samba's lib/util/dlinklist.h (see ../../includes.h), with the same semantics:
+ * the prev pointer of the list head points to the tail, the next pointer of the tail is NULL.
+ */
+#ifndef _SHIM_DLINKLIST_H
+#define _SHIM_DLINKLIST_H
+
+#define DLIST_ADD(list, p) \
+   do { \
+      if (!(list)) { \
+         (p)->prev = (list) = (p); \
+         (p)->next = NULL; \
+      } else { \
+         (p)->prev = (list)->prev; \
+         (list)->prev = (p); \
+         (p)->next = (list); \
+         (list) = (p); \
+      } \
+   } while (0)
+
+#define DLIST_REMOVE(list, p) \
+   do { \
+      if ((p) == (list)) { \
+         if ((p)->next) (p)->next->prev = (p)->prev; \
+         (list) = (p)->next; \
+      } else if ((list) && (p) == (list)->prev) { \
+         (p)->prev->next = NULL; \
+         (list)->prev = (p)->prev; \
+      } else { \
+         if ((p)->prev) (p)->prev->next = (p)->next; \
+         if ((p)->next) (p)->next->prev = (p)->prev; \
+      } \
+      if ((p) != (list)) (p)->next = (p)->prev = NULL; \
+   } while (0)
+
+#define DLIST_ADD_AFTER(list, p, el) \
+   do { \
+      if (!(list) || !(el)) { \
+         DLIST_ADD(list, p); \
+      } else { \
+         (p)->prev = (el); \
+         (p)->next = (el)->next; \
+         (el)->next = (p); \
+         if ((p)->next) (p)->next->prev = (p); \
+         if ((list)->prev == (el)) (list)->prev = (p); \
+      } \
+   } while (0)
+
+#define DLIST_ADD_END(list, p) \
+   do { \
+      if (!(list)) { \
+         DLIST_ADD(list, p); \
+      } else { \
+         DLIST_ADD_AFTER(list, p, (list)->prev); \
+      } \
+   } while (0)
+
+#endif /* _SHIM_DLINKLIST_H */
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+//shim of samba's lib/util/tevent_unix.h (see ../../includes.h)
+#ifndef _SHIM_TEVENT_UNIX_H
+#define _SHIM_TEVENT_UNIX_H
+
+#include "includes.h"
+
+//get the errno of a failed request. Returns false, if the request didn't fail
+bool tevent_req_is_unix_error(struct tevent_req *req, int *perrno);
+
+#endif /* _SHIM_TEVENT_UNIX_H */
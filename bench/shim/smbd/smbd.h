@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shim of samba's smbd/smbd.h: connections, file handles and the VFS interface, as far as vfs_rdirect uses them.
+ *
+ * There is a single module below the module under test, which is modelled after vfs_default:
+ * SMB_VFS_NEXT_* calls go to it directly. Its operations are also available as `shim_default_fns`, to measure
+ * the baseline with.
+ */
+#ifndef _SHIM_SMBD_H
+#define _SHIM_SMBD_H
+
+#include "includes.h"
+#include <sys/stat.h>
+
+#define SMB_VFS_INTERFACE_VERSION 45
+
+struct pthreadpool_tevent;
+
+struct smbd_server_connection {
+   struct tevent_context *ev_ctx;
+   struct pthreadpool_tevent *pool; //worker threads for asynchronous I/O
+};
+
+struct share_params {
+   int service;
+};
+
+typedef struct connection_struct {
+   struct smbd_server_connection *sconn;
+   struct share_params *params;
+   bool read_only; //share is read only for the user
+} connection_struct;
+
+#define SNUM(conn) ((conn)->params->service)
+
+typedef struct vfs_handle_struct {
+   connection_struct *conn;
+   void *data; //module's private data
+   void (*free_data)(void **data);
+} vfs_handle_struct;
+
+struct file_id {
+   uint64_t devid;
+   uint64_t inode;
+   uint64_t extid;
+};
+
+static inline bool file_id_equal(const struct file_id *id1, const struct file_id *id2)
+{
+   return (id1->devid == id2->devid) && (id1->inode == id2->inode) && (id1->extid == id2->extid);
+}
+
+//samba's stat, as far as used (see init_stat_ex_from_stat)
+typedef struct stat_ex {
+   dev_t st_ex_dev;
+   ino_t st_ex_ino;
+   mode_t st_ex_mode;
+   off_t st_ex_size;
+   blksize_t st_ex_blksize;
+   blkcnt_t st_ex_blocks;
+} SMB_STRUCT_STAT;
+
+void init_stat_ex_from_stat(struct stat_ex *dst, const struct stat *src, bool fake_dir_create_times);
+
+struct smb_filename {
+   char *base_name;
+   SMB_STRUCT_STAT st;
+};
+
+struct vfs_fsp_data;
+
+typedef struct files_struct {
+   connection_struct *conn;
+   struct smb_filename *fsp_name;
+   struct file_id file_id;
+   int fd;
+   struct {
+      bool is_directory;
+      bool can_read;
+      bool can_write;
+   } fsp_flags;
+   struct vfs_fsp_data *vfs_extension;
+} files_struct;
+
+static inline int fsp_get_io_fd(const files_struct *fsp)
+{
+   return fsp->fd;
+}
+
+static inline int fsp_get_pathref_fd(const files_struct *fsp)
+{
+   return fsp->fd;
+}
+
+static inline const char *fsp_str_dbg(const files_struct *fsp)
+{
+   return fsp->fsp_name->base_name;
+}
+
+struct vfs_aio_state {
+   int error;
+   uint64_t duration;
+};
+
+/*
+ * VFS operations (the ones vfs_rdirect implements).
+ */
+struct vfs_fn_pointers {
+   int (*connect_fn)(struct vfs_handle_struct *handle, const char *service, const char *user);
+   void (*disconnect_fn)(struct vfs_handle_struct *handle);
+   int (*openat_fn)(struct vfs_handle_struct *handle, const struct files_struct *dirfsp,
+         const struct smb_filename *smb_fname, struct files_struct *fsp, int flags, mode_t mode);
+   int (*close_fn)(struct vfs_handle_struct *handle, struct files_struct *fsp);
+   ssize_t (*pread_fn)(struct vfs_handle_struct *handle, struct files_struct *fsp, void *data, size_t n,
+         off_t offset);
+   struct tevent_req *(*pread_send_fn)(struct vfs_handle_struct *handle, TALLOC_CTX *mem_ctx,
+         struct tevent_context *ev, struct files_struct *fsp, void *data, size_t n, off_t offset);
+   ssize_t (*pread_recv_fn)(struct tevent_req *req, struct vfs_aio_state *state);
+   ssize_t (*sendfile_fn)(struct vfs_handle_struct *handle, int tofd, struct files_struct *fromfsp,
+         const DATA_BLOB *header, off_t offset, size_t count);
+   ssize_t (*pwrite_fn)(struct vfs_handle_struct *handle, struct files_struct *fsp, const void *data, size_t n,
+         off_t offset);
+   struct tevent_req *(*pwrite_send_fn)(struct vfs_handle_struct *handle, TALLOC_CTX *mem_ctx,
+         struct tevent_context *ev, struct files_struct *fsp, const void *data, size_t n, off_t offset);
+   ssize_t (*pwrite_recv_fn)(struct tevent_req *req, struct vfs_aio_state *state);
+   int (*ftruncate_fn)(struct vfs_handle_struct *handle, struct files_struct *fsp, off_t offset);
+   int (*stat_fn)(struct vfs_handle_struct *handle, struct smb_filename *smb_fname);
+   int (*lstat_fn)(struct vfs_handle_struct *handle, struct smb_filename *smb_fname);
+   int (*fstat_fn)(struct vfs_handle_struct *handle, struct files_struct *fsp, SMB_STRUCT_STAT *sbuf);
+};
+
+NTSTATUS smb_register_vfs(int version, const char *name, const struct vfs_fn_pointers *fns);
+const struct vfs_fn_pointers *shim_find_vfs(const char *name);
+
+//the module's init function (declared by the samba build system)
+#define static_decl_vfs NTSTATUS vfs_rdirect_init(TALLOC_CTX *ctx)
+
+/*
+ * The module below ("vfs_default").
+ */
+extern const struct vfs_fn_pointers shim_default_fns;
+
+#define SMB_VFS_NEXT_CONNECT(handle, service, user) \
+   shim_default_fns.connect_fn((handle), (service), (user))
+#define SMB_VFS_NEXT_DISCONNECT(handle) \
+   shim_default_fns.disconnect_fn((handle))
+#define SMB_VFS_NEXT_OPENAT(handle, dirfsp, smb_fname, fsp, flags, mode) \
+   shim_default_fns.openat_fn((handle), (dirfsp), (smb_fname), (fsp), (flags), (mode))
+#define SMB_VFS_NEXT_CLOSE(handle, fsp) \
+   shim_default_fns.close_fn((handle), (fsp))
+#define SMB_VFS_NEXT_PREAD(handle, fsp, data, n, offset) \
+   shim_default_fns.pread_fn((handle), (fsp), (data), (n), (offset))
+#define SMB_VFS_NEXT_PREAD_SEND(mem_ctx, ev, handle, fsp, data, n, offset) \
+   shim_default_fns.pread_send_fn((handle), (mem_ctx), (ev), (fsp), (data), (n), (offset))
+#define SMB_VFS_PREAD_RECV(req, state) \
+   shim_default_fns.pread_recv_fn((req), (state))
+#define SMB_VFS_NEXT_SENDFILE(handle, tofd, fromfsp, header, offset, count) \
+   shim_default_fns.sendfile_fn((handle), (tofd), (fromfsp), (header), (offset), (count))
+#define SMB_VFS_NEXT_PWRITE(handle, fsp, data, n, offset) \
+   shim_default_fns.pwrite_fn((handle), (fsp), (data), (n), (offset))
+#define SMB_VFS_NEXT_PWRITE_SEND(mem_ctx, ev, handle, fsp, data, n, offset) \
+   shim_default_fns.pwrite_send_fn((handle), (mem_ctx), (ev), (fsp), (data), (n), (offset))
+#define SMB_VFS_PWRITE_RECV(req, state) \
+   shim_default_fns.pwrite_recv_fn((req), (state))
+#define SMB_VFS_NEXT_FTRUNCATE(handle, fsp, offset) \
+   shim_default_fns.ftruncate_fn((handle), (fsp), (offset))
+#define SMB_VFS_NEXT_STAT(handle, smb_fname) \
+   shim_default_fns.stat_fn((handle), (smb_fname))
+#define SMB_VFS_NEXT_LSTAT(handle, smb_fname) \
+   shim_default_fns.lstat_fn((handle), (smb_fname))
+#define SMB_VFS_NEXT_FSTAT(handle, fsp, sbuf) \
+   shim_default_fns.fstat_fn((handle), (fsp), (sbuf))
+
+/*
+ * Module data.
+ */
+#define SMB_VFS_HANDLE_GET_DATA(handle, datap, type, ret) \
+   do { \
+      if ((handle)->data == NULL) { \
+         DEBUG(0, ("%s() failed to get vfs_handle->data!\n", __func__)); \
+         ret; \
+      } else { \
+         (datap) = (type *)(handle)->data; \
+      } \
+   } while (0)
+
+#define SMB_VFS_HANDLE_SET_DATA(handle, datap, free_fn, type, ret) \
+   do { \
+      (handle)->data = (void *)(datap); \
+      (handle)->free_data = (free_fn); \
+   } while (0)
+
+void *vfs_add_fsp_extension_notype(vfs_handle_struct *handle, files_struct *fsp, size_t ext_size,
+      void (*destroy_fn)(void *p_data));
+void *vfs_fetch_fsp_extension(vfs_handle_struct *handle, const files_struct *fsp);
+void vfs_remove_fsp_extension(vfs_handle_struct *handle, files_struct *fsp);
+
+#define VFS_ADD_FSP_EXTENSION(handle, fsp, type, destroy_fn) \
+   ((type *)vfs_add_fsp_extension_notype((handle), (fsp), sizeof(type), (destroy_fn)))
+#define VFS_FETCH_FSP_EXTENSION(handle, fsp) vfs_fetch_fsp_extension((handle), (fsp))
+#define VFS_REMOVE_FSP_EXTENSION(handle, fsp) vfs_remove_fsp_extension((handle), (fsp))
+
+#endif /* _SHIM_SMBD_H */
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+//shim of samba's system/filesys.h (see ../includes.h)
+#ifndef _SHIM_SYSTEM_FILESYS_H
+#define _SHIM_SYSTEM_FILESYS_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#endif /* _SHIM_SYSTEM_FILESYS_H */
@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Copyright (c) Manuel Heiss 2021
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, see <http://www.gnu.org/licenses/>.
+#
+# Compares two results files of run.sh (e.g. of the installed and of a new module version).
+#
+# Prints the change of each metric per profile and client count, and flags a regression where throughput or
+# IOPS drop, or the CPU time per GiB or p99 latency rise, by more than the threshold (default 5%).
+# Exits with 1 if there is a regression, so it can gate an upgrade.
+#
+set -euo pipefail
+
+if [ $# -lt 2 ] || [ $# -gt 3 ]; then
+   echo "usage: $0 <old results> <new results> [threshold in %]" >&2
+   exit 2
+fi
+
+awk -F '\t' -v threshold="${3:-5}" '
+   function change(old, new) {
+      return (old == 0) ? 0 : (new - old) * 100.0 / old
+   }
+   /^#/ || $1 == "profile" {
+      next
+   }
+   FNR == NR {
+      old[$1 "\t" $2] = $0
+      next
+   }
+   {
+      key = $1 "\t" $2
+      if (!(key in old)) {
+         printf "%-14s %4d  (no old result)\n", $1, $2
+         next
+      }
+      split(old[key], o, "\t")
+      mbs = change(o[3], $3); iops = change(o[4], $4); p99 = change(o[5], $5); cpu = change(o[6], $6)
+      regression = (mbs < -threshold) || (iops < -threshold) || (p99 > threshold) || (cpu > threshold)
+      printf "%-14s %4d  MiB/s %+6.1f%%  IOPS %+6.1f%%  p99 %+6.1f%%  cpu/GiB %+6.1f%%  cache %+.0f MiB%s\n",
+            $1, $2, mbs, iops, p99, cpu, $7 - o[7], regression ? "  REGRESSION" : ""
+      regressions += regression
+   }
+   END {
+      if (regressions > 0) {
+         printf "%d regression(s) above %s%%\n", regressions, threshold
+         exit 1
+      }
+   }
+' "$1" "$2"
@@ -0,0 +1,227 @@
+#!/bin/bash
+#
+# Copyright (c) Manuel Heiss 2021
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, see <http://www.gnu.org/licenses/>.
+#
+# End-to-end throughput test of an rdirect share.
+#
+# Brings up a private smbd with a share on the directory given (`vfs objects = rdirect`, or none with -B for
+# the baseline), mounts it via cifs over loopback once per client (separate SMB connections, so each client is
+# served by an smbd process of its own), and runs the fio profiles of e2e/profiles at each client count.
+# For each run, it records throughput, IOPS, p99 latency, the CPU time of all smbd processes per GiB transferred,
+# and the growth of the page cache (Cached in /proc/meminfo). Caches are dropped before each run.
+#
+# The results are written as a tab separated table (one line per profile and client count), which can be
+# compared between module versions with e2e/compare.sh.
+#
+# Requires root, fio, cifs-utils and python3.
+#
+set -euo pipefail
+
+E2E_DIR="$(cd "$(dirname "$0")" && pwd)"
+
+SAMBA="/usr/local/samba"
+SHARE=""
+RESULTS=""
+LABEL="rdirect"
+CLIENTS="1,4,16"
+RUNTIME=30
+SIZE="4G"
+PORT=4455
+BASELINE=0
+PROFILES="seqread randread-4k randread-64k readmix"
+OPTIONS=()
+
+usage()
+{
+   cat >&2 <<EOF
+usage: $0 -d <share dir> -r <results file> [options]
+  -d <dir>       directory to share (on the device under test)
+  -r <file>      results file to write
+  -s <prefix>    samba installation (default $SAMBA)
+  -o <option>    share option, e.g. -o 'rdirect:readahead = 4' (repeatable)
+  -B             baseline: share without vfs_rdirect
+  -c <counts>    client counts (default $CLIENTS)
+  -p <profiles>  profiles of e2e/profiles (default "$PROFILES")
+  -t <seconds>   runtime of each run (default $RUNTIME)
+  -S <size>      size of the file of each client (default $SIZE)
+  -P <port>      port of the private smbd (default $PORT)
+  -l <label>     label of the results (default $LABEL)
+EOF
+   exit 1
+}
+
+while getopts "d:r:s:o:Bc:p:t:S:P:l:h" opt; do
+   case "$opt" in
+   d) SHARE="$(realpath "$OPTARG")" ;;
+   r) RESULTS="$OPTARG" ;;
+   s) SAMBA="$OPTARG" ;;
+   o) OPTIONS+=("$OPTARG") ;;
+   B) BASELINE=1 ;;
+   c) CLIENTS="$OPTARG" ;;
+   p) PROFILES="$OPTARG" ;;
+   t) RUNTIME="$OPTARG" ;;
+   S) SIZE="$OPTARG" ;;
+   P) PORT="$OPTARG" ;;
+   l) LABEL="$OPTARG" ;;
+   *) usage ;;
+   esac
+done
+[ -n "$SHARE" ] && [ -n "$RESULTS" ] || usage
+[ "$(id -u)" -eq 0 ] || { echo "$0: must be run as root" >&2; exit 1; }
+for tool in fio mount.cifs python3; do
+   command -v "$tool" >/dev/null || { echo "$0: $tool not found" >&2; exit 1; }
+done
+
+WORKDIR="$(mktemp -d /tmp/rdirect-e2e.XXXXXX)"
+PASSWORD="rdirect-e2e"
+MAX_CLIENTS=$(tr ',' '\n' <<<"$CLIENTS" | sort -n | tail -1)
+SMBD_PID=""
+
+cleanup()
+{
+   local mounted=0 mnt
+   for mnt in "$WORKDIR"/mnt/*; do
+      if mountpoint -q "$mnt" && ! umount "$mnt"; then
+         mounted=1
+      fi
+   done
+   [ -n "$SMBD_PID" ] && kill "$SMBD_PID" 2>/dev/null || true
+   # never remove the working directory recursively while the share is still mounted in it
+   if [ "$mounted" -eq 0 ]; then
+      rm -rf "$WORKDIR"
+   else
+      echo "$0: $WORKDIR is still mounted, not removed" >&2
+   fi
+}
+trap cleanup EXIT
+
+#
+# Server.
+#
+mkdir -p "$WORKDIR"/{run,lock,state,cache,private,mnt}
+if [ "$BASELINE" -eq 1 ]; then
+   VFS_OBJECTS=""
+else
+   VFS_OBJECTS="rdirect"
+fi
+SHARE_OPTIONS=""
+for option in "${OPTIONS[@]+"${OPTIONS[@]}"}"; do
+   SHARE_OPTIONS+="   $option"$'\n'
+done
+python3 - "$E2E_DIR/smb.conf.in" "$WORKDIR/smb.conf" "$PORT" "$WORKDIR" "$SHARE" "$VFS_OBJECTS" \
+      "$SHARE_OPTIONS" <<'EOF'
+import sys
+text = open(sys.argv[1]).read()
+for key, value in zip(("@PORT@", "@WORKDIR@", "@SHARE@", "@VFS_OBJECTS@", "@OPTIONS@"), sys.argv[3:]):
+    text = text.replace(key, value)
+open(sys.argv[2], "w").write(text)
+EOF
+
+printf '%s\n%s\n' "$PASSWORD" "$PASSWORD" | "$SAMBA/bin/smbpasswd" -c "$WORKDIR/smb.conf" -s -a root >/dev/null
+"$SAMBA/sbin/smbd" -D -s "$WORKDIR/smb.conf"
+for _ in $(seq 50); do
+   [ -s "$WORKDIR/run/smbd-smb.conf.pid" ] || [ -s "$WORKDIR/run/smbd.pid" ] && break
+   sleep 0.1
+done
+SMBD_PID="$(cat "$WORKDIR"/run/smbd*.pid)"
+
+#
+# Clients: one mount (and SMB connection) per client.
+#
+DIRECTORIES=()
+for i in $(seq 0 $((MAX_CLIENTS - 1))); do
+   mkdir -p "$WORKDIR/mnt/$i"
+   mount -t cifs "//127.0.0.1/rdirect" "$WORKDIR/mnt/$i" \
+      -o "username=root,password=$PASSWORD,port=$PORT,vers=3.1.1,cache=none,nosharesock"
+   mkdir -p "$WORKDIR/mnt/$i/client$i"
+   DIRECTORIES+=("$WORKDIR/mnt/$i/client$i")
+done
+
+#
+# Sampling.
+#
+# CPU time [clock ticks] of all smbd processes
+smbd_ticks()
+{
+   local total=0 pid stat
+   for pid in $(pgrep -x smbd); do
+      stat="$(cat "/proc/$pid/stat" 2>/dev/null)" || continue
+      stat="${stat##*) }" # the command may contain blanks
+      set -- $stat
+      total=$((total + ${12} + ${13})) # utime and stime (fields 14 and 15)
+   done
+   echo "$total"
+}
+
+# page cache [KiB]
+cached_kib()
+{
+   awk '$1 == "Cached:" { print $2 }' /proc/meminfo
+}
+
+drop_caches()
+{
+   sync
+   echo 3 > /proc/sys/vm/drop_caches
+}
+
+#
+# Runs.
+#
+{
+   echo "# label: $LABEL"
+   echo "# date: $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+   echo "# module: $(git -C "$E2E_DIR" describe --always --dirty 2>/dev/null || echo unknown)"
+   echo "# vfs objects: ${VFS_OBJECTS:-none}"
+   for option in "${OPTIONS[@]+"${OPTIONS[@]}"}"; do
+      echo "# option: $option"
+   done
+   echo "# runtime: ${RUNTIME}s, size: $SIZE per client"
+   printf 'profile\tclients\tMiB/s\tIOPS\tp99[us]\tcpu[ms/GiB]\tcache[MiB]\n'
+} > "$RESULTS"
+
+TICKS_PER_SECOND="$(getconf CLK_TCK)"
+for profile in $PROFILES; do
+   for clients in ${CLIENTS//,/ }; do
+      directory="$(IFS=:; echo "${DIRECTORIES[*]:0:$clients}")"
+      # lay out the files first, so the run reads existing data
+      RUNTIME="$RUNTIME" SIZE="$SIZE" fio --directory="$directory" --numjobs="$clients" --create_only=1 \
+         "$E2E_DIR/profiles/$profile.fio" >/dev/null
+      drop_caches
+      ticks=$(smbd_ticks)
+      cached=$(cached_kib)
+      RUNTIME="$RUNTIME" SIZE="$SIZE" fio --directory="$directory" --numjobs="$clients" \
+         --output-format=json --output="$WORKDIR/fio.json" "$E2E_DIR/profiles/$profile.fio"
+      ticks=$(( $(smbd_ticks) - ticks ))
+      cached=$(( $(cached_kib) - cached ))
+      python3 - "$WORKDIR/fio.json" "$profile" "$clients" "$ticks" "$TICKS_PER_SECOND" "$cached" \
+            >> "$RESULTS" <<'EOF'
+import json, sys
+fio = json.load(open(sys.argv[1]))
+profile, clients, ticks, tps, cached = sys.argv[2], int(sys.argv[3]), int(sys.argv[4]), int(sys.argv[5]), int(sys.argv[6])
+job = fio["jobs"][0]
+read, write = job["read"], job["write"]
+bytes = read["io_bytes"] + write["io_bytes"]
+runtime = max(read["runtime"], write["runtime"]) / 1000.0
+percentiles = read.get("clat_ns", {}).get("percentile", {})
+p99 = percentiles.get("99.000000", 0) / 1000.0
+cpu = (ticks * 1000.0 / tps) / (bytes / 2**30) if bytes else 0.0
+print("%s\t%d\t%.1f\t%.0f\t%.0f\t%.1f\t%.0f" % (profile, clients, bytes / 2**20 / runtime,
+      read["iops"] + write["iops"], p99, cpu, cached / 1024.0))
+EOF
+      tail -1 "$RESULTS"
+   done
+done
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Dump the statistics of vfs_rdirect (`rdirect:stats = yes`), in the Prometheus text format.
+ *
+ * Build: cc -O2 -o rdirect_stats rdirect_stats.c
+ * Usage: rdirect_stats [share]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../vfs_rdirect_stats.h"
+
+static const char * const counterNames[] = {
+#define RDIRECT_STATS_NAME_OF(id, name) name,
+   RDIRECT_STATS_COUNTERS(RDIRECT_STATS_NAME_OF)
+#undef RDIRECT_STATS_NAME_OF
+};
+
+static const char * const engineNames[] = RDIRECT_STATS_ENGINE_NAMES;
+
+
+
+static uint64_t load(const uint64_t * const value)
+{
+   return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+
+
+static void dump(const struct rdirect_stats * const stats)
+{
+   for (unsigned int i = 0; i < RDIRECT_STATS_NUM_COUNTERS; ++i)
+   {
+      printf("rdirect_%s{share=\"%s\"} %llu\n", counterNames[i], stats->share,
+            (unsigned long long)load(&stats->counters[i]));
+   }
+
+   //cumulative buckets. the upper bound of bucket i is 2^(i+1) us
+   for (unsigned int e = 0; e < RDIRECT_STATS_ENGINES; ++e)
+   {
+      uint64_t count = 0;
+      for (unsigned int b = 0; b < RDIRECT_STATS_BUCKETS; ++b)
+      {
+         count += load(&stats->latency[e][b]);
+         if (b + 1 < RDIRECT_STATS_BUCKETS)
+         {
+            printf("rdirect_read_latency_us_bucket{share=\"%s\",engine=\"%s\",le=\"%llu\"} %llu\n",
+                  stats->share, engineNames[e], 1ULL << (b + 1), (unsigned long long)count);
+         }
+      }
+      printf("rdirect_read_latency_us_bucket{share=\"%s\",engine=\"%s\",le=\"+Inf\"} %llu\n",
+            stats->share, engineNames[e], (unsigned long long)count);
+      printf("rdirect_read_latency_us_count{share=\"%s\",engine=\"%s\"} %llu\n",
+            stats->share, engineNames[e], (unsigned long long)count);
+   }
+}
+
+
+
+int main(int argc, char *argv[])
+{
+   const char *share = (argc > 1) ? argv[1] : NULL;
+
+   const int fd = shm_open(RDIRECT_STATS_NAME, O_RDONLY, 0);
+   if (fd < 0)
+   {
+      fprintf(stderr, "rdirect_stats: no statistics (%s): %s\n", RDIRECT_STATS_NAME, strerror(errno));
+      return 1;
+   }
+   const struct rdirect_stats_segment *segment = mmap(NULL, sizeof(*segment), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if ((segment == MAP_FAILED) || (segment->magic != RDIRECT_STATS_MAGIC)
+         || (segment->numShares != RDIRECT_STATS_SHARES))
+   {
+      fprintf(stderr, "rdirect_stats: invalid statistics (%s)\n", RDIRECT_STATS_NAME);
+      return 1;
+   }
+
+   for (unsigned int i = 0; i < RDIRECT_STATS_SHARES; ++i)
+   {
+      const struct rdirect_stats *stats = &segment->shares[i];
+      if ((stats->share[0] != '\0') && ((share == NULL) || (strcmp(stats->share, share) == 0)))
+      {
+         dump(stats);
+      }
+   }
+   return 0;
+}
@@ -17,10 +17,38 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <linux/fiemap.h>
+#include <fnmatch.h>
+#include <ctype.h>
 #include "includes.h"
 #include "system/filesys.h"
 #include "smbd/smbd.h"
 #include "lib/util/tevent_unix.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
+#include "lib/util/dlinklist.h"
+#include "vfs_rdirect_stats.h"
+
+#if defined(HAVE_LIBURING)
+#define RDIRECT_URING
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+
+#if defined(HAVE_SYS_SDT_H)
+#define RDIRECT_PROBES
+#include <sys/sdt.h>
+#endif
 
 /* Read-direct module.
  *
@@ -31,143 +59,5811 @@
 
 #define MODULE "rdirect"
 
+#ifndef FS_IOC_FIEMAP
+#define FS_IOC_FIEMAP _IOWR('f', 11, struct fiemap) //of <linux/fs.h>, which conflicts with <sys/mount.h>
+#endif
+
+
+
+
+/*
+ * Engines, to perform asynchronous reads (pread_send) with.
+ * Selected per share by parameter `rdirect:engine`.
+ */
+enum rdirect_engine {
+   RDIRECT_ENGINE_SYNC, //read synchronously, in the smbd main thread
+   RDIRECT_ENGINE_THREADPOOL, //read in smbd's worker threadpool
+   RDIRECT_ENGINE_IO_URING //read via io_uring (falls back to threadpool, if not available)
+};
+
+static const struct enum_list rdirect_engines[] = {
+   { RDIRECT_ENGINE_SYNC, "sync" },
+   { RDIRECT_ENGINE_THREADPOOL, "threadpool" },
+   { RDIRECT_ENGINE_IO_URING, "io_uring" },
+   { -1, NULL }
+};
+
+#ifdef RDIRECT_URING
+#define RDIRECT_ENGINE_DEFAULT RDIRECT_ENGINE_IO_URING
+#else
+#define RDIRECT_ENGINE_DEFAULT RDIRECT_ENGINE_THREADPOOL
+#endif
+
+
+
+/*
+ * Static probes (USDT, provider `rdirect`), for tracing with bpftrace, perf or systemtap.
+ * A probe is a single nop, as long as no tracer is attached. Offsets and lengths are in bytes, times in ns.
+ *
+ *   pread_entry(fd, offset, n, async)                 read request received
+ *   pread_return(fd, offset, n, result, elapsed)      read request completed (result: bytes read, or -errno)
+ *   fallback(fd, offset, n, reason)                   request passed to the next module
+ *                                                     (reason: 0 below rdirect:min size, 1 O_DIRECT not available,
+ *                                                     2 small random or repeated reads, see rdirect:adaptive,
+ *                                                     3 file matches rdirect:exclude)
+ *   bounce(fd, offset, n, align)                      request read via bounce buffer (range or buffer not aligned)
+ *   submit(fd, offset, len, engine)                   direct read submitted to the engine (fd: O_DIRECT descriptor)
+ *   complete(fd, offset, len, result, elapsed)        direct read completed by the engine
+ *   sendfile(fd, offset, n, result)                   request sent via splice (fd: O_DIRECT descriptor,
+ *                                                     result: bytes sent including the header, or -errno)
+ */
+#ifdef RDIRECT_PROBES
+#define RDIRECT_PROBE4(name, a, b, c, d) \
+   DTRACE_PROBE4(rdirect, name, (int64_t)(a), (int64_t)(b), (int64_t)(c), (int64_t)(d))
+#define RDIRECT_PROBE5(name, a, b, c, d, e) \
+   DTRACE_PROBE5(rdirect, name, (int64_t)(a), (int64_t)(b), (int64_t)(c), (int64_t)(d), (int64_t)(e))
+#else
+#define RDIRECT_PROBE4(name, a, b, c, d)
+#define RDIRECT_PROBE5(name, a, b, c, d, e)
+#endif
+
+
+
+/*
+ * Per share configuration (stored as handle data).
+ */
+struct rdirect_config {
+   enum rdirect_engine engine;
+   uint64_t minSize; //files smaller than this [bytes] are read via page cache (0: all files are read direct)
+   unsigned int raDepth; //number of chunks to read ahead of sequential streams (0: no read-ahead)
+   size_t raSize; //size of a read-ahead chunk [bytes]
+   size_t raMemory; //max. memory used for read-ahead chunks [bytes] (per process)
+   size_t chunkSize; //large reads are split into concurrent reads of this size [bytes] (0: no split)
+   size_t bounceMemory; //max. memory of bounce buffers of asynchronous reads in flight [bytes] (per process, 0: no limit)
+   bool coalesce; //concurrent reads of the same range share a single device read
+   bool cache; //use the shared block cache
+   uint64_t cacheRange; //blocks of files below this offset [bytes] are cached
+   bool tryPageCache; //serve reads from the page cache, if the data is resident already
+   bool fallbackDontneed; //drop data read via page cache (instead of direct) from the page cache afterwards
+   bool sendfile; //send direct reads via splice (otherwise sendfile is passed to the next module, i.e. page cache)
+   bool raw; //read files raw from the block device (see rdirect_raw_map)
+   unsigned int hedgeAfter; //deadline of asynchronous reads [ms], after which a duplicate is issued (0: none)
+   int hedgeMirror; //block device mirroring the devices of files read raw, for duplicates (-1: none)
+   bool adaptive; //switch handles with small random or repeated reads to page cache (see rdirect_pattern_buffered)
+   size_t adaptiveSize; //reads smaller than this [bytes] are small
+   struct rdirect_stats *stats; //statistics of the share (NULL: not collected)
+   struct rdirect_qos *qos; //QoS of the direct reads (NULL: not limited)
+   struct rdirect_rules *rules; //rules by file name (rdirect:include, rdirect:exclude), NULL if none
+   uint32_t ioHint; //I/O size reported for files read direct (0: not changed, see RDIRECT_IO_HINT_AUTO)
+};
+
+#define RDIRECT_IO_HINT_AUTO  UINT32_MAX           //rdirect:io hint = auto: the device's preferred size
+#define RDIRECT_IO_HINT_MAX   (64 * 1024 * 1024)   //max. rdirect:io hint
+
+
+
+/*
+ * Alignment [bytes] required by O_DIRECT.
+ * Both values are powers of two.
+ */
+struct rdirect_align {
+   uint32_t mem; //alignment of the buffer address
+   uint32_t offset; //alignment of file offset and transfer size
+};
+
+//alignment assumed, if it can't be detected (suits 512e and 4Kn devices)
+#define RDIRECT_ALIGN_DEFAULT 4096
+
+
+
+/*
+ * A requested range, extended to the alignment required by O_DIRECT.
+ */
+struct rdirect_span {
+   off_t offset; //aligned start offset of the covering range
+   size_t head; //bytes in front of the requested range
+   size_t len; //aligned length of the covering range
+};
+
+
+
+//direct read requires file offset and transfer size to be multiples of the block size.
+//so align the offset down and the end of the requested range up, to get the covering range.
+static void rdirect_span_init(struct rdirect_span * const span, const struct rdirect_align * const align,
+         const size_t n, const off_t offset)
+{
+   const size_t mask = (size_t)align->offset - 1;
+   span->offset = offset & ~((off_t)mask);
+   span->head = (size_t)(offset - span->offset);
+   span->len = (span->head + n + mask) & ~mask;
+}
+
+
+
+//check, if the covering range is the requested range, and the caller's buffer is aligned
+//-> the device can read straight into the caller's buffer
+static bool rdirect_span_is_direct(const struct rdirect_span * const span, const struct rdirect_align * const align,
+         const void * const data, const size_t n)
+{
+   return (span->head == 0) && (span->len == n) && (((uintptr_t)data & ((uintptr_t)align->mem - 1)) == 0);
+}
+
+
+
+//get the number of requested bytes, contained in `count` bytes read from the covering range
+static ssize_t rdirect_span_count(const struct rdirect_span * const span, const ssize_t count, const size_t n)
+{
+   if (count <= (ssize_t)span->head)
+   {
+      return (count < 0) ? count : 0; //offset is at (or beyond) end of file
+   }
+   return MIN((size_t)count - span->head, n);
+}
+
+
+
+/*
+ * Memory of the direct I/O buffers (`rdirect:hugepages`, `rdirect:numa node`; per process).
+ *
+ * By default, the buffers are allocated from the heap. With huge pages or a NUMA node configured, they are mapped
+ * from anonymous memory instead: backed by 2 MiB huge pages (MAP_HUGETLB while the hugetlb pool has pages, else
+ * transparent huge pages), and/or with a preferred policy for the node (so the allocation still succeeds, when
+ * the node is full). The settings are made by the first tree connect of the process, before any buffer is got.
+ * Mapping is done by the workers of the threadpool engine as well, so it doesn't log.
+ */
+#define RDIRECT_MEM_HUGE         (2 * 1024 * 1024)    //size of a huge page
+#define RDIRECT_MEM_MAX_NODES    1024                 //max. number of NUMA nodes (bits of the node mask)
+#define RDIRECT_MEM_MPOL_PREFERRED  1                 //MPOL_PREFERRED of <numaif.h> (no dependency on libnuma)
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB             (21 << 26)           //(21 << MAP_HUGE_SHIFT)
+#endif
+
+static struct {
+   bool configured; //settings are made
+   bool mapped;     //buffers are mapped (huge pages or a node are configured), not allocated from the heap
+   bool hugepages;
+   int node;        //NUMA node for the buffers (-1: any)
+   bool noHugetlb;  //the hugetlb pool has no pages (left), use transparent huge pages
+} rdirect_mem = {
+   .node = -1
+};
+
+
+
+//get the NUMA node of the CPU we are running on (-1, if unknown)
+static int rdirect_mem_current_node(void)
+{
+#ifdef SYS_getcpu
+   unsigned cpu = 0;
+   unsigned node = 0;
+   if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+   {
+      return (int)node;
+   }
+#endif
+   return -1;
+}
+
+
+
+/*
+ * Make the settings for the buffer memory of the process, unless made already.
+ * `node` is the NUMA node for the buffers, RDIRECT_MEM_NODE_AUTO for the node of the current CPU, or -1 for any.
+ */
+#define RDIRECT_MEM_NODE_AUTO -2
+
+static void rdirect_mem_configure(const bool hugepages, int node)
+{
+   if (rdirect_mem.configured)
+   {
+      if ((hugepages != rdirect_mem.hugepages) || ((node != -1) != (rdirect_mem.node != -1)))
+      {
+         DEBUG(3, ("vfs_rdirect:buffer memory of the process is set by the first share connected already, "
+               "ignoring hugepages/numa node of this share\n"));
+      }
+      return;
+   }
+   if (node == RDIRECT_MEM_NODE_AUTO)
+   {
+      node = rdirect_mem_current_node();
+   }
+   if (node >= RDIRECT_MEM_MAX_NODES)
+   {
+      DEBUG(1, ("vfs_rdirect:invalid numa node %d, ignored\n", node));
+      node = -1;
+   }
+#ifdef MAP_HUGETLB
+   if (hugepages)
+   {
+      //probe the hugetlb pool (mapping it doesn't reserve pages, until touched; MAP_POPULATE touches it)
+      void * const probe = mmap(NULL, RDIRECT_MEM_HUGE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB | MAP_POPULATE, -1, 0);
+      if (probe == MAP_FAILED)
+      {
+         DEBUG(2, ("vfs_rdirect:no hugetlb pages available (%s), using transparent huge pages\n", strerror(errno)));
+         rdirect_mem.noHugetlb = true;
+      }
+      else
+      {
+         munmap(probe, RDIRECT_MEM_HUGE);
+      }
+   }
+#else
+   rdirect_mem.noHugetlb = true;
+#endif
+   rdirect_mem.hugepages = hugepages;
+   rdirect_mem.node = node;
+   rdirect_mem.mapped = hugepages || (node >= 0);
+   rdirect_mem.configured = true;
+   if (rdirect_mem.mapped)
+   {
+      DEBUG(3, ("vfs_rdirect:buffers with hugepages %s, numa node %d\n", hugepages ? "yes" : "no", node));
+   }
+}
+
+
+
+/*
+ * Map `size` bytes of buffer memory (a multiple of RDIRECT_MEM_HUGE), according to the settings.
+ * Returns NULL on out of memory.
+ */
+static void *rdirect_mem_map(const size_t size)
+{
+   void *memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+   if (rdirect_mem.hugepages && !__atomic_load_n(&rdirect_mem.noHugetlb, __ATOMIC_RELAXED))
+   {
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB,
+            -1, 0);
+   }
+#endif
+   if (memory == MAP_FAILED)
+   {
+      //align the mapping to a huge page, so it can be backed by transparent huge pages
+      const size_t slack = rdirect_mem.hugepages ? RDIRECT_MEM_HUGE : 0;
+      uint8_t * const raw = mmap(NULL, size + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (raw == MAP_FAILED)
+      {
+         return NULL;
+      }
+      uint8_t *aligned = raw;
+      if (slack > 0)
+      {
+         aligned = (uint8_t *)(((uintptr_t)raw + slack - 1) & ~((uintptr_t)slack - 1));
+         if (aligned > raw)
+         {
+            munmap(raw, (size_t)(aligned - raw));
+         }
+         if (raw + slack > aligned)
+         {
+            munmap(aligned + size, (size_t)(raw + slack - aligned));
+         }
+#ifdef MADV_HUGEPAGE
+         madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+      }
+      memory = aligned;
+   }
+#ifdef SYS_mbind
+   if (rdirect_mem.node >= 0)
+   {
+      //before the pages are touched, so they are allocated on the node
+      unsigned long mask[RDIRECT_MEM_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+      mask[rdirect_mem.node / (8 * sizeof(unsigned long))] = 1UL << (rdirect_mem.node % (8 * sizeof(unsigned long)));
+      syscall(SYS_mbind, memory, size, RDIRECT_MEM_MPOL_PREFERRED, mask, (unsigned long)RDIRECT_MEM_MAX_NODES + 1, 0);
+   }
+#endif
+   return memory;
+}
+
+
+
+//round `len` up to a multiple of the huge page size
+static size_t rdirect_mem_size(const size_t len)
+{
+   return ((len + RDIRECT_MEM_HUGE - 1) / RDIRECT_MEM_HUGE) * RDIRECT_MEM_HUGE;
+}
+
+
+
+/*
+ * Pool of aligned bounce buffers (per process).
+ *
+ * Requests, which can't be read straight into the caller's buffer, are read into a bounce buffer and copied out.
+ * The bounce buffers are page aligned (so they satisfy any O_DIRECT alignment) and grouped in power of two size
+ * classes. Released buffers are kept in a free list per size class, for reuse by later requests, up to a total
+ * of RDIRECT_POOL_CACHED_BYTES. Requests larger than the largest size class get a buffer of their own.
+ * With mapped buffer memory, the size classes below a huge page are carved out of huge page sized regions, which
+ * stay with the pool (their buffers can't be unmapped one by one), so they are kept in the free lists regardless.
+ * The pool is used by the workers of the threadpool engine as well, so it is protected by a mutex.
+ */
+#define RDIRECT_POOL_ALIGN          4096                 //alignment of the bounce buffers
+#define RDIRECT_POOL_MIN_SHIFT      12                   //smallest size class: 4 KiB
+#define RDIRECT_POOL_MAX_SHIFT      24                   //largest size class: 16 MiB
+#define RDIRECT_POOL_CLASSES        (RDIRECT_POOL_MAX_SHIFT - RDIRECT_POOL_MIN_SHIFT + 1)
+#define RDIRECT_POOL_CACHED_BYTES   (32 * 1024 * 1024)   //max. number of bytes kept in the free lists
+
+struct rdirect_pool_buffer {
+   struct rdirect_pool_buffer *next; //next free buffer of the same size class (stored in the free buffer itself)
+};
+
+static struct {
+   pthread_mutex_t mutex;
+   struct rdirect_pool_buffer *free[RDIRECT_POOL_CLASSES];
+   size_t cachedBytes; //number of bytes in the free lists
+} rdirect_pool = {
+   .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+
+//get the size class for a buffer of `len` bytes. Returns -1, if the buffer is larger than the largest class
+static int rdirect_pool_class(const size_t len)
+{
+   int cls = 0;
+   while (((size_t)1 << (RDIRECT_POOL_MIN_SHIFT + cls)) < len)
+   {
+      if (++cls >= RDIRECT_POOL_CLASSES)
+      {
+         return -1;
+      }
+   }
+   return cls;
+}
+
+
+
+/*
+ * Get an aligned buffer of (at least) `len` bytes.
+ * Returns NULL on out of memory.
+ */
+static void *rdirect_pool_get(const size_t len)
+{
+   const int cls = rdirect_pool_class(len);
+   const size_t size = (cls >= 0) ? ((size_t)1 << (RDIRECT_POOL_MIN_SHIFT + cls)) : len;
+   const bool carved = rdirect_mem.mapped && (cls >= 0) && (size < RDIRECT_MEM_HUGE);
+   if (cls >= 0)
+   {
+      pthread_mutex_lock(&rdirect_pool.mutex);
+      struct rdirect_pool_buffer *head = rdirect_pool.free[cls];
+      if (head != NULL)
+      {
+         rdirect_pool.free[cls] = head->next;
+         if (!carved)
+         {
+            rdirect_pool.cachedBytes -= size;
+         }
+      }
+      pthread_mutex_unlock(&rdirect_pool.mutex);
+      if (head != NULL)
+      {
+         return head;
+      }
+   }
+
+   if (carved)
+   {
+      //carve a region into buffers of the class, keep all but the first in the free list
+      uint8_t * const region = rdirect_mem_map(RDIRECT_MEM_HUGE);
+      if (region == NULL)
+      {
+         return NULL;
+      }
+      pthread_mutex_lock(&rdirect_pool.mutex);
+      for (size_t offset = size; offset < RDIRECT_MEM_HUGE; offset += size)
+      {
+         struct rdirect_pool_buffer * const head = (struct rdirect_pool_buffer *)(region + offset);
+         head->next = rdirect_pool.free[cls];
+         rdirect_pool.free[cls] = head;
+      }
+      pthread_mutex_unlock(&rdirect_pool.mutex);
+      return region;
+   }
+   if (rdirect_mem.mapped)
+   {
+      return rdirect_mem_map(rdirect_mem_size(size));
+   }
+   void *buffer = NULL;
+   if (posix_memalign(&buffer, RDIRECT_POOL_ALIGN, size) != 0)
+   {
+      return NULL;
+   }
+   return buffer;
+}
+
+
+
+//release a buffer of `len` bytes, got from rdirect_pool_get
+static void rdirect_pool_put(void * const buffer, const size_t len)
+{
+   const int cls = rdirect_pool_class(len);
+   const size_t size = (cls >= 0) ? ((size_t)1 << (RDIRECT_POOL_MIN_SHIFT + cls)) : len;
+   if (cls >= 0)
+   {
+      const bool carved = rdirect_mem.mapped && (size < RDIRECT_MEM_HUGE);
+      pthread_mutex_lock(&rdirect_pool.mutex);
+      if (carved || (rdirect_pool.cachedBytes + size <= RDIRECT_POOL_CACHED_BYTES))
+      {
+         struct rdirect_pool_buffer *head = (struct rdirect_pool_buffer *)buffer;
+         head->next = rdirect_pool.free[cls];
+         rdirect_pool.free[cls] = head;
+         if (!carved)
+         {
+            rdirect_pool.cachedBytes += size;
+         }
+         pthread_mutex_unlock(&rdirect_pool.mutex);
+         return;
+      }
+      pthread_mutex_unlock(&rdirect_pool.mutex);
+   }
+   if (rdirect_mem.mapped)
+   {
+      munmap(buffer, rdirect_mem_size(size));
+   }
+   else
+   {
+      free(buffer);
+   }
+}
+
+
+
+/*
+ * Read the aligned range [aoffset, aoffset + alen) into the aligned buffer `buffer`.
+ * Short reads are continued, until end of file.
+ * Returns the number of bytes read, which may be less than alen at end of file.
+ */
+static ssize_t rdirect_read_aligned(const int fd, void * const buffer, const size_t alen, const off_t aoffset)
+{
+   size_t done = 0;
+   while (done < alen)
+   {
+      const ssize_t count = pread(fd, (uint8_t *)buffer + done, alen - done, aoffset + (off_t)done);
+      if (count < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         if (done > 0)
+         {
+            break; //the rest can't be read (e.g. an unaligned end of file) -> return what we have
+         }
+         return -1;
+      }
+      if (count == 0)
+      {
+         break; //end of file
+      }
+      done += (size_t)count;
+   }
+   return (ssize_t)done;
+}
+
+
+
+/*
+ * Per device data (per process).
+ * The O_DIRECT alignment is detected once per device (st_dev), and cached in a small table. So are devices
+ * (filesystems), that don't support O_DIRECT at all (e.g. tmpfs, some FUSE mounts): Files there are read via page
+ * cache, without trying (and failing) to open them direct again.
+ */
+#define RDIRECT_DEVS 16 //number of table entries
+
+struct rdirect_dev {
+   dev_t dev;
+   bool unsupported; //O_DIRECT is not supported (align and ioSize are not valid)
+   struct rdirect_align align;
+   uint32_t ioSize; //preferred size of direct reads (see rdirect_dev_io_size)
+};
+
+static struct rdirect_dev rdirect_devs[RDIRECT_DEVS];
+static unsigned int rdirect_devCount = 0; //number of devices detected so far (entries are reused round robin)
+
+
+
+static bool rdirect_is_pow2(const uint64_t value)
+{
+   return (value != 0) && ((value & (value - 1)) == 0);
+}
+
+
+
+//read queue attribute `name` (e.g. "logical_block_size") of device `dev` from sysfs. Returns 0, if not available
+static uint32_t rdirect_dev_queue_value(const dev_t dev, const char * const name)
+{
+   //the queue of a partition is the one of its parent device
+   static const char * const formats[] = {
+      "/sys/dev/block/%u:%u/queue/%s",
+      "/sys/dev/block/%u:%u/../queue/%s"
+   };
+   for (size_t i = 0; i < ARRAY_SIZE(formats); ++i)
+   {
+      char path[128];
+      snprintf(path, sizeof(path), formats[i], major(dev), minor(dev), name);
+      FILE *file = fopen(path, "r");
+      if (file == NULL)
+      {
+         continue;
+      }
+      unsigned int value = 0;
+      const int ret = fscanf(file, "%u", &value);
+      fclose(file);
+      if (ret == 1)
+      {
+         return value;
+      }
+   }
+   return 0;
+}
+
+
+
+//read the logical block size of device `dev` from sysfs. Returns 0, if not available
+static uint32_t rdirect_dev_block_size(const dev_t dev)
+{
+   const uint32_t size = rdirect_dev_queue_value(dev, "logical_block_size");
+   return rdirect_is_pow2(size) ? size : 0;
+}
+
+
+
+/*
+ * Get the preferred size of direct reads from device `dev`, whose O_DIRECT alignment is `align`: its optimal I/O
+ * size (e.g. the stripe width of a RAID), else its minimum I/O size (the physical block size), but at least the
+ * alignment, and a multiple of it.
+ */
+static uint32_t rdirect_dev_io_size(const dev_t dev, const struct rdirect_align * const align)
+{
+   uint32_t size = rdirect_dev_queue_value(dev, "optimal_io_size");
+   if (size == 0)
+   {
+      size = rdirect_dev_queue_value(dev, "minimum_io_size");
+   }
+   const uint32_t mask = align->offset - 1;
+   return MAX((size + mask) & ~mask, align->offset);
+}
+
+
+
+/*
+ * Detect the O_DIRECT alignment of the file opened as `fd` (with O_DIRECT flag set), residing on device `st`.
+ * statx(STATX_DIOALIGN) reports the alignment the filesystem actually requires (which may be more relaxed than
+ * the logical block size). Where not available, the logical block size of the device is used,
+ * and if that is unknown as well, the preferred I/O size of the file.
+ */
+static void rdirect_dev_detect(const int fd, const struct stat * const st, struct rdirect_align * const align)
+{
+#ifdef STATX_DIOALIGN
+   struct statx stx;
+   if ((statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0) && (stx.stx_mask & STATX_DIOALIGN)
+         && rdirect_is_pow2(stx.stx_dio_mem_align) && rdirect_is_pow2(stx.stx_dio_offset_align))
+   {
+      align->mem = stx.stx_dio_mem_align;
+      align->offset = stx.stx_dio_offset_align;
+      return;
+   }
+#endif
+   uint32_t size = rdirect_dev_block_size(st->st_dev);
+   if (size == 0)
+   {
+      size = rdirect_is_pow2(st->st_blksize) ? (uint32_t)st->st_blksize : RDIRECT_ALIGN_DEFAULT;
+   }
+   align->mem = size;
+   align->offset = size;
+}
+
+
+
+//get the table entry of device `dev` (NULL, if none)
+static struct rdirect_dev *rdirect_dev_find(const dev_t dev)
+{
+   const unsigned int count = MIN(rdirect_devCount, RDIRECT_DEVS);
+   for (unsigned int i = 0; i < count; ++i)
+   {
+      if (rdirect_devs[i].dev == dev)
+      {
+         return &rdirect_devs[i];
+      }
+   }
+   return NULL;
+}
+
+
+
+//get a new table entry for device `dev`
+static struct rdirect_dev *rdirect_dev_add(const dev_t dev)
+{
+   struct rdirect_dev *entry = &rdirect_devs[rdirect_devCount % RDIRECT_DEVS];
+   ++rdirect_devCount;
+   entry->dev = dev;
+   entry->unsupported = false;
+   return entry;
+}
+
+
+
+//check, if device `dev` is known not to support O_DIRECT
+static bool rdirect_dev_is_unsupported(const dev_t dev)
+{
+   const struct rdirect_dev *entry = rdirect_dev_find(dev);
+   return (entry != NULL) && entry->unsupported;
+}
+
+
+
+//remember, that device `dev` doesn't support O_DIRECT
+static void rdirect_dev_set_unsupported(const dev_t dev)
+{
+   struct rdirect_dev *entry = rdirect_dev_find(dev);
+   if (entry == NULL)
+   {
+      entry = rdirect_dev_add(dev);
+   }
+   entry->unsupported = true;
+
+   DEBUG(2, ("vfs_rdirect:open Device %u:%u doesn't support O_DIRECT, files are read via page cache\n",
+         major(dev), minor(dev)));
+}
+
+
+
+/*
+ * Get the O_DIRECT alignment for the file opened as `fd` (with O_DIRECT flag set).
+ * The alignment is detected on first access to a device, and cached afterwards.
+ */
+static void rdirect_dev_align(const int fd, struct rdirect_align * const align)
+{
+   struct stat st;
+   if (fstat(fd, &st) != 0)
+   {
+      align->mem = RDIRECT_ALIGN_DEFAULT;
+      align->offset = RDIRECT_ALIGN_DEFAULT;
+      return;
+   }
+
+   struct rdirect_dev *entry = rdirect_dev_find(st.st_dev);
+   if ((entry != NULL) && !entry->unsupported)
+   {
+      *align = entry->align;
+      return;
+   }
+
+   if (entry == NULL)
+   {
+      entry = rdirect_dev_add(st.st_dev);
+   }
+   entry->unsupported = false; //the file has been opened direct, after all
+   rdirect_dev_detect(fd, &st, &entry->align);
+   if (entry->align.mem > RDIRECT_POOL_ALIGN)
+   {
+      entry->align.mem = RDIRECT_POOL_ALIGN; //larger buffer alignment is not supported by the bounce buffers
+   }
+   entry->ioSize = rdirect_dev_io_size(st.st_dev, &entry->align);
+   *align = entry->align;
+
+   DEBUG(5, ("vfs_rdirect:open Device %u:%u requires alignment mem=%u, offset=%u, prefers reads of %u\n",
+         major(st.st_dev), minor(st.st_dev), align->mem, align->offset, entry->ioSize));
+}
+
+
+
+/*
+ * Raw block device reads (`rdirect:raw device`).
+ *
+ * The extent map of a file is fetched once per file handle (FS_IOC_FIEMAP), and its reads go straight to the block
+ * device of the filesystem, at the mapped physical offsets. Holes and unwritten extents are zero-filled. This drops
+ * the locking and block mapping of the filesystem from the read path.
+ * This is only safe, as long as the extent map is stable. So it is limited to read only shares on filesystems
+ * mounted read-only (no process can truncate, rewrite or move the blocks of a file), which address their blocks
+ * by device offset (ext4 and xfs; not e.g. btrfs, whose addresses are logical). Files with extents, that are not
+ * plain data at a known, aligned location (delayed allocation, inline, encoded or encrypted data), are read through
+ * the filesystem as usual.
+ * The block devices are opened with O_DIRECT once per process (as root), when a file there is opened first.
+ */
+#define RDIRECT_RAW_DEVS         8                    //number of block devices per process
+#define RDIRECT_RAW_MAX_EXTENTS  4096                 //files with more extents are read through the filesystem
+#define RDIRECT_RAW_BATCH        128                  //number of extents fetched per FS_IOC_FIEMAP
+#define RDIRECT_RAW_EXT4_MAGIC   0xEF53
+#define RDIRECT_RAW_XFS_MAGIC    0x58465342
+#define RDIRECT_RAW_UNSTABLE     (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED | \
+      FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL)
+
+struct rdirect_extent {
+   off_t logical; //file offset
+   off_t physical; //device offset
+   off_t length;
+   bool zero; //unwritten extent (reads as zeros)
+};
+
+struct rdirect_raw {
+   unsigned int refs; //references by the file handle and its ios (main thread only)
+   int fd; //O_DIRECT descriptor of the block device
+   off_t size; //size of the file
+   unsigned int count; //number of extents
+   struct rdirect_extent extents[]; //sorted by file offset, holes are not listed
+};
+
+static struct {
+   dev_t dev;
+   int fd; //-1: can't be opened
+} rdirect_rawDevs[RDIRECT_RAW_DEVS];
+static unsigned int rdirect_rawDevCount = 0;
+
+
+
+//get the O_DIRECT descriptor of block device `dev`, opened on first use. Returns -1, if it can't be opened
+static int rdirect_raw_device(const dev_t dev)
+{
+   for (unsigned int i = 0; i < rdirect_rawDevCount; ++i)
+   {
+      if (rdirect_rawDevs[i].dev == dev)
+      {
+         return rdirect_rawDevs[i].fd;
+      }
+   }
+   if (rdirect_rawDevCount >= RDIRECT_RAW_DEVS)
+   {
+      return -1;
+   }
+
+   //the device node is found via its udev link, or the name the kernel reports in sysfs
+   char path[96];
+   snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/uevent", major(dev), minor(dev));
+   char name[64] = "";
+   FILE *file = fopen(path, "r");
+   if (file != NULL)
+   {
+      char line[128];
+      while ((fgets(line, sizeof(line), file) != NULL) && (sscanf(line, "DEVNAME=%63s", name) != 1))
+      {
+      }
+      fclose(file);
+   }
+   snprintf(path, sizeof(path), "/dev/block/%u:%u", major(dev), minor(dev));
+   become_root();
+   int fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC | O_NOCTTY);
+   if ((fd < 0) && (errno == ENOENT) && (name[0] != '\0'))
+   {
+      snprintf(path, sizeof(path), "/dev/%s", name);
+      fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC | O_NOCTTY);
+   }
+   const int err = errno;
+   unbecome_root();
+   if (fd < 0)
+   {
+      DEBUG(1, ("vfs_rdirect:raw Failed to open block device %s, reading through the filesystem. Code %d\n",
+            path, err));
+   }
+   else
+   {
+      DEBUG(3, ("vfs_rdirect:raw Reading files of %s from the block device\n", path));
+   }
+   rdirect_rawDevs[rdirect_rawDevCount].dev = dev;
+   rdirect_rawDevs[rdirect_rawDevCount].fd = fd;
+   ++rdirect_rawDevCount;
+   return fd;
+}
+
+
+
+/*
+ * Open the block device `path`, which mirrors the device of a filesystem (`rdirect:hedge mirror`), once per process.
+ * Returns its O_DIRECT descriptor, or -1 on error.
+ */
+static int rdirect_raw_mirror(const char * const path)
+{
+   become_root();
+   const int fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC | O_NOCTTY);
+   const int err = errno;
+   unbecome_root();
+   if (fd < 0)
+   {
+      DEBUG(1, ("vfs_rdirect:connect Failed to open mirror device %s. Code %d\n", path, err));
+      return -1;
+   }
+   struct stat st;
+   if ((fstat(fd, &st) != 0) || !S_ISBLK(st.st_mode))
+   {
+      DEBUG(1, ("vfs_rdirect:connect Mirror %s is not a block device\n", path));
+      close(fd);
+      return -1;
+   }
+
+   //one descriptor per device and process
+   for (unsigned int i = 0; i < rdirect_rawDevCount; ++i)
+   {
+      if (rdirect_rawDevs[i].dev == st.st_rdev)
+      {
+         if (rdirect_rawDevs[i].fd < 0)
+         {
+            rdirect_rawDevs[i].fd = fd;
+            return fd;
+         }
+         close(fd);
+         return rdirect_rawDevs[i].fd;
+      }
+   }
+   if (rdirect_rawDevCount >= RDIRECT_RAW_DEVS)
+   {
+      DEBUG(1, ("vfs_rdirect:connect Too many block devices, mirror %s not used\n", path));
+      close(fd);
+      return -1;
+   }
+   rdirect_rawDevs[rdirect_rawDevCount].dev = st.st_rdev;
+   rdirect_rawDevs[rdirect_rawDevCount].fd = fd;
+   ++rdirect_rawDevCount;
+   return fd;
+}
+
+
+
+//check, that the filesystem of `fd` has a stable extent map, addressed by device offset
+static bool rdirect_raw_is_stable(const int fd)
+{
+   struct statfs sfs;
+   struct statvfs svfs;
+   if ((fstatfs(fd, &sfs) != 0) || (fstatvfs(fd, &svfs) != 0))
+   {
+      return false;
+   }
+   if ((sfs.f_type != RDIRECT_RAW_EXT4_MAGIC) && (sfs.f_type != RDIRECT_RAW_XFS_MAGIC))
+   {
+      return false;
+   }
+   return (svfs.f_flag & ST_RDONLY) != 0;
+}
+
+
+
+/*
+ * Get the extent map of the regular file opened as `fd` (described by `st`), for raw reads with alignment `align`.
+ * Returns NULL, if the file can't be read raw.
+ */
+static struct rdirect_raw *rdirect_raw_map(const int fd, const struct stat * const st,
+         const struct rdirect_align * const align)
+{
+   if (!S_ISREG(st->st_mode) || !rdirect_raw_is_stable(fd))
+   {
+      return NULL;
+   }
+
+   struct fiemap *fm = calloc(1, sizeof(struct fiemap) + RDIRECT_RAW_BATCH * sizeof(struct fiemap_extent));
+   struct rdirect_raw *raw = calloc(1, sizeof(struct rdirect_raw));
+   if ((fm == NULL) || (raw == NULL))
+   {
+      goto fail;
+   }
+   const uint64_t mask = align->offset - 1;
+   bool last = (st->st_size == 0);
+   uint64_t start = 0;
+   while (!last)
+   {
+      fm->fm_start = start;
+      fm->fm_length = FIEMAP_MAX_OFFSET - start;
+      fm->fm_flags = 0;
+      fm->fm_extent_count = RDIRECT_RAW_BATCH;
+      if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0)
+      {
+         DEBUG(5, ("vfs_rdirect:raw FS_IOC_FIEMAP failed. Code %d\n", errno));
+         goto fail;
+      }
+      if (fm->fm_mapped_extents == 0)
+      {
+         break; //the rest of the file is a hole
+      }
+      if (raw->count + fm->fm_mapped_extents > RDIRECT_RAW_MAX_EXTENTS)
+      {
+         goto fail;
+      }
+      struct rdirect_raw *grown = realloc(raw, sizeof(struct rdirect_raw)
+            + (raw->count + fm->fm_mapped_extents) * sizeof(struct rdirect_extent));
+      if (grown == NULL)
+      {
+         goto fail;
+      }
+      raw = grown;
+      for (uint32_t i = 0; i < fm->fm_mapped_extents; ++i)
+      {
+         const struct fiemap_extent *fe = &fm->fm_extents[i];
+         if ((fe->fe_flags & RDIRECT_RAW_UNSTABLE) || (((fe->fe_logical | fe->fe_physical | fe->fe_length) & mask) != 0))
+         {
+            goto fail;
+         }
+         struct rdirect_extent *extent = &raw->extents[raw->count++];
+         extent->logical = (off_t)fe->fe_logical;
+         extent->physical = (off_t)fe->fe_physical;
+         extent->length = (off_t)fe->fe_length;
+         extent->zero = (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) != 0;
+         start = fe->fe_logical + fe->fe_length;
+         last = (fe->fe_flags & FIEMAP_EXTENT_LAST) != 0;
+      }
+   }
+   free(fm);
+
+   raw->fd = rdirect_raw_device(st->st_dev);
+   if (raw->fd < 0)
+   {
+      free(raw);
+      return NULL;
+   }
+   raw->refs = 1;
+   raw->size = st->st_size;
+   return raw;
+
+fail:
+   free(fm);
+   free(raw);
+   return NULL;
+}
+
+
+
+//add a reference to `raw` (may be NULL). Returns `raw`
+static struct rdirect_raw *rdirect_raw_ref(struct rdirect_raw * const raw)
+{
+   if (raw != NULL)
+   {
+      ++raw->refs;
+   }
+   return raw;
+}
+
+
+
+//drop a reference to `raw` (may be NULL)
+static void rdirect_raw_unref(struct rdirect_raw * const raw)
+{
+   if ((raw != NULL) && (--raw->refs == 0))
+   {
+      free(raw);
+   }
+}
+
+
+
+/*
+ * Read the aligned range [aoffset, aoffset + alen) of the file mapped by `raw` into the aligned buffer `buffer`,
+ * from the block device opened as `fd` (raw->fd, or a mirror of it). Like rdirect_read_aligned, the read ends at
+ * end of file. This function is thread-safe
+ * (it is also run by the workers of the threadpool engine) and must therefore not log.
+ * Returns the number of bytes read, or -1 on error (errno set).
+ */
+static ssize_t rdirect_raw_read(const struct rdirect_raw * const raw, const int fd, void * const buffer,
+         const size_t alen, const off_t aoffset)
+{
+   const off_t end = aoffset + (off_t)alen;
+   const off_t stop = MIN(end, raw->size);
+   //the extent containing (or next behind) aoffset
+   unsigned int lo = 0;
+   unsigned int hi = raw->count;
+   while (lo < hi)
+   {
+      const unsigned int mid = (lo + hi) / 2;
+      if (raw->extents[mid].logical + raw->extents[mid].length <= aoffset)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+
+   off_t pos = aoffset;
+   for (unsigned int i = lo; pos < stop; )
+   {
+      const struct rdirect_extent *extent = (i < raw->count) ? &raw->extents[i] : NULL;
+      uint8_t * const dest = (uint8_t *)buffer + (pos - aoffset);
+      if ((extent == NULL) || (pos < extent->logical))
+      {
+         //hole
+         const off_t len = (extent == NULL) ? (end - pos) : (MIN(extent->logical, end) - pos);
+         memset(dest, 0, (size_t)len);
+         pos += len;
+         continue;
+      }
+      const off_t len = MIN(extent->logical + extent->length, end) - pos;
+      if (extent->zero)
+      {
+         memset(dest, 0, (size_t)len);
+      }
+      else
+      {
+         const ssize_t count = rdirect_read_aligned(fd, dest, (size_t)len,
+               extent->physical + (pos - extent->logical));
+         if (count != len)
+         {
+            if (pos > aoffset)
+            {
+               break; //return what we have
+            }
+            if (count >= 0)
+            {
+               errno = EIO; //the extent reaches beyond the device
+            }
+            return -1;
+         }
+      }
+      pos += len;
+      ++i;
+   }
+   return (ssize_t)MAX(MIN(pos, stop) - aoffset, 0);
+}
+
+
+
+//read the aligned range [aoffset, aoffset + alen) from the O_DIRECT descriptor `fd` of the file, or raw from the
+//block device `fd` (if `raw` is not NULL)
+static ssize_t rdirect_read_range(const int fd, const struct rdirect_raw * const raw, void * const buffer,
+         const size_t alen, const off_t aoffset)
+{
+   return (raw != NULL) ? rdirect_raw_read(raw, fd, buffer, alen, aoffset) : rdirect_read_aligned(fd, buffer, alen, aoffset);
+}
+
+
+
+/*
+ * POSIX shared memory segments, used by all smbd processes.
+ */
+
+//initialize a process shared mutex, that survives the death of its owner. Returns false on error
+static bool rdirect_shm_mutex_init(pthread_mutex_t * const mutex)
+{
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST); //a process may die, while holding the mutex
+   const int ret = pthread_mutex_init(mutex, &attr);
+   pthread_mutexattr_destroy(&attr);
+   return (ret == 0);
+}
+
+
+
+/*
+ * Map the shared memory segment `name` into this process. The first process creates it with `size` bytes,
+ * and initializes it by `init_fn`. Later processes map the segment as it is, after checking it by `check_fn`.
+ * Creation is serialized by a file lock on the segment. The size of the segment is returned in `mapSize`.
+ * Returns the mapped segment, or NULL on error.
+ */
+static void *rdirect_shm_attach(const char * const name, const size_t size,
+         bool (*init_fn)(void *memory, size_t size), bool (*check_fn)(const void *memory, size_t size),
+         size_t * const mapSize)
+{
+   const int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+   if (fd < 0)
+   {
+      DEBUG(1, ("vfs_rdirect:shm Failed to open shared memory %s. Code %d\n", name, errno));
+      return NULL;
+   }
+   //the segment is initialized by the process, that finds it empty
+   flock(fd, LOCK_EX);
+
+   void *memory = MAP_FAILED;
+   struct stat st;
+   const bool create = (fstat(fd, &st) == 0) && (st.st_size == 0);
+   *mapSize = create ? size : (size_t)st.st_size;
+   if ((create && (ftruncate(fd, (off_t)size) != 0)) || (*mapSize == 0))
+   {
+      DEBUG(1, ("vfs_rdirect:shm Failed to set up shared memory %s. Code %d\n", name, errno));
+   }
+   else if ((memory = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+   {
+      DEBUG(1, ("vfs_rdirect:shm Failed to map shared memory %s. Code %d\n", name, errno));
+   }
+   else if (create ? !init_fn(memory, *mapSize) : !check_fn(memory, *mapSize))
+   {
+      DEBUG(1, ("vfs_rdirect:shm Invalid shared memory %s.\n", name));
+      munmap(memory, *mapSize);
+      memory = MAP_FAILED;
+      if (create)
+      {
+         (void)ftruncate(fd, 0); //let the next process try again
+      }
+   }
+
+   flock(fd, LOCK_UN);
+   close(fd);
+   return (memory != MAP_FAILED) ? memory : NULL;
+}
+
+
+
+/*
+ * Shared block cache (`rdirect:cache size`).
+ *
+ * Bypassing the page cache sends hot regions of files (headers, indexes, the start of videos hit by previews)
+ * to the device on every access. So the module keeps blocks read from the first `rdirect:cache range` bytes of the
+ * files in a cache of its own, which is bounded by its own size limit. The cache resides in a POSIX shared memory
+ * segment, used by all smbd processes: A hash table of block descriptors and the block data, protected by a process
+ * shared (robust) mutex. Blocks are replaced by the CLOCK algorithm.
+ * Blocks are keyed by device, inode and modification time of the file at open, so files changed by others than
+ * smbd are not served from stale blocks. Writes through the module drop the blocks they overlap. Only whole blocks
+ * are cached: the partial block at end of file would be stale after the file has grown.
+ */
+#define RDIRECT_CACHE_NAME          "/vfs_rdirect.cache"   //name of the shared memory segment
+#define RDIRECT_CACHE_MAGIC         0x52444331             //"RDC1"
+#define RDIRECT_CACHE_BLOCK         (64 * 1024)            //size of a block (multiple of any O_DIRECT alignment)
+#define RDIRECT_CACHE_DATA_ALIGN    4096                   //alignment of the block data in the segment
+
+struct rdirect_cache_file {
+   uint64_t dev;
+   uint64_t ino; //0: file is not cached
+   uint64_t generation; //modification time of the file at open [ns]
+};
+
+struct rdirect_cache_block {
+   struct rdirect_cache_file file;
+   uint64_t offset; //file offset of the block (multiple of the block size)
+   uint32_t len; //number of valid bytes (the block size), 0: block is unused
+   uint32_t ref; //block has been accessed, since the clock hand passed it last
+   int32_t next; //next block in the hash chain (-1: none)
+};
+
+struct rdirect_cache_header {
+   uint32_t magic; //set, when the segment is initialized
+   uint32_t numBlocks; //number of blocks (and of hash buckets)
+   uint64_t size; //size of the segment [bytes]
+   uint64_t epoch; //incremented by each invalidation
+   uint32_t hand; //clock hand
+   pthread_mutex_t mutex; //protects everything in the segment
+};
+
+struct rdirect_cache_segment {
+   struct rdirect_cache_header *header;
+   int32_t *buckets; //heads of the hash chains (-1: empty)
+   struct rdirect_cache_block *blocks;
+   uint8_t *data; //block data
+};
+
+static struct rdirect_cache_segment *rdirect_cache = NULL; //segment mapped by this process (NULL, if none)
+
+
+
+//get the offset of the block data in a segment with `numBlocks` blocks
+static size_t rdirect_cache_data_offset(const uint32_t numBlocks)
+{
+   const size_t end = sizeof(struct rdirect_cache_header) + (size_t)numBlocks * sizeof(int32_t)
+         + (size_t)numBlocks * sizeof(struct rdirect_cache_block);
+   return (end + RDIRECT_CACHE_DATA_ALIGN - 1) & ~((size_t)RDIRECT_CACHE_DATA_ALIGN - 1);
+}
+
+
+
+//drop all blocks. Called with the mutex held
+static void rdirect_cache_clear(struct rdirect_cache_segment * const cache)
+{
+   const uint32_t numBlocks = cache->header->numBlocks;
+   for (uint32_t i = 0; i < numBlocks; ++i)
+   {
+      cache->buckets[i] = -1;
+      cache->blocks[i].len = 0;
+      cache->blocks[i].ref = 0;
+      cache->blocks[i].next = -1;
+   }
+   cache->header->hand = 0;
+   ++cache->header->epoch;
+}
+
+
+
+//set up the view `cache` of the (initialized) segment at `memory`
+static void rdirect_cache_map(struct rdirect_cache_segment * const cache, void * const memory)
+{
+   cache->header = (struct rdirect_cache_header *)memory;
+   const uint32_t numBlocks = cache->header->numBlocks;
+   //the blocks go first, as they require the larger alignment
+   cache->blocks = (struct rdirect_cache_block *)(cache->header + 1);
+   cache->buckets = (int32_t *)(cache->blocks + numBlocks);
+   cache->data = (uint8_t *)memory + rdirect_cache_data_offset(numBlocks);
+}
+
+
+
+//initialize a segment of `size` bytes at `memory`, just created
+static bool rdirect_cache_init(void * const memory, const size_t size)
+{
+   struct rdirect_cache_header *header = (struct rdirect_cache_header *)memory;
+   if (size <= sizeof(*header))
+   {
+      return false;
+   }
+   const size_t perBlock = RDIRECT_CACHE_BLOCK + sizeof(int32_t) + sizeof(struct rdirect_cache_block);
+   uint32_t numBlocks = (uint32_t)MIN((size - sizeof(*header)) / perBlock, (size_t)INT32_MAX);
+   while ((numBlocks > 0) && (rdirect_cache_data_offset(numBlocks) + (size_t)numBlocks * RDIRECT_CACHE_BLOCK > size))
+   {
+      --numBlocks;
+   }
+   if ((numBlocks == 0) || !rdirect_shm_mutex_init(&header->mutex))
+   {
+      return false;
+   }
+
+   header->numBlocks = numBlocks;
+   header->size = size;
+   header->epoch = 0;
+   struct rdirect_cache_segment cache;
+   rdirect_cache_map(&cache, memory);
+   rdirect_cache_clear(&cache);
+   header->magic = RDIRECT_CACHE_MAGIC;
+   return true;
+}
+
+
+
+//check a segment of `size` bytes at `memory`, created by another process
+static bool rdirect_cache_check(const void * const memory, const size_t size)
+{
+   const struct rdirect_cache_header *header = (const struct rdirect_cache_header *)memory;
+   return (size >= sizeof(*header)) && (header->magic == RDIRECT_CACHE_MAGIC) && (header->size == size);
+}
+
+
+
+/*
+ * Map the shared cache segment into this process. It is created with `size` bytes by the first process.
+ * Later processes use the segment as it is (a new size takes effect, when the segment has been removed, e.g. after
+ * a reboot). Returns false, if the cache is not available.
+ */
+static bool rdirect_cache_attach(const size_t size)
+{
+   if (rdirect_cache != NULL)
+   {
+      return true;
+   }
+
+   size_t mapSize = 0;
+   void *memory = rdirect_shm_attach(RDIRECT_CACHE_NAME, size, rdirect_cache_init, rdirect_cache_check, &mapSize);
+   if (memory == NULL)
+   {
+      return false;
+   }
+   if (mapSize != size)
+   {
+      DEBUG(3, ("vfs_rdirect:cache Using existing cache of %zu bytes.\n", mapSize));
+   }
+   static struct rdirect_cache_segment segment;
+   rdirect_cache_map(&segment, memory);
+   rdirect_cache = &segment;
+   return true;
+}
+
+
+
+//lock the cache. Returns false on error
+static bool rdirect_cache_lock(struct rdirect_cache_segment * const cache)
+{
+   const int ret = pthread_mutex_lock(&cache->header->mutex);
+   if (ret == EOWNERDEAD)
+   {
+      //the owner died in the middle of an update -> start over with an empty cache
+      pthread_mutex_consistent(&cache->header->mutex);
+      rdirect_cache_clear(cache);
+      return true;
+   }
+   return (ret == 0);
+}
+
+
+
+static void rdirect_cache_unlock(struct rdirect_cache_segment * const cache)
+{
+   pthread_mutex_unlock(&cache->header->mutex);
+}
+
+
+
+static uint32_t rdirect_cache_bucket(const struct rdirect_cache_segment * const cache, const uint64_t dev,
+         const uint64_t ino, const uint64_t offset)
+{
+   uint64_t hash = (dev * 0x9E3779B97F4A7C15ULL) ^ (ino * 0xC2B2AE3D27D4EB4FULL)
+         ^ ((offset / RDIRECT_CACHE_BLOCK) * 0x165667B19E3779F9ULL);
+   hash ^= hash >> 29;
+   return (uint32_t)(hash % cache->header->numBlocks);
+}
+
+
+
+//get the block of `file` at `offset`, of any generation if `anyGeneration` (-1: not cached). Called with the mutex held
+static int32_t rdirect_cache_find(const struct rdirect_cache_segment * const cache,
+         const struct rdirect_cache_file * const file, const uint64_t offset, const bool anyGeneration)
+{
+   int32_t i = cache->buckets[rdirect_cache_bucket(cache, file->dev, file->ino, offset)];
+   while (i >= 0)
+   {
+      const struct rdirect_cache_block *block = &cache->blocks[i];
+      if ((block->file.ino == file->ino) && (block->file.dev == file->dev) && (block->offset == offset)
+            && (anyGeneration || (block->file.generation == file->generation)))
+      {
+         return i;
+      }
+      i = block->next;
+   }
+   return -1;
+}
+
+
+
+//drop the block `i` (if used). Called with the mutex held
+static void rdirect_cache_unlink(struct rdirect_cache_segment * const cache, const int32_t i)
+{
+   struct rdirect_cache_block *block = &cache->blocks[i];
+   if (block->len == 0)
+   {
+      return;
+   }
+   int32_t *link = &cache->buckets[rdirect_cache_bucket(cache, block->file.dev, block->file.ino, block->offset)];
+   while (*link >= 0)
+   {
+      if (*link == i)
+      {
+         *link = block->next;
+         break;
+      }
+      link = &cache->blocks[*link].next;
+   }
+   block->len = 0;
+   block->next = -1;
+}
+
+
+
+/*
+ * Read `n` bytes at `offset` of `file` from the cache into `data`.
+ * Returns true, if the whole range is cached. The number of bytes read is returned in `count`.
+ */
+static bool rdirect_cache_read(const struct rdirect_cache_file * const file, void * const data, const size_t n,
+         const off_t offset, ssize_t * const count)
+{
+   struct rdirect_cache_segment *cache = rdirect_cache;
+   if ((cache == NULL) || (file->ino == 0) || !rdirect_cache_lock(cache))
+   {
+      return false;
+   }
+
+   const off_t end = offset + (off_t)n;
+   off_t blockOffset = (offset / RDIRECT_CACHE_BLOCK) * RDIRECT_CACHE_BLOCK;
+   for (; blockOffset < end; blockOffset += RDIRECT_CACHE_BLOCK)
+   {
+      const int32_t i = rdirect_cache_find(cache, file, (uint64_t)blockOffset, false);
+      if (i < 0)
+      {
+         rdirect_cache_unlock(cache);
+         return false;
+      }
+      struct rdirect_cache_block *block = &cache->blocks[i];
+      block->ref = 1;
+      const off_t from = MAX(offset, blockOffset);
+      const off_t to = MIN(end, blockOffset + (off_t)block->len);
+      memcpy((uint8_t *)data + (from - offset),
+            cache->data + (size_t)i * RDIRECT_CACHE_BLOCK + (from - blockOffset), (size_t)(to - from));
+   }
+   rdirect_cache_unlock(cache);
+   *count = (ssize_t)n;
+   return true;
+}
+
+
+
+//get the current invalidation epoch (reads started before an invalidation, must not fill the cache)
+static uint64_t rdirect_cache_epoch(void)
+{
+   return (rdirect_cache != NULL) ? __atomic_load_n(&rdirect_cache->header->epoch, __ATOMIC_ACQUIRE) : 0;
+}
+
+
+
+//fill the cache with the whole blocks contained in `len` bytes of `file`, read at `offset` into `data` while in `epoch`
+static void rdirect_cache_fill(const struct rdirect_cache_file * const file, const uint64_t epoch,
+         const void * const data, const off_t offset, const size_t len)
+{
+   struct rdirect_cache_segment *cache = rdirect_cache;
+   if ((cache == NULL) || (file->ino == 0) || !rdirect_cache_lock(cache))
+   {
+      return;
+   }
+   if (cache->header->epoch != epoch)
+   {
+      rdirect_cache_unlock(cache); //the file may have been written, while the data was read
+      return;
+   }
+
+   const off_t end = offset + (off_t)len;
+   off_t blockOffset = ((offset + RDIRECT_CACHE_BLOCK - 1) / RDIRECT_CACHE_BLOCK) * RDIRECT_CACHE_BLOCK;
+   for (; blockOffset + RDIRECT_CACHE_BLOCK <= end; blockOffset += RDIRECT_CACHE_BLOCK)
+   {
+      if (rdirect_cache_find(cache, file, (uint64_t)blockOffset, false) >= 0)
+      {
+         continue;
+      }
+
+      //find a victim: the next block not accessed since the hand passed last
+      struct rdirect_cache_header *header = cache->header;
+      int32_t i = -1;
+      for (uint32_t k = 0; (i < 0) && (k < 2 * header->numBlocks); ++k)
+      {
+         struct rdirect_cache_block *block = &cache->blocks[header->hand];
+         if ((block->len == 0) || (block->ref == 0))
+         {
+            i = (int32_t)header->hand;
+         }
+         block->ref = 0;
+         header->hand = (header->hand + 1) % header->numBlocks;
+      }
+      rdirect_cache_unlink(cache, i);
+
+      struct rdirect_cache_block *block = &cache->blocks[i];
+      const uint32_t bucket = rdirect_cache_bucket(cache, file->dev, file->ino, (uint64_t)blockOffset);
+      memcpy(cache->data + (size_t)i * RDIRECT_CACHE_BLOCK, (const uint8_t *)data + (blockOffset - offset),
+            RDIRECT_CACHE_BLOCK);
+      block->file = *file;
+      block->offset = (uint64_t)blockOffset;
+      block->len = RDIRECT_CACHE_BLOCK;
+      block->ref = 0;
+      block->next = cache->buckets[bucket];
+      cache->buckets[bucket] = i;
+   }
+   rdirect_cache_unlock(cache);
+}
+
+
+
+//drop the cached blocks of `file` (of any generation), overlapping [offset, end). `end` < 0: up to end of file
+static void rdirect_cache_invalidate(const struct rdirect_cache_file * const file, const off_t offset, const off_t end)
+{
+   struct rdirect_cache_segment *cache = rdirect_cache;
+   if ((cache == NULL) || (file->ino == 0) || !rdirect_cache_lock(cache))
+   {
+      return;
+   }
+
+   struct rdirect_cache_header *header = cache->header;
+   ++header->epoch;
+   const off_t first = (offset / RDIRECT_CACHE_BLOCK) * RDIRECT_CACHE_BLOCK;
+   if ((end < 0) || ((uint64_t)(end - first) / RDIRECT_CACHE_BLOCK >= header->numBlocks))
+   {
+      //large range -> scan all blocks
+      for (uint32_t i = 0; i < header->numBlocks; ++i)
+      {
+         const struct rdirect_cache_block *block = &cache->blocks[i];
+         if ((block->len > 0) && (block->file.ino == file->ino) && (block->file.dev == file->dev)
+               && (block->offset >= (uint64_t)first) && ((end < 0) || (block->offset < (uint64_t)end)))
+         {
+            rdirect_cache_unlink(cache, (int32_t)i);
+         }
+      }
+   }
+   else
+   {
+      for (off_t blockOffset = first; blockOffset < end; blockOffset += RDIRECT_CACHE_BLOCK)
+      {
+         int32_t i = -1;
+         while ((i = rdirect_cache_find(cache, file, (uint64_t)blockOffset, true)) >= 0)
+         {
+            rdirect_cache_unlink(cache, i);
+         }
+      }
+   }
+   rdirect_cache_unlock(cache);
+}
+
+
+
+/*
+ * I/O statistics (`rdirect:stats`), kept in a shared memory segment with one slot per share
+ * (see vfs_rdirect_stats.h). Counters are updated atomically, without locking.
+ */
+static struct rdirect_stats_segment *rdirect_statsSegment = NULL; //segment mapped by this process (NULL, if none)
+
+
+
+static bool rdirect_stats_init(void * const memory, const size_t size)
+{
+   struct rdirect_stats_segment *segment = (struct rdirect_stats_segment *)memory;
+   if ((size < sizeof(*segment)) || !rdirect_shm_mutex_init(&segment->mutex))
+   {
+      return false;
+   }
+   segment->numShares = RDIRECT_STATS_SHARES;
+   segment->magic = RDIRECT_STATS_MAGIC; //the slots are zeroed already (new segment)
+   return true;
+}
+
+
+
+static bool rdirect_stats_check(const void * const memory, const size_t size)
+{
+   const struct rdirect_stats_segment *segment = (const struct rdirect_stats_segment *)memory;
+   return (size == sizeof(*segment)) && (segment->magic == RDIRECT_STATS_MAGIC)
+         && (segment->numShares == RDIRECT_STATS_SHARES);
+}
+
+
+
+//get the statistics slot of share `share`. It is allocated on first use. Returns NULL, if not available
+static struct rdirect_stats *rdirect_stats_get(const char * const share)
+{
+   if (rdirect_statsSegment == NULL)
+   {
+      size_t mapSize = 0;
+      rdirect_statsSegment = (struct rdirect_stats_segment *)rdirect_shm_attach(RDIRECT_STATS_NAME,
+            sizeof(struct rdirect_stats_segment), rdirect_stats_init, rdirect_stats_check, &mapSize);
+      if (rdirect_statsSegment == NULL)
+      {
+         return NULL;
+      }
+   }
+
+   struct rdirect_stats_segment *segment = rdirect_statsSegment;
+   const int ret = pthread_mutex_lock(&segment->mutex);
+   if (ret == EOWNERDEAD)
+   {
+      pthread_mutex_consistent(&segment->mutex); //a slot is allocated by writing its name only
+   }
+   else if (ret != 0)
+   {
+      return NULL;
+   }
+   struct rdirect_stats *stats = NULL;
+   for (unsigned int i = 0; (stats == NULL) && (i < RDIRECT_STATS_SHARES); ++i)
+   {
+      struct rdirect_stats *slot = &segment->shares[i];
+      if (slot->share[0] == '\0')
+      {
+         strlcpy(slot->share, share, sizeof(slot->share));
+         stats = slot;
+      }
+      else if (strncmp(slot->share, share, sizeof(slot->share) - 1) == 0)
+      {
+         stats = slot;
+      }
+   }
+   pthread_mutex_unlock(&segment->mutex);
+
+   if (stats == NULL)
+   {
+      DEBUG(1, ("vfs_rdirect:stats No free slot for share %s.\n", share));
+   }
+   return stats;
+}
+
+
+
+static void rdirect_count(struct rdirect_stats * const stats, const enum rdirect_stats_counter counter,
+         const uint64_t value)
+{
+   if (stats != NULL)
+   {
+      __atomic_fetch_add(&stats->counters[counter], value, __ATOMIC_RELAXED);
+   }
+}
+
+
+
+//count a read or write request, returning `count` (-1: failed)
+static void rdirect_count_request(struct rdirect_stats * const stats, const bool write, const ssize_t count)
+{
+   if (stats == NULL)
+   {
+      return;
+   }
+   rdirect_count(stats, write ? RDIRECT_STATS_WRITES : RDIRECT_STATS_READS, 1);
+   if (count < 0)
+   {
+      rdirect_count(stats, write ? RDIRECT_STATS_WRITE_ERRORS : RDIRECT_STATS_READ_ERRORS, 1);
+   }
+   else
+   {
+      rdirect_count(stats, write ? RDIRECT_STATS_WRITE_BYTES : RDIRECT_STATS_READ_BYTES, (uint64_t)count);
+   }
+}
+
+
+
+//add a device read of `duration` [ns], performed by `engine`, to the latency histogram
+static void rdirect_stats_latency(struct rdirect_stats * const stats, const enum rdirect_engine engine,
+         const uint64_t duration)
+{
+   if (stats == NULL)
+   {
+      return;
+   }
+   const uint64_t us = duration / 1000;
+   const unsigned int bucket = (us > 1) ? MIN((unsigned int)(63 - __builtin_clzll(us)), RDIRECT_STATS_BUCKETS - 1) : 0;
+   __atomic_fetch_add(&stats->latency[engine][bucket], 1, __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * QoS of direct reads (`rdirect:qos ...`): token buckets, limiting bandwidth and IOPS.
+ *
+ * A bucket holds byte and request tokens, refilled at the configured rates, up to RDIRECT_QOS_BURST_MS worth of
+ * them. A request is admitted, as long as the bucket is not in debt, and takes its tokens then. So requests larger
+ * than the burst pass as well, their debt delays the following ones. Asynchronous requests over the limit are
+ * queued (per tree connect, in order), and admitted by a timer, when the debt has been paid off.
+ * The bucket is per tree connect (scope `connection`, i.e. per client, as every client has an smbd process of its
+ * own), or shared by all smbd processes serving the same user on the share (`user`), or the share (`share`). Shared
+ * buckets reside in the shared memory segment RDIRECT_QOS_NAME, protected by a process shared mutex.
+ */
+#define RDIRECT_QOS_NAME        "/vfs_rdirect.qos"   //name of the shared memory segment
+#define RDIRECT_QOS_MAGIC       0x52445131           //"RDQ1"
+#define RDIRECT_QOS_SLOTS       256                  //number of shared buckets
+#define RDIRECT_QOS_KEY         128                  //max. length of a bucket key (including termination)
+#define RDIRECT_QOS_BURST_MS    100                  //capacity of a bucket [ms of its rates]
+
+enum rdirect_qos_scope {
+   RDIRECT_QOS_SCOPE_CONNECTION, //bucket per tree connect
+   RDIRECT_QOS_SCOPE_USER, //bucket per share and user, shared by all smbd processes
+   RDIRECT_QOS_SCOPE_SHARE //bucket per share, shared by all smbd processes
+};
+
+static const struct enum_list rdirect_qos_scopes[] = {
+   { RDIRECT_QOS_SCOPE_CONNECTION, "connection" },
+   { RDIRECT_QOS_SCOPE_USER, "user" },
+   { RDIRECT_QOS_SCOPE_SHARE, "share" },
+   { -1, NULL }
+};
+
+struct rdirect_qos_bucket {
+   double bytes; //byte tokens (negative: in debt)
+   double ios; //request tokens (negative: in debt)
+   int64_t stamp; //time of the last refill [ns] (0: not used yet)
+};
+
+struct rdirect_qos_slot {
+   char key[RDIRECT_QOS_KEY]; //share (and user) the bucket belongs to (empty: slot is unused)
+   struct rdirect_qos_bucket bucket;
+};
+
+struct rdirect_qos_segment {
+   uint32_t magic; //set, when the segment is initialized
+   uint32_t numSlots; //number of slots
+   pthread_mutex_t mutex; //serializes the access to the buckets (process shared, robust)
+   struct rdirect_qos_slot slots[RDIRECT_QOS_SLOTS];
+};
+
+static struct rdirect_qos_segment *rdirect_qosSegment = NULL; //segment mapped by this process (NULL, if none)
+
+struct rdirect_pread_state;
+
+struct rdirect_qos {
+   double bandwidth; //limit [bytes/s] (0: not limited)
+   double iops; //limit [requests/s] (0: not limited)
+   struct rdirect_qos_bucket local; //bucket of scope connection
+   struct rdirect_qos_bucket *bucket; //bucket in use: `local`, or a slot of the shared segment
+   struct rdirect_pread_state *queue; //requests waiting for admission, in order
+   struct tevent_timer *timer; //admits the queued requests (set, while the queue is not empty)
+};
+
+
+
+static bool rdirect_qos_init(void * const memory, const size_t size)
+{
+   struct rdirect_qos_segment *segment = (struct rdirect_qos_segment *)memory;
+   if ((size < sizeof(*segment)) || !rdirect_shm_mutex_init(&segment->mutex))
+   {
+      return false;
+   }
+   segment->numSlots = RDIRECT_QOS_SLOTS;
+   segment->magic = RDIRECT_QOS_MAGIC; //the slots are zeroed already (new segment)
+   return true;
+}
+
+
+
+static bool rdirect_qos_check(const void * const memory, const size_t size)
+{
+   const struct rdirect_qos_segment *segment = (const struct rdirect_qos_segment *)memory;
+   return (size == sizeof(*segment)) && (segment->magic == RDIRECT_QOS_MAGIC)
+         && (segment->numSlots == RDIRECT_QOS_SLOTS);
+}
+
+
+
+//lock the shared segment. Returns false on error
+static bool rdirect_qos_lock_segment(struct rdirect_qos_segment * const segment)
+{
+   const int ret = pthread_mutex_lock(&segment->mutex);
+   if (ret == EOWNERDEAD)
+   {
+      pthread_mutex_consistent(&segment->mutex); //a bucket is a hint only, it may be off after a crash
+      return true;
+   }
+   return (ret == 0);
+}
+
+
+
+//get the shared bucket with key `key`. It is allocated on first use. Returns NULL, if not available
+static struct rdirect_qos_bucket *rdirect_qos_shared(const char * const key)
+{
+   if (rdirect_qosSegment == NULL)
+   {
+      size_t mapSize = 0;
+      rdirect_qosSegment = (struct rdirect_qos_segment *)rdirect_shm_attach(RDIRECT_QOS_NAME,
+            sizeof(struct rdirect_qos_segment), rdirect_qos_init, rdirect_qos_check, &mapSize);
+      if (rdirect_qosSegment == NULL)
+      {
+         return NULL;
+      }
+   }
+
+   struct rdirect_qos_segment *segment = rdirect_qosSegment;
+   if (!rdirect_qos_lock_segment(segment))
+   {
+      return NULL;
+   }
+   struct rdirect_qos_bucket *bucket = NULL;
+   for (unsigned int i = 0; (bucket == NULL) && (i < RDIRECT_QOS_SLOTS); ++i)
+   {
+      struct rdirect_qos_slot *slot = &segment->slots[i];
+      if (slot->key[0] == '\0')
+      {
+         strlcpy(slot->key, key, sizeof(slot->key));
+         bucket = &slot->bucket;
+      }
+      else if (strncmp(slot->key, key, sizeof(slot->key) - 1) == 0)
+      {
+         bucket = &slot->bucket;
+      }
+   }
+   pthread_mutex_unlock(&segment->mutex);
+
+   if (bucket == NULL)
+   {
+      DEBUG(1, ("vfs_rdirect:qos No free slot for %s.\n", key));
+   }
+   return bucket;
+}
+
+
+
+/*
+ * Set up the QoS of a tree connect to share `share` by user `user` (allocated on `mem_ctx`).
+ * Returns NULL, if the reads of the share are not limited (or on out of memory).
+ */
+static struct rdirect_qos *rdirect_qos_new(TALLOC_CTX * const mem_ctx, const uint64_t bandwidth,
+         const uint64_t iops, const enum rdirect_qos_scope scope, const char * const share, const char * const user)
+{
+   if ((bandwidth == 0) && (iops == 0))
+   {
+      return NULL;
+   }
+   struct rdirect_qos *qos = talloc_zero(mem_ctx, struct rdirect_qos);
+   if (qos == NULL)
+   {
+      DEBUG(1, ("vfs_rdirect:qos Out of memory, reads are not limited.\n"));
+      return NULL;
+   }
+   qos->bandwidth = (double)bandwidth;
+   qos->iops = (double)iops;
+   qos->bucket = &qos->local;
+   if (scope != RDIRECT_QOS_SCOPE_CONNECTION)
+   {
+      //backslash is not valid in share names, so the keys of the scopes don't collide
+      char key[RDIRECT_QOS_KEY];
+      snprintf(key, sizeof(key), (scope == RDIRECT_QOS_SCOPE_USER) ? "%s\\%s" : "%s", share, user);
+      struct rdirect_qos_bucket *bucket = rdirect_qos_shared(key);
+      if (bucket == NULL)
+      {
+         DEBUG(1, ("vfs_rdirect:qos Shared bucket not available, limiting per connection.\n"));
+      }
+      else
+      {
+         qos->bucket = bucket;
+      }
+   }
+   return qos;
+}
+
+
+
+/*
+ * Take the tokens of a read request of `n` bytes from the bucket of `qos`. Unless `force`d, the tokens are taken
+ * only, if the bucket is not in debt.
+ * Returns 0, if the tokens have been taken, otherwise the time [ns] until the debt is paid off.
+ */
+static int64_t rdirect_qos_take(struct rdirect_qos * const qos, const size_t n, const bool force)
+{
+   struct rdirect_qos_bucket *bucket = qos->bucket;
+   const bool shared = (bucket != &qos->local);
+   if (shared && !rdirect_qos_lock_segment(rdirect_qosSegment))
+   {
+      return 0; //not limited, rather than stalled
+   }
+
+   struct timespec now;
+   PROFILE_TIMESTAMP(&now);
+   const int64_t stamp = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+   const double elapsed = (bucket->stamp > 0) ? (double)MAX(stamp - bucket->stamp, 0) / 1e9 : 1.0;
+   bucket->stamp = stamp;
+   bucket->bytes = MIN(bucket->bytes + qos->bandwidth * elapsed, qos->bandwidth * RDIRECT_QOS_BURST_MS / 1000.0);
+   bucket->ios = MIN(bucket->ios + qos->iops * elapsed, MAX(qos->iops * RDIRECT_QOS_BURST_MS / 1000.0, 1.0));
+
+   double wait = 0.0; //[s]
+   if ((qos->bandwidth > 0) && (bucket->bytes < 0))
+   {
+      wait = -bucket->bytes / qos->bandwidth;
+   }
+   if ((qos->iops > 0) && (bucket->ios < 0))
+   {
+      wait = MAX(wait, -bucket->ios / qos->iops);
+   }
+   if (force || (wait <= 0.0))
+   {
+      bucket->bytes -= (qos->bandwidth > 0) ? (double)n : 0.0;
+      bucket->ios -= (qos->iops > 0) ? 1.0 : 0.0;
+      wait = 0.0;
+   }
+
+   if (shared)
+   {
+      pthread_mutex_unlock(&rdirect_qosSegment->mutex);
+   }
+   return (wait > 0.0) ? MAX((int64_t)(wait * 1e9), 1) : 0;
+}
+
+
+
+/*
+ * Rules by file name (rdirect:include, rdirect:exclude), compiled once per connection.
+ *
+ * Patterns are matched case insensitively against the last component of a file's path, or against the whole
+ * path relative to the share, if the pattern contains a slash. Suffix patterns (`*` followed by a literal, e.g.
+ * `*.mxf`) go into a trie of the reversed suffixes, so a name is matched against all of them by a single walk
+ * from its end. Other patterns are matched one by one (fnmatch).
+ * A file matching an exclude pattern is excluded, even if it matches an include pattern as well.
+ */
+#define RDIRECT_RULE_INCLUDE  0x1   //read direct, whatever its size and access pattern
+#define RDIRECT_RULE_EXCLUDE  0x2   //read via page cache
+
+struct rdirect_rule_node {
+   char c; //character of the edge from the parent (lower case)
+   uint8_t rules; //rules of the suffix ending at this node
+   int child; //first child (-1: none)
+   int sibling; //next sibling (-1: none)
+};
+
+struct rdirect_rule_glob {
+   const char *pattern;
+   bool path; //match against the whole path
+   uint8_t rule;
+};
+
+struct rdirect_rules {
+   struct rdirect_rule_node *nodes; //trie of the suffix patterns (node 0: root, the empty suffix)
+   unsigned int numNodes;
+   struct rdirect_rule_glob *globs; //other patterns
+   unsigned int numGlobs;
+   char *strings; //copies of the other patterns
+};
+
+
+
+//get the child of trie node `node` on character `c` (-1: none)
+static int rdirect_rules_child(const struct rdirect_rules * const rules, const int node, const char c)
+{
+   int child = rules->nodes[node].child;
+   while ((child >= 0) && (rules->nodes[child].c != c))
+   {
+      child = rules->nodes[child].sibling;
+   }
+   return child;
+}
+
+
+
+//get the literal suffix of a pattern like `*.mxf`, NULL if `pattern` is not a suffix pattern
+static const char *rdirect_rules_suffix(const char * const pattern)
+{
+   if ((pattern[0] != '*') || (strpbrk(pattern + 1, "*?[\\/") != NULL))
+   {
+      return NULL;
+   }
+   return pattern + 1;
+}
+
+
+
+/*
+ * Compile the patterns of the NULL terminated lists `include` and `exclude` (either may be NULL).
+ * Returns NULL, if there are no patterns (or on out of memory, which is logged).
+ */
+static struct rdirect_rules *rdirect_rules_compile(TALLOC_CTX * const mem_ctx, const char ** const include,
+         const char ** const exclude)
+{
+   const char ** const lists[] = { include, exclude };
+   const uint8_t kinds[] = { RDIRECT_RULE_INCLUDE, RDIRECT_RULE_EXCLUDE };
+
+   //size the trie and the other patterns
+   unsigned int maxNodes = 1;
+   unsigned int maxGlobs = 0;
+   size_t stringsSize = 0;
+   for (unsigned int l = 0; l < ARRAY_SIZE(lists); ++l)
+   {
+      for (unsigned int i = 0; (lists[l] != NULL) && (lists[l][i] != NULL); ++i)
+      {
+         const char * const suffix = rdirect_rules_suffix(lists[l][i]);
+         if (suffix != NULL)
+         {
+            maxNodes += (unsigned int)strlen(suffix);
+         }
+         else if (lists[l][i][0] != '\0')
+         {
+            ++maxGlobs;
+            stringsSize += strlen(lists[l][i]) + 1;
+         }
+      }
+   }
+   if ((maxNodes == 1) && (maxGlobs == 0))
+   {
+      return NULL;
+   }
+
+   struct rdirect_rules *rules = talloc_zero(mem_ctx, struct rdirect_rules);
+   if (rules != NULL)
+   {
+      rules->nodes = talloc_zero_array(rules, struct rdirect_rule_node, maxNodes);
+      rules->globs = talloc_zero_array(rules, struct rdirect_rule_glob, MAX(maxGlobs, 1));
+      rules->strings = talloc_zero_array(rules, char, MAX(stringsSize, 1));
+   }
+   if ((rules == NULL) || (rules->nodes == NULL) || (rules->globs == NULL) || (rules->strings == NULL))
+   {
+      DEBUG(1, ("vfs_rdirect:connect Out of memory for include/exclude rules, ignoring them.\n"));
+      TALLOC_FREE(rules);
+      return NULL;
+   }
+   rules->nodes[0].child = -1;
+   rules->nodes[0].sibling = -1;
+   rules->numNodes = 1;
+
+   char *string = rules->strings;
+   for (unsigned int l = 0; l < ARRAY_SIZE(lists); ++l)
+   {
+      for (unsigned int i = 0; (lists[l] != NULL) && (lists[l][i] != NULL); ++i)
+      {
+         const char * const pattern = lists[l][i];
+         const char * const suffix = rdirect_rules_suffix(pattern);
+         if (suffix != NULL)
+         {
+            //insert the suffix reversed, from its last character on
+            int node = 0;
+            for (size_t k = strlen(suffix); k > 0; --k)
+            {
+               const char c = (char)tolower((unsigned char)suffix[k - 1]);
+               int child = rdirect_rules_child(rules, node, c);
+               if (child < 0)
+               {
+                  child = (int)rules->numNodes++;
+                  rules->nodes[child].c = c;
+                  rules->nodes[child].child = -1;
+                  rules->nodes[child].sibling = rules->nodes[node].child;
+                  rules->nodes[node].child = child;
+               }
+               node = child;
+            }
+            rules->nodes[node].rules |= kinds[l];
+         }
+         else if (pattern[0] != '\0')
+         {
+            struct rdirect_rule_glob * const glob = &rules->globs[rules->numGlobs++];
+            const size_t len = strlen(pattern);
+            memcpy(string, pattern, len + 1);
+            glob->pattern = string;
+            glob->path = (strchr(pattern, '/') != NULL);
+            glob->rule = kinds[l];
+            string += len + 1;
+         }
+      }
+   }
+   DEBUG(5, ("vfs_rdirect:connect Compiled include/exclude rules: %u suffix nodes, %u other patterns\n",
+         rules->numNodes - 1, rules->numGlobs));
+   return rules;
+}
+
+
+
+//get the rules (RDIRECT_RULE_*), that the file at `path` (relative to the share) matches
+static uint8_t rdirect_rules_match(const struct rdirect_rules * const rules, const char * const path)
+{
+   if ((rules == NULL) || (path == NULL))
+   {
+      return 0;
+   }
+   const char * const slash = strrchr(path, '/');
+   const char * const name = (slash != NULL) ? slash + 1 : path;
+
+   uint8_t matched = rules->nodes[0].rules;
+   int node = 0;
+   for (size_t k = strlen(name); (k > 0) && (node >= 0); --k)
+   {
+      node = rdirect_rules_child(rules, node, (char)tolower((unsigned char)name[k - 1]));
+      if (node >= 0)
+      {
+         matched |= rules->nodes[node].rules;
+      }
+   }
+   for (unsigned int i = 0; i < rules->numGlobs; ++i)
+   {
+      const struct rdirect_rule_glob * const glob = &rules->globs[i];
+      if (((matched & glob->rule) == 0) && (fnmatch(glob->pattern, glob->path ? path : name, FNM_CASEFOLD) == 0))
+      {
+         matched |= glob->rule;
+      }
+   }
+   return matched;
+}
+
+
+
+/*
+ * Per file handle data (stored as fsp extension).
+ * Whether a file is accessed direct or via page cache, is decided once, when the handle is opened.
+ * For direct access, the O_DIRECT descriptor is opened next to the normal one, and reused by all reads and writes
+ * on the handle.
+ */
+struct rdirect_readahead;
+static void rdirect_ra_free(struct rdirect_readahead *ra);
+
+/*
+ * Access pattern of a file handle (`rdirect:adaptive`), see rdirect_pattern_buffered.
+ */
+#define RDIRECT_PATTERN_RANGES   8   //number of recent reads, repeated reads are detected among
+#define RDIRECT_PATTERN_LIMIT    8   //bound of the score
+#define RDIRECT_PATTERN_SWITCH   4   //score, at which the mode is switched
+
+struct rdirect_pattern {
+   off_t start[RDIRECT_PATTERN_RANGES]; //ranges of the recent reads (ring buffer)
+   off_t end[RDIRECT_PATTERN_RANGES];
+   unsigned int next; //next entry of the ring buffer to use
+   off_t last; //end of the previous read (-1: none)
+   int score; //> 0: small random or repeated reads prevail, < 0: large reads prevail
+   bool buffered; //read via page cache
+};
+
+/*
+ * A descriptor, referenced by the file handle and by its asynchronous reads and writes (main thread only).
+ * It is closed with the last reference. So a worker thread, that still reads from or writes to it when the handle
+ * is closed (e.g. for a request abandoned in flight), can't hit a reused descriptor number.
+ */
+struct rdirect_dfd {
+   unsigned int refs;
+   int fd;
+};
+
+
+
+//take ownership of descriptor `fd` (closed, if out of memory). Returns the referenced descriptor, or NULL on error
+static struct rdirect_dfd *rdirect_dfd_new(const int fd)
+{
+   if (fd < 0)
+   {
+      return NULL;
+   }
+   struct rdirect_dfd *dfd = malloc(sizeof(*dfd));
+   if (dfd == NULL)
+   {
+      close(fd);
+      errno = ENOMEM;
+      return NULL;
+   }
+   dfd->refs = 1;
+   dfd->fd = fd;
+   return dfd;
+}
+
+
+
+//add a reference to `dfd` (may be NULL). Returns `dfd`
+static struct rdirect_dfd *rdirect_dfd_ref(struct rdirect_dfd * const dfd)
+{
+   if (dfd != NULL)
+   {
+      ++dfd->refs;
+   }
+   return dfd;
+}
+
+
+
+//drop a reference to `dfd` (may be NULL). The descriptor is closed with the last one
+static void rdirect_dfd_unref(struct rdirect_dfd * const dfd)
+{
+   if ((dfd != NULL) && (--dfd->refs == 0))
+   {
+      close(dfd->fd);
+      free(dfd);
+   }
+}
+
+
+
+struct rdirect_fsp {
+   bool decided; //access mode has been decided (see rdirect_fsp_setup)
+   bool direct; //access with O_DIRECT (otherwise the normal descriptor is used, i.e. the page cache)
+   bool fallback; //file should be accessed direct, but can't (e.g. the filesystem doesn't support O_DIRECT)
+   bool included; //file matches rdirect:include (read direct, whatever its size and access pattern)
+   bool excluded; //file matches rdirect:exclude (read via page cache)
+   bool wantWrite; //handle is opened for write
+   bool writable; //fd is opened for read and write (otherwise for read only)
+   int fd; //file descriptor opened with O_DIRECT flag set (-1 if not opened yet)
+   struct rdirect_dfd *dfd; //reference to fd, held by the handle (NULL if not opened yet)
+   struct rdirect_align align; //O_DIRECT alignment of the file (valid, if fd >= 0)
+   struct rdirect_readahead *ra; //read-ahead (NULL, if not used)
+   struct rdirect_cache_file file; //key of the file in the block cache
+   off_t size; //size of the file, as far as known (refreshed, when a read reaches beyond), -1 if unknown
+   struct rdirect_pattern pattern; //access pattern (if rdirect:adaptive)
+   struct rdirect_raw *raw; //extent map for raw reads (NULL: read through the filesystem)
+};
+
+
+
+static void rdirect_fsp_destroy(void *p_data)
+{
+   struct rdirect_fsp *rfsp = (struct rdirect_fsp *)p_data;
+   if (rfsp->ra != NULL)
+   {
+      rdirect_ra_free(rfsp->ra);
+      rfsp->ra = NULL;
+   }
+   rdirect_dfd_unref(rfsp->dfd); //closes fd, unless reads or writes are still in flight
+   rfsp->dfd = NULL;
+   rfsp->fd = -1;
+   rdirect_raw_unref(rfsp->raw);
+   rfsp->raw = NULL;
+}
+
+
+
+/*
+ * Open a second descriptor for direct access, referring to the same file as the (already open) descriptor `fd`.
+ * The file is reopened via its /proc/self/fd magic link. This doesn't walk the file's path again,
+ * so it works for arbitrarily long paths and for files that have been renamed in the meantime.
+ * `accmode` is O_RDONLY, or O_RDWR for handles that write (the descriptor is read from as well).
+ * Returns the file descriptor, or -1 on error.
+ */
+static int rdirect_reopen_direct(const int fd, const int accmode)
+{
+   char linkPath[64];
+   snprintf(linkPath, sizeof(linkPath), "/proc/self/fd/%d", fd);
+
+   int dfd = open(linkPath, accmode | O_DIRECT | O_CLOEXEC | O_NOCTTY); //here we open the file with O_DIRECT flag set!!!
+   if (dfd < 0)
+   {
+      const int err = errno;
+      DEBUG(10, ("vfs_rdirect:open Failed to reopen fd %d for direct access. Code %d\n",
+            fd, err));
+      errno = err;
+      return -1;
+   }
+   return dfd;
+}
+
+
+
+/*
+ * Get the per file handle data of `fsp`. It is created, if it doesn't exist yet.
+ * Returns NULL on out of memory.
+ */
+static struct rdirect_fsp *rdirect_get_fsp(vfs_handle_struct * const handle, files_struct * const fsp)
+{
+   struct rdirect_fsp *rfsp = (struct rdirect_fsp *)VFS_FETCH_FSP_EXTENSION(handle, fsp);
+   if (rfsp == NULL)
+   {
+      rfsp = VFS_ADD_FSP_EXTENSION(handle, fsp, struct rdirect_fsp, rdirect_fsp_destroy);
+      if (rfsp == NULL)
+      {
+         errno = ENOMEM;
+         return NULL;
+      }
+      rfsp->fd = -1;
+      rfsp->size = -1;
+      rfsp->pattern.last = -1;
+   }
+   return rfsp;
+}
+
+
+
+/*
+ * Open the O_DIRECT descriptor of `rfsp` next to the (already open) descriptor `fd`, and get its alignment.
+ * If the filesystem doesn't support O_DIRECT (EINVAL), this is remembered for the device, and the file falls back
+ * to the page cache.
+ */
+static void rdirect_fsp_open(struct rdirect_fsp * const rfsp, const int fd)
+{
+   rfsp->writable = false;
+   if (rfsp->wantWrite)
+   {
+      rfsp->fd = rdirect_reopen_direct(fd, O_RDWR);
+      rfsp->writable = (rfsp->fd >= 0);
+   }
+   if (rfsp->fd < 0)
+   {
+      rfsp->fd = rdirect_reopen_direct(fd, O_RDONLY); //still read direct (writes go via page cache)
+   }
+   if (rfsp->fd >= 0)
+   {
+      rfsp->dfd = rdirect_dfd_new(rfsp->fd);
+      if (rfsp->dfd == NULL)
+      {
+         rfsp->fd = -1; //out of memory (closed)
+         rfsp->writable = false;
+         return;
+      }
+      rdirect_dev_align(rfsp->fd, &rfsp->align);
+      return;
+   }
+   if ((errno == EINVAL) && (rfsp->file.ino != 0))
+   {
+      rdirect_dev_set_unsupported((dev_t)rfsp->file.dev);
+      rfsp->direct = false;
+      rfsp->fallback = true;
+   }
+}
+
+
+
+//size of the file described by `st`, to clip reads with. Reads from block devices (st_size 0) are not clipped
+static off_t rdirect_stat_size(const struct stat * const st)
+{
+   return S_ISREG(st->st_mode) ? st->st_size : (off_t)INT64_MAX;
+}
+
+
+
+/*
+ * Decide, how the file `path` (relative to the share) opened as `fd` is accessed: Files matching
+ * `rdirect:exclude`, and files smaller than `rdirect:min size` (unless matching `rdirect:include`) are accessed
+ * via page cache, all others direct (so the O_DIRECT descriptor is opened; for read and write, if `writable`).
+ * With `rdirect:raw device`, the extent map of files opened for read only is fetched, to read them raw.
+ */
+static void rdirect_fsp_setup(const struct rdirect_config * const config, struct rdirect_fsp * const rfsp,
+         const char * const path, const int fd, const bool writable)
+{
+   rfsp->decided = true;
+   rfsp->direct = true;
+   rfsp->wantWrite = writable;
+   const uint8_t rules = rdirect_rules_match(config->rules, path);
+   rfsp->excluded = (rules & RDIRECT_RULE_EXCLUDE) != 0;
+   rfsp->included = !rfsp->excluded && ((rules & RDIRECT_RULE_INCLUDE) != 0);
+   if (rules != 0)
+   {
+      DEBUG(10, ("vfs_rdirect:open File %s is %s by rule\n", path, rfsp->excluded ? "excluded" : "included"));
+   }
+   struct stat st;
+   const bool known = (fstat(fd, &st) == 0);
+   if (known)
+   {
+      rfsp->file.dev = (uint64_t)st.st_dev;
+      rfsp->file.ino = (uint64_t)st.st_ino;
+      rfsp->file.generation = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+      rfsp->size = rdirect_stat_size(&st);
+   }
+   if (rfsp->excluded
+         || (known && !rfsp->included && (config->minSize > 0) && ((uint64_t)st.st_size < config->minSize)))
+   {
+      rfsp->direct = false;
+      return;
+   }
+   if (known && rdirect_dev_is_unsupported(st.st_dev))
+   {
+      rfsp->direct = false;
+      rfsp->fallback = true;
+      return;
+   }
+   rdirect_fsp_open(rfsp, fd);
+   if (config->raw && known && !writable && (rfsp->fd >= 0))
+   {
+      rfsp->raw = rdirect_raw_map(rfsp->fd, &st, &rfsp->align);
+   }
+}
+
+
+
+/*
+ * Get the per file handle data of `fsp`, ready for reading and writing. If the file is accessed direct
+ * (rfsp->direct), the O_DIRECT descriptor is open.
+ * Usually the decision was made and the descriptor was opened together with the handle (see rdirect_openat).
+ * For handles opened otherwise (e.g. for read and write), this happens on first use.
+ * If the direct descriptor can't be opened, the handle falls back to the page cache.
+ * Returns NULL on out of memory.
+ */
+static struct rdirect_fsp *rdirect_fsp_prepare(vfs_handle_struct * const handle,
+         const struct rdirect_config * const config, files_struct * const fsp)
+{
+   struct rdirect_fsp *rfsp = rdirect_get_fsp(handle, fsp);
+   if (rfsp == NULL)
+   {
+      return NULL;
+   }
+   if (!rfsp->decided)
+   {
+      rdirect_fsp_setup(config, rfsp, fsp->fsp_name->base_name, fsp_get_io_fd(fsp), fsp->fsp_flags.can_write);
+   }
+   if (rfsp->direct && (rfsp->fd < 0))
+   {
+      rdirect_fsp_open(rfsp, fsp_get_io_fd(fsp));
+      if (rfsp->fd < 0)
+      {
+         DEBUG(1, ("vfs_rdirect:open Failed to open file %s for direct access, using page cache\n",
+               fsp_str_dbg(fsp)));
+         rfsp->direct = false;
+         rfsp->fallback = true;
+      }
+   }
+   return rfsp;
+}
+
+
+
+//descriptor the direct reads of the prepared handle `rfsp` go to (the block device, if read raw)
+static int rdirect_fsp_read_fd(const struct rdirect_fsp * const rfsp)
+{
+   return (rfsp->raw != NULL) ? rfsp->raw->fd : rfsp->fd;
+}
+
+
+
+/*
+ * Limit a read of `*n` bytes at `offset` to the end of the file. So the covering range ends with the block
+ * containing the end of file, and nothing is read beyond. The known size is refreshed, if the read reaches beyond
+ * it (the file may have been extended by others).
+ * Returns false, if the read is at or beyond end of file (nothing to read).
+ */
+static bool rdirect_fsp_clip(struct rdirect_fsp * const rfsp, size_t * const n, const off_t offset)
+{
+   if ((rfsp->size < 0) || (offset + (off_t)*n > rfsp->size))
+   {
+      struct stat st;
+      if (fstat(rfsp->fd, &st) != 0)
+      {
+         return true; //size unknown -> the read itself finds the end of file
+      }
+      rfsp->size = rdirect_stat_size(&st);
+   }
+   if (offset >= rfsp->size)
+   {
+      return false;
+   }
+   *n = (size_t)MIN((off_t)*n, rfsp->size - offset);
+   return true;
+}
+
+
+
+//the file has been written up to `end`
+static void rdirect_fsp_extend(struct rdirect_fsp * const rfsp, const off_t end)
+{
+   if ((rfsp->size >= 0) && (end > rfsp->size))
+   {
+      rfsp->size = end;
+   }
+}
+
+
+
+/*
+ * Track the access pattern of the file handle with a read of `n` bytes at `offset`, and decide, if the file is read
+ * via page cache for now (`rdirect:adaptive`).
+ * Small reads (below `rdirect:adaptive size`), that don't continue the previous one, and reads overlapping one of
+ * the recent reads, raise the score of the handle: the page cache serves them better (e.g. index lookups). Large
+ * reads lower it: that's streaming, where direct reads avoid polluting it. Small sequential reads are neutral (they
+ * are served by read-ahead). The score is bounded, and the mode is switched with a hysteresis, so a single odd read
+ * doesn't flip it.
+ * Without `update`, the pattern of the handle is left as is (the decision for a read, that may not be done).
+ * Returns true, if the read is done via page cache.
+ */
+static bool rdirect_pattern_buffered(const struct rdirect_config * const config, struct rdirect_fsp * const rfsp,
+         const size_t n, const off_t offset, const bool update)
+{
+   struct rdirect_pattern peek = rfsp->pattern;
+   struct rdirect_pattern *pattern = update ? &rfsp->pattern : &peek;
+   const off_t end = offset + (off_t)n;
+   bool repeated = false;
+   for (unsigned int i = 0; !repeated && (i < RDIRECT_PATTERN_RANGES); ++i)
+   {
+      repeated = (pattern->start[i] < end) && (offset < pattern->end[i]);
+   }
+   const bool sequential = (offset == pattern->last);
+   const bool small = (n < config->adaptiveSize);
+   pattern->start[pattern->next] = offset;
+   pattern->end[pattern->next] = end;
+   pattern->next = (pattern->next + 1) % RDIRECT_PATTERN_RANGES;
+   pattern->last = end;
+
+   if (repeated || (small && !sequential))
+   {
+      pattern->score = MIN(pattern->score + 1, RDIRECT_PATTERN_LIMIT);
+   }
+   else if (!small)
+   {
+      pattern->score = MAX(pattern->score - 1, -RDIRECT_PATTERN_LIMIT);
+   }
+
+   if (pattern->buffered != (pattern->buffered ? (pattern->score > -RDIRECT_PATTERN_SWITCH)
+         : (pattern->score >= RDIRECT_PATTERN_SWITCH)))
+   {
+      pattern->buffered = !pattern->buffered;
+      if (update)
+      {
+         rdirect_count(config->stats, RDIRECT_STATS_ADAPTIVE_SWITCHES, 1);
+         DEBUG(5, ("vfs_rdirect:adaptive Reading fd %d %s now\n", rfsp->fd,
+               pattern->buffered ? "buffered" : "direct"));
+      }
+   }
+   return pattern->buffered;
+}
+
+
+
+/*
+ * Reasons, to pass a read to the next module (i.e. to read via page cache), instead of reading direct.
+ * The values are the reasons reported by the `fallback` probe.
+ */
+enum rdirect_pass {
+   RDIRECT_PASS_NONE = -1, //read direct
+   RDIRECT_PASS_MIN_SIZE = 0, //file below rdirect:min size
+   RDIRECT_PASS_FALLBACK = 1, //O_DIRECT not available
+   RDIRECT_PASS_ADAPTIVE = 2, //small random or repeated reads (rdirect:adaptive)
+   RDIRECT_PASS_EXCLUDED = 3 //file matches rdirect:exclude
+};
+
+//decide, how a read of `n` bytes at `offset` of the prepared handle `rfsp` is done. With `account`, the read is
+//counted and fed to the access pattern; without, there are no side effects (for a read, that may not be done)
+static enum rdirect_pass rdirect_read_pass(const struct rdirect_config * const config, struct rdirect_fsp * const rfsp,
+         const size_t n, const off_t offset, const bool account)
+{
+   struct rdirect_stats * const stats = account ? config->stats : NULL;
+   if (!rfsp->direct)
+   {
+      rdirect_count(stats, rfsp->fallback ? RDIRECT_STATS_FALLBACK_READS : RDIRECT_STATS_BUFFERED_READS, 1);
+      if (rfsp->fallback)
+      {
+         return RDIRECT_PASS_FALLBACK;
+      }
+      return rfsp->excluded ? RDIRECT_PASS_EXCLUDED : RDIRECT_PASS_MIN_SIZE;
+   }
+   if (config->adaptive && !rfsp->included && rdirect_pattern_buffered(config, rfsp, n, offset, account))
+   {
+      rdirect_count(stats, RDIRECT_STATS_ADAPTIVE_READS, 1);
+      return RDIRECT_PASS_ADAPTIVE;
+   }
+   rdirect_count(stats, RDIRECT_STATS_DIRECT_READS, 1);
+   if (rfsp->raw != NULL)
+   {
+      rdirect_count(stats, RDIRECT_STATS_RAW_READS, 1);
+   }
+   return RDIRECT_PASS_NONE;
+}
+
+
+
+static int rdirect_openat(vfs_handle_struct *handle,
+           const struct files_struct *dirfsp,
+           const struct smb_filename *smb_fname,
+           files_struct *fsp,
+           int flags,
+           mode_t mode)
+{
+   struct rdirect_config *config = NULL;
+   SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return -1);
+
+   const int fd = SMB_VFS_NEXT_OPENAT(handle, dirfsp, smb_fname, fsp, flags, mode);
+   if (fd < 0)
+   {
+      return fd;
+   }
+
+   //open the direct descriptor next to the normal one, for regular files.
+   //the normal descriptor stays as it is, as smbd (and other modules) use it with arbitrary alignment
+#ifdef O_PATH
+   if (flags & O_PATH)
+   {
+      return fd;
+   }
+#endif
+   if ((flags & O_DIRECTORY) || fsp->fsp_flags.is_directory)
+   {
+      return fd;
+   }
+
+   struct rdirect_fsp *rfsp = rdirect_get_fsp(handle, fsp);
+   if ((rfsp != NULL) && !rfsp->decided)
+   {
+      //if the direct open fails, it is retried on first access
+      rdirect_fsp_setup(config, rfsp, fsp->fsp_name->base_name, fd, (flags & O_ACCMODE) != O_RDONLY);
+   }
+   return fd;
+}
+
+
+
+/*
+ * Read `n` bytes at `offset` from the O_DIRECT descriptor `fd` into `data` (raw from the block device `fd`, if
+ * `raw` is not NULL). Buffer, offset and size may have any alignment. This function is thread-safe (it is also run by the workers
+ * of the threadpool engine) and must therefore not log.
+ * Returns the number of bytes read, or -1 on error (errno set).
+ */
+static ssize_t rdirect_read_direct(const int fd, const struct rdirect_raw * const raw,
+         const struct rdirect_align * const align, void * const data, const size_t n, const off_t offset,
+         struct rdirect_stats * const stats)
+{
+   struct rdirect_span span;
+   rdirect_span_init(&span, align, n, offset);
+
+   if (rdirect_span_is_direct(&span, align, data, n))
+   {
+      //everything is aligned already -> read straight into the caller's buffer
+      return rdirect_read_range(fd, raw, data, n, offset);
+   }
+
+   //direct read requires the destination buffer to be aligned as well!
+   //read the covering range into a pooled bounce buffer and hand out the requested part only
+   RDIRECT_PROBE4(bounce, fd, offset, n, align->offset);
+   void *buffer = rdirect_pool_get(span.len);
+   if (buffer == NULL)
+   {
+      errno = ENOMEM;
+      return -1;
+   }
+   const ssize_t count = rdirect_span_count(&span, rdirect_read_range(fd, raw, buffer, span.len, span.offset), n);
+   if (count > 0)
+   {
+      memcpy(data, (const uint8_t *)buffer + span.head, count);
+      rdirect_count(stats, RDIRECT_STATS_BOUNCE_COPIES, 1);
+      rdirect_count(stats, RDIRECT_STATS_BOUNCE_BYTES, (uint64_t)count);
+   }
+   const int err = errno;
+   rdirect_pool_put(buffer, span.len);
+   errno = err;
+   return count;
+}
+
+
+
+/*
+ * Try to read `n` bytes at `offset` from the normal descriptor `fd` into `data`, without blocking on the device
+ * (preadv2 with RWF_NOWAIT). If another process has pulled the data into the page cache already, it costs a memcpy
+ * instead of a device read (and the O_DIRECT read doesn't force writeback and invalidation of the cached pages).
+ * Returns true, if the whole range was resident.
+ */
+static bool rdirect_read_cached(const int fd, void * const data, const size_t n, const off_t offset)
+{
+#ifdef RWF_NOWAIT
+   static bool unsupported = false; //kernel or filesystem doesn't support RWF_NOWAIT for buffered reads
+   if (unsupported)
+   {
+      return false;
+   }
+
+   struct iovec iov = { .iov_base = data, .iov_len = n };
+   ssize_t count = -1;
+   do
+   {
+      count = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+   } while ((count < 0) && (errno == EINTR));
+   if ((count < 0) && ((errno == EOPNOTSUPP) || (errno == ENOSYS)))
+   {
+      DEBUG(3, ("vfs_rdirect:pread RWF_NOWAIT not supported. Code %d\n", errno));
+      unsupported = true;
+   }
+   //a short read means, that the rest is not resident (or end of file) -> read direct
+   return (count == (ssize_t)n);
+#else
+   return false;
+#endif
+}
+
+
+
+//read synchronously (the request is counted by the caller). A direct read is charged to the QoS, if `charge`
+//(it isn't delayed, though)
+static ssize_t rdirect_pread_sync(vfs_handle_struct *const handle, const struct rdirect_config * const config,
+         files_struct * const fsp, void * const data, size_t n, const off_t offset, const bool charge)
+{
+   if (n == 0)
+   {
+      return 0;
+   }
+
+   struct rdirect_fsp *rfsp = rdirect_fsp_prepare(handle, config, fsp);
+   if (rfsp == NULL)
+   {
+      return -1;
+   }
+   const enum rdirect_pass pass = rdirect_read_pass(config, rfsp, n, offset, true);
+   if (pass != RDIRECT_PASS_NONE)
+   {
+      RDIRECT_PROBE4(fallback, fsp_get_io_fd(fsp), offset, n, pass);
+      const ssize_t count = SMB_VFS_NEXT_PREAD(handle, fsp, data, n, offset);
+      if (rfsp->fallback && config->fallbackDontneed && (count > 0))
+      {
+         posix_fadvise(fsp_get_io_fd(fsp), offset, count, POSIX_FADV_DONTNEED);
+      }
+      return count;
+   }
+   if (!rdirect_fsp_clip(rfsp, &n, offset))
+   {
+      return 0; //at end of file
+   }
+   if (charge && (config->qos != NULL))
+   {
+      rdirect_qos_take(config->qos, n, true);
+   }
+   if (config->tryPageCache && rdirect_read_cached(fsp_get_io_fd(fsp), data, n, offset))
+   {
+      rdirect_count(config->stats, RDIRECT_STATS_PAGE_CACHE_HITS, 1);
+      return (ssize_t)n;
+   }
+
+   struct timespec start, end;
+   PROFILE_TIMESTAMP(&start);
+   const ssize_t count = rdirect_read_direct(rdirect_fsp_read_fd(rfsp), rfsp->raw, &rfsp->align, data, n, offset, config->stats);
+   const int err = errno;
+   PROFILE_TIMESTAMP(&end);
+   rdirect_stats_latency(config->stats, RDIRECT_ENGINE_SYNC, nsec_time_diff(&end, &start));
+   if (count < 0)
+   {
+      DEBUG(10, ("vfs_rdirect:pread Failed to read file %s. Code %d\n",
+            fsp_str_dbg(fsp), err));
+      errno = err;
+   }
+   return count;
+}
+
+
+
+static ssize_t rdirect_pread(vfs_handle_struct *const handle, files_struct * const fsp, void * const data,
+         size_t n, const off_t offset)
+{
+   DEBUG(10, ("vfs_rdirect:pread file %s, data=%p, n=%lu, offset=%ld\n",
+          fsp_str_dbg(fsp), data, n, offset));
+
+   struct rdirect_config *config = NULL;
+   SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return -1);
+
+#ifdef RDIRECT_PROBES
+   struct timespec start, end;
+   PROFILE_TIMESTAMP(&start);
+#endif
+   RDIRECT_PROBE4(pread_entry, fsp_get_io_fd(fsp), offset, n, 0);
+   const ssize_t count = rdirect_pread_sync(handle, config, fsp, data, n, offset, true);
+   rdirect_count_request(config->stats, false, count);
+#ifdef RDIRECT_PROBES
+   const int err = errno;
+   PROFILE_TIMESTAMP(&end);
+   RDIRECT_PROBE5(pread_return, fsp_get_io_fd(fsp), offset, n, (count < 0) ? -err : count,
+         nsec_time_diff(&end, &start));
+   errno = err;
+#endif
+   return count;
+}
+
+
+
+/*
+ * Zero-copy sendfile, keeping the data off the page cache.
+ *
+ * For large reads, smbd sends the data straight from the file to the client socket (SMB_VFS_SENDFILE), bypassing
+ * pread, and sendfile(2) reads via page cache. Instead, the covering range is spliced from the O_DIRECT descriptor
+ * into a pipe: the kernel reads it direct into pages owned by the pipe, which are spliced on to the socket. So
+ * there is no copy to userspace and back, and no page cache involved. The bytes of the covering range in front of
+ * and behind the requested range are read out of the pipe and dropped.
+ * The range is spliced in chunks of the pipe's capacity. The first chunk is read before anything is sent: if the
+ * kernel can't splice from the O_DIRECT descriptor, the request is returned to smbd (ENOSYS), which then reads it
+ * via pread (i.e. direct as well, with a copy).
+ * The pipe is used by the smbd main thread only (sendfile is synchronous).
+ */
+#define RDIRECT_SPLICE_PIPE_SIZE (1024 * 1024) //requested capacity of the pipe [bytes] (limited by fs.pipe-max-size)
+
+static struct {
+   int fds[2]; //read and write end of the pipe (-1: not created yet)
+   size_t size; //capacity of the pipe [bytes]
+} rdirect_splice = {
+   .fds = { -1, -1 }
+};
+
+
+
+//close the pipe (after an error, it may still contain data). It is created again on next use
+static void rdirect_splice_close(void)
+{
+   for (int i = 0; i < 2; ++i)
+   {
+      if (rdirect_splice.fds[i] >= 0)
+      {
+         close(rdirect_splice.fds[i]);
+         rdirect_splice.fds[i] = -1;
+      }
+   }
+}
+
+
+
+//get the (empty) pipe. It is created on first use. Returns false on error
+static bool rdirect_splice_pipe(void)
+{
+   if (rdirect_splice.fds[0] >= 0)
+   {
+      return true;
+   }
+   if (pipe2(rdirect_splice.fds, O_CLOEXEC) != 0)
+   {
+      DEBUG(1, ("vfs_rdirect:sendfile Failed to create pipe. Code %d\n", errno));
+      rdirect_splice.fds[0] = rdirect_splice.fds[1] = -1;
+      return false;
+   }
+   fcntl(rdirect_splice.fds[1], F_SETPIPE_SZ, RDIRECT_SPLICE_PIPE_SIZE); //keeps the default capacity, if denied
+   const int size = fcntl(rdirect_splice.fds[1], F_GETPIPE_SZ);
+   rdirect_splice.size = (size > 0) ? (size_t)size : 0;
+   return true;
+}
+
+
+
+/*
+ * Splice the aligned range [aoffset, aoffset + alen) from the O_DIRECT descriptor `fd` into the pipe.
+ * Short splices are continued, until end of file.
+ * Returns the number of bytes in the pipe, which may be less than alen at end of file, or -1 on error.
+ */
+static ssize_t rdirect_splice_fill(const int fd, const off_t aoffset, const size_t alen)
+{
+   size_t done = 0;
+   while (done < alen)
+   {
+      loff_t offset = aoffset + (off_t)done;
+      const ssize_t count = splice(fd, &offset, rdirect_splice.fds[1], NULL, alen - done, SPLICE_F_MOVE);
+      if (count < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         if (done > 0)
+         {
+            break; //the rest can't be read (e.g. an unaligned end of file) -> return what we have
+         }
+         return -1;
+      }
+      if (count == 0)
+      {
+         break; //end of file
+      }
+      done += (size_t)count;
+   }
+   return (ssize_t)done;
+}
+
+
+
+//read `len` bytes out of the pipe, and drop them. Returns false on error
+static bool rdirect_splice_drop(size_t len)
+{
+   uint8_t scratch[4096];
+   while (len > 0)
+   {
+      const ssize_t count = read(rdirect_splice.fds[0], scratch, MIN(len, sizeof(scratch)));
+      if (count < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return false;
+      }
+      if (count == 0)
+      {
+         errno = EPIPE;
+         return false;
+      }
+      len -= (size_t)count;
+   }
+   return true;
+}
+
+
+
+//splice `len` bytes out of the pipe to the socket `tofd`. `more`: more data follows (keep the socket corked)
+static bool rdirect_splice_send(const int tofd, size_t len, const bool more)
+{
+   while (len > 0)
+   {
+      const ssize_t count = splice(rdirect_splice.fds[0], NULL, tofd, NULL, len,
+            SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0));
+      if (count < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return false;
+      }
+      if (count == 0)
+      {
+         errno = EPIPE;
+         return false;
+      }
+      len -= (size_t)count;
+   }
+   return true;
+}
+
+
+
+//send the header of a sendfile request. It is corked, to go out together with the data
+static bool rdirect_send_header(const int tofd, const DATA_BLOB * const header)
+{
+   size_t done = 0;
+   while ((header != NULL) && (done < header->length))
+   {
+      const ssize_t count = send(tofd, header->data + done, header->length - done, MSG_MORE);
+      if (count < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return false;
+      }
+      done += (size_t)count;
+   }
+   return true;
+}
+
+
+
+/*
+ * Send `header` followed by `n` bytes at `offset` of the O_DIRECT descriptor `fd` to the socket `tofd`.
+ * The socket is switched to blocking mode meanwhile (like sys_sendfile does it): the whole response must be
+ * sent, before anything else goes out on the connection.
+ * Returns the number of bytes sent (header included), 0 if nothing has been sent (at end of file), or -1 on error.
+ * errno ENOSYS means, that nothing has been sent either (smbd falls back to a normal read then).
+ */
+static ssize_t rdirect_sendfile_direct(const int tofd, const int fd, const struct rdirect_align * const align,
+         const DATA_BLOB * const header, const off_t offset, const size_t n)
+{
+   if (!rdirect_splice_pipe())
+   {
+      errno = ENOSYS;
+      return -1;
+   }
+   const size_t chunkSize = rdirect_splice.size & ~((size_t)align->offset - 1);
+   if (chunkSize == 0)
+   {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   struct rdirect_span span;
+   rdirect_span_init(&span, align, n, offset);
+   off_t aoffset = span.offset;
+   size_t alen = MIN(span.len, chunkSize);
+   ssize_t filled = rdirect_splice_fill(fd, aoffset, alen);
+   if (filled < 0)
+   {
+      DEBUG(3, ("vfs_rdirect:sendfile Failed to splice from fd %d, using pread. Code %d\n", fd, errno));
+      rdirect_splice_close();
+      errno = ENOSYS;
+      return -1;
+   }
+   if ((size_t)filled <= span.head)
+   {
+      //at end of file
+      if (!rdirect_splice_drop((size_t)filled))
+      {
+         rdirect_splice_close();
+      }
+      return 0;
+   }
+
+   const int flags = fcntl(tofd, F_GETFL, 0);
+   if ((flags >= 0) && (flags & O_NONBLOCK))
+   {
+      fcntl(tofd, F_SETFL, flags & ~O_NONBLOCK);
+   }
+
+   ssize_t ret = -1;
+   size_t sent = 0; //bytes of the requested range sent
+   size_t skip = span.head; //bytes in front of the requested range, still to drop
+   if (!rdirect_send_header(tofd, header))
+   {
+      goto out;
+   }
+   for (;;)
+   {
+      size_t avail = (size_t)filled;
+      const size_t head = MIN(skip, avail);
+      const size_t len = MIN(avail - head, n - sent);
+      if (!rdirect_splice_drop(head) || !rdirect_splice_send(tofd, len, sent + len < n)
+            || !rdirect_splice_drop(avail - head - len))
+      {
+         goto out;
+      }
+      skip -= head;
+      sent += len;
+      if ((sent == n) || ((size_t)filled < alen))
+      {
+         break; //done, or at end of file
+      }
+      aoffset += filled;
+      alen = MIN(span.len - (size_t)(aoffset - span.offset), chunkSize);
+      filled = rdirect_splice_fill(fd, aoffset, alen);
+      if (filled < 0)
+      {
+         goto out;
+      }
+   }
+   ret = (ssize_t)(((header != NULL) ? header->length : 0) + sent);
+
+out:
+   {
+      const int err = errno;
+      if (ret < 0)
+      {
+         rdirect_splice_close();
+      }
+      if ((flags >= 0) && (flags & O_NONBLOCK))
+      {
+         fcntl(tofd, F_SETFL, flags);
+      }
+      errno = err;
+   }
+   return ret;
+}
+
+
+
+static ssize_t rdirect_sendfile(vfs_handle_struct *handle, int tofd, files_struct *fromfsp,
+         const DATA_BLOB *header, off_t offset, size_t n)
+{
+   DEBUG(10, ("vfs_rdirect:sendfile file %s, n=%lu, offset=%ld\n",
+          fsp_str_dbg(fromfsp), n, offset));
+
+   struct rdirect_config *config = NULL;
+   SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return -1);
+
+   if (!config->sendfile)
+   {
+      return SMB_VFS_NEXT_SENDFILE(handle, tofd, fromfsp, header, offset, n);
+   }
+   struct rdirect_fsp *rfsp = rdirect_fsp_prepare(handle, config, fromfsp);
+   if ((rfsp == NULL) || (rfsp->raw != NULL))
+   {
+      //(handles read raw are read via pread, as splicing goes through the filesystem)
+      errno = ENOSYS; //nothing sent
+      return -1;
+   }
+   /*
+    * The read is counted (and fed to the access pattern) only, when it is done here: if nothing is sent (ENOSYS, or
+    * 0 at end of file), smbd falls back to a normal read, which counts it.
+    */
+   const size_t len = n;
+   const enum rdirect_pass pass = rdirect_read_pass(config, rfsp, len, offset, false);
+   if (pass != RDIRECT_PASS_NONE)
+   {
+      RDIRECT_PROBE4(fallback, fsp_get_io_fd(fromfsp), offset, n, pass);
+      const ssize_t count = SMB_VFS_NEXT_SENDFILE(handle, tofd, fromfsp, header, offset, n);
+      const int err = errno;
+      if ((count > 0) || ((count < 0) && (err != ENOSYS)))
+      {
+         rdirect_read_pass(config, rfsp, len, offset, true);
+      }
+      if (rfsp->fallback && config->fallbackDontneed && (count > 0))
+      {
+         posix_fadvise(fsp_get_io_fd(fromfsp), offset, n, POSIX_FADV_DONTNEED);
+      }
+      errno = err;
+      return count;
+   }
+   if ((n == 0) || !rdirect_fsp_clip(rfsp, &n, offset))
+   {
+      return 0; //at end of file -> smbd does a normal read
+   }
+
+   const ssize_t count = rdirect_sendfile_direct(tofd, rfsp->fd, &rfsp->align, header, offset, n);
+   const int err = errno;
+   RDIRECT_PROBE4(sendfile, rfsp->fd, offset, n, (count < 0) ? -err : count);
+   if ((count > 0) || ((count < 0) && (err != ENOSYS)))
+   {
+      rdirect_read_pass(config, rfsp, len, offset, true);
+   }
+   if (count > 0)
+   {
+      const size_t sent = (size_t)count - ((header != NULL) ? header->length : 0);
+      rdirect_count_request(config->stats, false, (ssize_t)sent);
+      rdirect_count(config->stats, RDIRECT_STATS_SENDFILE_READS, 1);
+      if (config->qos != NULL)
+      {
+         rdirect_qos_take(config->qos, sent, true); //sendfile is synchronous -> charged, but not delayed
+      }
+   }
+   else if ((count < 0) && (err != ENOSYS))
+   {
+      DEBUG(10, ("vfs_rdirect:sendfile Failed to send file %s. Code %d\n", fsp_str_dbg(fromfsp), err));
+      rdirect_count_request(config->stats, false, -1);
+   }
+   errno = err;
+   return count;
+}
+
+
+
+/*
+ * Write the aligned buffer `buffer` to the aligned range [aoffset, aoffset + alen) completely.
+ * Returns the number of bytes written, or -1 on error.
+ */
+static ssize_t rdirect_write_aligned(const int fd, const void * const buffer, const size_t alen, const off_t aoffset)
+{
+   size_t done = 0;
+   while (done < alen)
+   {
+      const ssize_t count = pwrite(fd, (const uint8_t *)buffer + done, alen - done, aoffset + (off_t)done);
+      if (count < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return -1;
+      }
+      if (count == 0)
+      {
+         errno = ENOSPC;
+         return -1;
+      }
+      done += (size_t)count;
+   }
+   return (ssize_t)done;
+}
+
+
+
+/*
+ * Check, if a write of `n` bytes at `offset` covers whole pages (and thus whole blocks of the O_DIRECT alignment
+ * `align`). Other writes would need a read-modify-write of their partial blocks, which can't be made atomic with
+ * respect to the writes of other file handles or processes, so they go via page cache (see rdirect_pwrite_sync).
+ * Whole pages are required, for a direct write not to share a page with a partial write via page cache.
+ */
+static bool rdirect_write_is_direct(const struct rdirect_align * const align, const size_t n, const off_t offset)
+{
+   const size_t unit = MAX((size_t)align->offset, (size_t)getpagesize());
+   return (((size_t)offset % unit) == 0) && ((n % unit) == 0);
+}
+
+
+
+/*
+ * Write `n` bytes of `data` at `offset` to the O_DIRECT descriptor `fd` (opened for read and write).
+ * Offset and size must cover whole blocks (see rdirect_write_is_direct). A buffer, that isn't aligned, is copied
+ * to a bounce buffer first. This function is thread-safe (it is also run by the workers of the threadpool engine)
+ * and must therefore not log.
+ * Returns the number of bytes written, or -1 on error (errno set).
+ */
+static ssize_t rdirect_write_direct(const int fd, const struct rdirect_align * const align, const void * const data,
+         const size_t n, const off_t offset)
+{
+   if (((uintptr_t)data % align->mem) == 0)
+   {
+      //everything is aligned already -> write straight from the caller's buffer
+      return rdirect_write_aligned(fd, data, n, offset);
+   }
+
+   void *buffer = rdirect_pool_get(n);
+   if (buffer == NULL)
+   {
+      errno = ENOMEM;
+      return -1;
+   }
+   memcpy(buffer, data, n);
+   const ssize_t count = rdirect_write_aligned(fd, buffer, n, offset);
+   const int err = errno;
+   rdirect_pool_put(buffer, n);
+   errno = err;
+   return count;
+}
+
+
+
+/*
+ * A single aligned read from the device, performed asynchronously by one of the engines.
+ *
+ * An io is owned by its requester, which frees it after completion (signalled by calling `done_fn`).
+ * A requester, that goes away before, abandons the io (see rdirect_io_abandon), and the io frees itself
+ * when it lands.
+ */
+struct rdirect_io {
+   int fd; //O_DIRECT descriptor to read from (of the block device, if raw)
+   struct rdirect_dfd *dfd; //reference to the descriptor of the file, kept open by the io (NULL: none)
+   struct rdirect_raw *raw; //extent map to read raw by (NULL: read the file), referenced by the io
+   off_t offset; //aligned file offset
+   size_t len; //aligned length
+   void *buffer; //aligned destination (if NULL on submission, the engine provides a buffer owned by the io)
+   bool ownBuffer; //buffer is owned by the io (pooled bounce buffer or registered buffer)
+   int bufferIndex; //index of the registered buffer (io_uring), -1 if none
+   bool inFlight; //submitted, but not completed yet
+   size_t done; //number of bytes read so far (io_uring continues short reads)
+   ssize_t result; //number of bytes read, or -1 on error
+   struct vfs_aio_state vfs_aio_state; //error and duration of the read
+   struct timespec start; //time of submission
+   void (*done_fn)(struct rdirect_io *io, void *private_data); //completion callback
+   void *private_data;
+   struct rdirect_flight *flight; //requests sharing the read (see rdirect:coalesce), NULL if none
+   enum rdirect_engine engine; //engine, that performs the read
+   struct rdirect_stats *stats; //statistics to account the read to (NULL: none)
+   struct tevent_req *job; //job of the threadpool engine (NULL, if not submitted to the threadpool)
+   size_t charged; //bytes charged to rdirect_bounceMemory (see rdirect:bounce memory)
+#ifdef RDIRECT_URING
+   struct rdirect_uring *uring; //ring the io was submitted to (NULL, if not submitted to a ring)
+   bool queued; //queued on the ring, not submitted to the kernel yet (see rdirect_uring_flush)
+   bool cancelled; //cancelled while queued
+   bool merged; //read as part of a merged read
+   struct rdirect_io *mergeNext; //next io of the merged read, that this io heads or is part of (NULL: last)
+   struct iovec *mergeIov; //vector of the merged read (of its head only)
+#endif
+};
+
+static void rdirect_flight_land(struct rdirect_flight *flight);
+
+static size_t rdirect_bounceMemory = 0; //bytes of bounce buffers of asynchronous requests in flight (per process)
+
+
+
+#ifdef RDIRECT_URING
+/*
+ * Asynchronous read engine, based on io_uring.
+ *
+ * There is one ring per smbd process. Its completions are signalled to the eventfd registered with the ring,
+ * which is monitored by the tevent loop of the process. Reads that can't go straight to the caller's buffer,
+ * are read into a set of aligned buffers, registered with the ring at setup (fixed buffers).
+ * Reads are queued, and submitted together once per tevent loop iteration, with adjacent ranges merged.
+ */
+#define RDIRECT_URING_ENTRIES       128             //number of submission queue entries
+#define RDIRECT_URING_BUFFERS       8               //number of registered buffers (max. 32)
+#define RDIRECT_URING_BUFFER_SIZE   (1024 * 1024)   //size of each registered buffer
+#define RDIRECT_URING_MERGE_IOS     16              //max. number of adjacent ios merged into a single read
+#define RDIRECT_URING_MERGE_SIZE    (4 * 1024 * 1024) //max. size of a merged read
+
+struct rdirect_uring {
+   struct io_uring ring;
+   int eventFd; //eventfd the ring signals its completions to
+   struct tevent_fd *fde;
+   struct tevent_context *ev;
+   struct tevent_timer *flushTimer; //submits the queued ios (NULL: none queued)
+   struct rdirect_io *pending[RDIRECT_URING_ENTRIES]; //ios queued, sorted on submission
+   unsigned int numPending;
+   void *bufferMemory; //memory of the registered buffers (from the pool)
+   struct iovec buffers[RDIRECT_URING_BUFFERS];
+   uint32_t freeBuffers; //bitmap of the registered buffers, not in use at the moment
+};
+
+static struct rdirect_uring *rdirect_uring = NULL; //ring of this process
+static bool rdirect_uring_unavailable = false; //setup failed before, don't try again
+#endif
+
+
+
+static int rdirect_io_destructor(struct rdirect_io *io)
+{
+   rdirect_raw_unref(io->raw);
+   rdirect_dfd_unref(io->dfd);
+   rdirect_bounceMemory -= io->charged;
+#ifdef RDIRECT_URING
+   if (io->bufferIndex >= 0)
+   {
+      if (rdirect_uring != NULL)
+      {
+         rdirect_uring->freeBuffers |= (1U << io->bufferIndex);
+      }
+      return 0;
+   }
+#endif
+   if (io->ownBuffer && (io->buffer != NULL))
+   {
+      rdirect_pool_put(io->buffer, io->len);
+   }
+   return 0;
+}
+
+
+
+/*
+ * Create an io, to read the aligned range [offset, offset + len) from `fd` (or raw by `raw`, if not NULL) into
+ * `buffer`. The io references `dfd` (the descriptor of the file, may be NULL), until it is freed.
+ * If `buffer` is NULL, the engine provides a buffer on submission, owned by the io.
+ * Returns NULL on out of memory.
+ */
+static struct rdirect_io *rdirect_io_new(const int fd, struct rdirect_dfd * const dfd,
+         struct rdirect_raw * const raw, const off_t offset, const size_t len, void * const buffer)
+{
+   //ios are not bound to a talloc parent, as abandoned ios must outlive their requester
+   struct rdirect_io *io = talloc_zero(NULL, struct rdirect_io);
+   if (io == NULL)
+   {
+      return NULL;
+   }
+   io->fd = fd;
+   io->dfd = rdirect_dfd_ref(dfd);
+   io->raw = rdirect_raw_ref(raw);
+   io->offset = offset;
+   io->len = len;
+   io->buffer = buffer;
+   io->bufferIndex = -1;
+   io->result = -1;
+   talloc_set_destructor(io, rdirect_io_destructor);
+   return io;
+}
+
+
+
+//provide a pooled bounce buffer to `io`, if it has no buffer yet. Returns false on out of memory
+static bool rdirect_io_alloc_buffer(struct rdirect_io * const io)
+{
+   if (io->buffer != NULL)
+   {
+      return true;
+   }
+   io->buffer = rdirect_pool_get(io->len);
+   io->ownBuffer = (io->buffer != NULL);
+   return io->ownBuffer;
+}
+
+
+
+//the engine has completed `io`
+static void rdirect_io_finish(struct rdirect_io * const io)
+{
+   struct timespec end;
+   PROFILE_TIMESTAMP(&end);
+   io->inFlight = false;
+   io->vfs_aio_state.duration = nsec_time_diff(&end, &io->start);
+   rdirect_stats_latency(io->stats, io->engine, io->vfs_aio_state.duration);
+   RDIRECT_PROBE5(complete, io->fd, io->offset, io->len, (io->result < 0) ? -io->vfs_aio_state.error : io->result,
+         io->vfs_aio_state.duration);
+   if (io->flight != NULL)
+   {
+      rdirect_flight_land(io->flight); //requests attached are served first, even if the requester is gone
+   }
+   if (io->done_fn == NULL)
+   {
+      talloc_free(io); //abandoned
+      return;
+   }
+   io->done_fn(io, io->private_data);
+}
+
+
+
+/*
+ * Threadpool engine: the read is performed by smbd's worker threads (the same way as vfs_default does it).
+ */
+static void rdirect_io_do(void *private_data)
+{
+   struct rdirect_io *io = (struct rdirect_io *)private_data;
+
+   io->result = rdirect_read_range(io->fd, io->raw, io->buffer, io->len, io->offset);
+   if (io->result == -1) {
+      io->vfs_aio_state.error = errno;
+   }
+}
+
+
+
+//perform `io` synchronously, and complete it
+static void rdirect_io_run(struct rdirect_io * const io)
+{
+   io->engine = RDIRECT_ENGINE_SYNC;
+   RDIRECT_PROBE4(submit, io->fd, io->offset, io->len, io->engine);
+   PROFILE_TIMESTAMP(&io->start);
+   if (rdirect_io_alloc_buffer(io))
+   {
+      rdirect_io_do(io);
+   }
+   else
+   {
+      io->result = -1;
+      io->vfs_aio_state.error = ENOMEM;
+   }
+   rdirect_io_finish(io);
+}
+
+
+
+static void rdirect_io_pool_done(struct tevent_req *subreq)
+{
+   struct rdirect_io *io = tevent_req_callback_data(
+      subreq, struct rdirect_io);
+   int ret;
+
+   ret = pthreadpool_tevent_job_recv(subreq);
+   TALLOC_FREE(subreq);
+   io->job = NULL;
+   if (ret != 0) {
+      if (ret != EAGAIN) {
+         io->result = -1;
+         io->vfs_aio_state.error = ret;
+      } else {
+         /*
+          * If we get EAGAIN from pthreadpool_tevent_job_recv() this
+          * means the lower level pthreadpool failed to create a new
+          * thread. Fallback to sync processing in that case to allow
+          * some progress for the client.
+          */
+         rdirect_io_do(io);
+      }
+   }
+   rdirect_io_finish(io);
+}
+
+
+
+static bool rdirect_io_pool_submit(vfs_handle_struct * const handle, struct tevent_context * const ev,
+         struct rdirect_io * const io)
+{
+   if (!rdirect_io_alloc_buffer(io))
+   {
+      return false;
+   }
+   struct tevent_req *subreq = pthreadpool_tevent_job_send(
+      io, ev, handle->conn->sconn->pool, rdirect_io_do, io);
+   if (subreq == NULL)
+   {
+      return false;
+   }
+   tevent_req_set_callback(subreq, rdirect_io_pool_done, io);
+   io->job = subreq;
+   PROFILE_TIMESTAMP(&io->start);
+   io->inFlight = true;
+   io->engine = RDIRECT_ENGINE_THREADPOOL;
+   return true;
+}
+
+
+
+#ifdef RDIRECT_URING
+static int rdirect_uring_destructor(struct rdirect_uring *uring)
+{
+   TALLOC_FREE(uring->fde);
+   io_uring_queue_exit(&uring->ring);
+   if (uring->eventFd >= 0)
+   {
+      close(uring->eventFd);
+   }
+   if (uring->bufferMemory != NULL)
+   {
+      rdirect_pool_put(uring->bufferMemory, RDIRECT_URING_BUFFERS * RDIRECT_URING_BUFFER_SIZE);
+   }
+   if (rdirect_uring == uring)
+   {
+      rdirect_uring = NULL;
+   }
+   return 0;
+}
+
+
+
+//get a free submission queue entry. Returns NULL, if the queue is full
+static struct io_uring_sqe *rdirect_uring_get_sqe(struct rdirect_uring * const uring)
+{
+   struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+   if (sqe == NULL)
+   {
+      //submission queue is full. flush it and try again
+      (void)io_uring_submit(&uring->ring);
+      sqe = io_uring_get_sqe(&uring->ring);
+   }
+   return sqe;
+}
+
+
+
+//continue `io` after a short read, to read the rest of its range. Returns false, if it couldn't be submitted
+static bool rdirect_io_uring_continue(struct rdirect_uring * const uring, struct rdirect_io * const io)
+{
+   struct io_uring_sqe *sqe = rdirect_uring_get_sqe(uring);
+   if (sqe == NULL)
+   {
+      return false;
+   }
+   uint8_t *buffer = (uint8_t *)io->buffer + io->done;
+   if (io->bufferIndex >= 0)
+   {
+      io_uring_prep_read_fixed(sqe, io->fd, buffer, io->len - io->done, io->offset + (off_t)io->done,
+            io->bufferIndex);
+   }
+   else
+   {
+      io_uring_prep_read(sqe, io->fd, buffer, io->len - io->done, io->offset + (off_t)io->done);
+   }
+   io_uring_sqe_set_data(sqe, io);
+   (void)io_uring_submit(&uring->ring);
+   return true;
+}
+
+
+
+/*
+ * Complete the merged read headed by `head`, which returned `res`: the bytes read are split among its ios in
+ * order. Ios, that got less than their range, continue by themselves (as after a short read). If the merged read
+ * failed, each io is retried by itself, so an error only fails the ios whose range it is in.
+ */
+static void rdirect_uring_complete_merged(struct rdirect_uring * const uring, struct rdirect_io * const head,
+         const int res)
+{
+   size_t left = (res > 0) ? (size_t)res : 0;
+   struct rdirect_io *io = head;
+   TALLOC_FREE(head->mergeIov);
+   while (io != NULL)
+   {
+      struct rdirect_io * const next = io->mergeNext;
+      io->mergeNext = NULL;
+      io->merged = false;
+      io->done = MIN(left, io->len);
+      left -= io->done;
+      if ((res != 0) && (io->done < io->len) && rdirect_io_uring_continue(uring, io))
+      {
+         io = next;
+         continue;
+      }
+      if ((res < 0) && (io->done == 0))
+      {
+         io->result = -1;
+         io->vfs_aio_state.error = -res;
+      }
+      else
+      {
+         io->result = (ssize_t)io->done;
+      }
+      rdirect_io_finish(io);
+      io = next;
+   }
+}
+
+
+
+//process all completions available in the completion queue
+static void rdirect_uring_reap(struct rdirect_uring * const uring)
+{
+   struct io_uring_cqe *cqe = NULL;
+   while (io_uring_peek_cqe(&uring->ring, &cqe) == 0)
+   {
+      struct rdirect_io *io = (struct rdirect_io *)io_uring_cqe_get_data(cqe);
+      const int res = cqe->res;
+      io_uring_cqe_seen(&uring->ring, cqe);
+      if (io == NULL)
+      {
+         continue;
+      }
+      if (io->mergeNext != NULL)
+      {
+         rdirect_uring_complete_merged(uring, io, res);
+         continue;
+      }
+      if (res < 0)
+      {
+         //a continued read, that fails (e.g. at an unaligned end of file), returns what has been read before
+         io->result = (io->done > 0) ? (ssize_t)io->done : -1;
+         io->vfs_aio_state.error = -res;
+      }
+      else
+      {
+         io->done += (size_t)res;
+         if ((res > 0) && (io->done < io->len) && rdirect_io_uring_continue(uring, io))
+         {
+            continue; //short read -> read the rest (until end of file)
+         }
+         io->result = (ssize_t)io->done;
+      }
+      rdirect_io_finish(io);
+   }
+}
+
+
+
+static void rdirect_uring_fd_handler(struct tevent_context *ev,
+               struct tevent_fd *fde,
+               uint16_t flags,
+               void *private_data)
+{
+   struct rdirect_uring *uring = talloc_get_type_abort(private_data, struct rdirect_uring);
+   eventfd_t value;
+   (void)eventfd_read(uring->eventFd, &value); //reset the eventfd counter
+   rdirect_uring_reap(uring);
+}
+
+
+
+/*
+ * Get the ring of this process. It is set up on first use.
+ * Returns NULL, if io_uring is not available.
+ */
+static struct rdirect_uring *rdirect_uring_get(struct tevent_context * const ev)
+{
+   if ((rdirect_uring != NULL) || rdirect_uring_unavailable)
+   {
+      return rdirect_uring;
+   }
+
+   struct rdirect_uring *uring = talloc_zero(ev, struct rdirect_uring);
+   if (uring == NULL)
+   {
+      return NULL;
+   }
+   int ret = io_uring_queue_init(RDIRECT_URING_ENTRIES, &uring->ring, 0);
+   if (ret < 0)
+   {
+      DEBUG(1, ("vfs_rdirect:io_uring Failed to set up ring. Code %d\n", -ret));
+      TALLOC_FREE(uring);
+      rdirect_uring_unavailable = true;
+      return NULL;
+   }
+   uring->eventFd = -1;
+   uring->ev = ev;
+   talloc_set_destructor(uring, rdirect_uring_destructor);
+
+#ifdef HAVE_IO_URING_RING_DONTFORK
+   (void)io_uring_ring_dontfork(&uring->ring);
+#endif
+
+   uring->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if ((uring->eventFd < 0) || (io_uring_register_eventfd(&uring->ring, uring->eventFd) < 0))
+   {
+      DEBUG(1, ("vfs_rdirect:io_uring Failed to set up eventfd.\n"));
+      goto fail;
+   }
+   uring->fde = tevent_add_fd(ev, uring, uring->eventFd, TEVENT_FD_READ, rdirect_uring_fd_handler, uring);
+   if (uring->fde == NULL)
+   {
+      goto fail;
+   }
+
+   //register the aligned buffers. if this fails, pooled bounce buffers are used instead
+   uring->bufferMemory = rdirect_pool_get(RDIRECT_URING_BUFFERS * RDIRECT_URING_BUFFER_SIZE);
+   if (uring->bufferMemory != NULL)
+   {
+      for (int i = 0; i < RDIRECT_URING_BUFFERS; ++i)
+      {
+         uring->buffers[i].iov_base = (uint8_t *)uring->bufferMemory + (size_t)i * RDIRECT_URING_BUFFER_SIZE;
+         uring->buffers[i].iov_len = RDIRECT_URING_BUFFER_SIZE;
+      }
+      ret = io_uring_register_buffers(&uring->ring, uring->buffers, RDIRECT_URING_BUFFERS);
+      if (ret == 0)
+      {
+         uring->freeBuffers = (uint32_t)((1ULL << RDIRECT_URING_BUFFERS) - 1);
+      }
+      else
+      {
+         DEBUG(5, ("vfs_rdirect:io_uring Failed to register buffers. Code %d\n", -ret));
+         rdirect_pool_put(uring->bufferMemory, RDIRECT_URING_BUFFERS * RDIRECT_URING_BUFFER_SIZE);
+         uring->bufferMemory = NULL;
+      }
+   }
+
+   rdirect_uring = uring;
+   return uring;
+
+fail:
+   TALLOC_FREE(uring);
+   rdirect_uring_unavailable = true;
+   return NULL;
+}
+
+
+
+//order of the queued ios: by descriptor, then by offset
+static int rdirect_uring_compare(const void *a, const void *b)
+{
+   const struct rdirect_io * const ioA = *(struct rdirect_io * const *)a;
+   const struct rdirect_io * const ioB = *(struct rdirect_io * const *)b;
+   if (ioA->fd != ioB->fd)
+   {
+      return (ioA->fd < ioB->fd) ? -1 : 1;
+   }
+   if (ioA->offset != ioB->offset)
+   {
+      return (ioA->offset < ioB->offset) ? -1 : 1;
+   }
+   return 0;
+}
+
+
+
+//prepare the read of `io` (by itself) in `sqe`
+static void rdirect_uring_prep(struct io_uring_sqe * const sqe, struct rdirect_io * const io)
+{
+   if (io->bufferIndex >= 0)
+   {
+      io_uring_prep_read_fixed(sqe, io->fd, io->buffer, io->len, io->offset, io->bufferIndex);
+   }
+   else
+   {
+      io_uring_prep_read(sqe, io->fd, io->buffer, io->len, io->offset);
+   }
+   io_uring_sqe_set_data(sqe, io);
+}
+
+
+
+/*
+ * Submit the ios queued on the ring, by a single io_uring_submit.
+ * The ios are sorted by descriptor and offset, and each run of adjacent ranges (up to RDIRECT_URING_MERGE_IOS ios
+ * and RDIRECT_URING_MERGE_SIZE bytes) is merged into a single vectored read into their buffers - one larger
+ * device I/O instead of several small ones. Ios cancelled while queued complete with ECANCELED, unsubmitted.
+ */
+static void rdirect_uring_flush(struct rdirect_uring * const uring)
+{
+   const unsigned int count = uring->numPending;
+   if (count == 0)
+   {
+      return;
+   }
+   //(completions may queue new ios)
+   struct rdirect_io *ios[RDIRECT_URING_ENTRIES];
+   memcpy(ios, uring->pending, count * sizeof(ios[0]));
+   uring->numPending = 0;
+   qsort(ios, count, sizeof(ios[0]), rdirect_uring_compare);
+   for (unsigned int i = 0; i < count; ++i)
+   {
+      ios[i]->queued = false;
+   }
+
+   unsigned int i = 0;
+   while (i < count)
+   {
+      struct rdirect_io * const head = ios[i];
+      if (head->cancelled)
+      {
+         ++i;
+         continue;
+      }
+      unsigned int n = 1;
+      size_t len = head->len;
+      while ((i + n < count) && (n < RDIRECT_URING_MERGE_IOS))
+      {
+         const struct rdirect_io * const next = ios[i + n];
+         if (next->cancelled || (next->fd != head->fd) || (next->offset != head->offset + (off_t)len)
+               || (len + next->len > RDIRECT_URING_MERGE_SIZE))
+         {
+            break;
+         }
+         len += next->len;
+         ++n;
+      }
+      if (n > 1)
+      {
+         head->mergeIov = talloc_array(head, struct iovec, n);
+         if (head->mergeIov == NULL)
+         {
+            n = 1; //read them one by one
+         }
+      }
+
+      //(an entry for each queued io was kept free on queueing)
+      struct io_uring_sqe * const sqe = io_uring_get_sqe(&uring->ring);
+      if (sqe == NULL)
+      {
+         DEBUG(1, ("vfs_rdirect:io_uring Submission queue full, reading synchronously.\n"));
+         TALLOC_FREE(head->mergeIov);
+         for (unsigned int k = 0; k < n; ++k)
+         {
+            ios[i + k]->uring = NULL;
+            rdirect_io_run(ios[i + k]);
+         }
+         i += n;
+         continue;
+      }
+      if (n == 1)
+      {
+         rdirect_uring_prep(sqe, head);
+         ++i;
+         continue;
+      }
+      for (unsigned int k = 0; k < n; ++k)
+      {
+         struct rdirect_io * const io = ios[i + k];
+         head->mergeIov[k].iov_base = io->buffer;
+         head->mergeIov[k].iov_len = io->len;
+         io->merged = true;
+         io->mergeNext = (k + 1 < n) ? ios[i + k + 1] : NULL;
+         rdirect_count(io->stats, RDIRECT_STATS_MERGED_READS, 1);
+      }
+      io_uring_prep_readv(sqe, head->fd, head->mergeIov, n, head->offset);
+      io_uring_sqe_set_data(sqe, head);
+      i += n;
+   }
+
+   const int ret = io_uring_submit(&uring->ring);
+   if (ret < 0)
+   {
+      //the entries stay in the submission queue and are submitted together with the next ones
+      DEBUG(5, ("vfs_rdirect:io_uring Failed to submit. Code %d\n", -ret));
+   }
+
+   for (i = 0; i < count; ++i)
+   {
+      if (ios[i]->cancelled)
+      {
+         ios[i]->result = -1;
+         ios[i]->vfs_aio_state.error = ECANCELED;
+         rdirect_io_finish(ios[i]);
+      }
+   }
+}
+
+
+
+static void rdirect_uring_flush_timer(struct tevent_context *ev,
+               struct tevent_timer *te,
+               struct timeval current_time,
+               void *private_data)
+{
+   struct rdirect_uring *uring = talloc_get_type_abort(private_data, struct rdirect_uring);
+   uring->flushTimer = NULL; //freed by tevent
+   rdirect_uring_flush(uring);
+}
+
+
+
+/*
+ * Queue `io` on the ring.
+ * The ios queued are submitted together (see rdirect_uring_flush) by a timer, that is due at once. As tevent only
+ * runs timers when there are no immediate events left, this happens after all requests dispatched in the
+ * same loop iteration have been queued (e.g. the parts of a compound request, or the requests of a client
+ * received at once).
+ * Returns false, if the io couldn't be queued.
+ */
+static bool rdirect_io_uring_submit(struct rdirect_uring * const uring, struct rdirect_io * const io)
+{
+   //keep a submission queue entry free for each io queued
+   if (uring->numPending >= io_uring_sq_space_left(&uring->ring))
+   {
+      rdirect_uring_flush(uring);
+      if (io_uring_sq_space_left(&uring->ring) == 0)
+      {
+         return false;
+      }
+   }
+
+   if ((io->buffer == NULL) && (io->len <= RDIRECT_URING_BUFFER_SIZE) && (uring->freeBuffers != 0))
+   {
+      //read into a registered buffer
+      io->bufferIndex = ffs((int)uring->freeBuffers) - 1;
+      uring->freeBuffers &= ~(1U << io->bufferIndex);
+      io->buffer = uring->buffers[io->bufferIndex].iov_base;
+      io->ownBuffer = true;
+   }
+   else if (!rdirect_io_alloc_buffer(io))
+   {
+      //(read into the caller's buffer or a pooled bounce buffer otherwise)
+      return false;
+   }
+
+   uring->pending[uring->numPending++] = io;
+   PROFILE_TIMESTAMP(&io->start);
+   io->inFlight = true;
+   io->queued = true;
+   io->engine = RDIRECT_ENGINE_IO_URING;
+   io->uring = uring;
+   if (uring->flushTimer == NULL)
+   {
+      uring->flushTimer = tevent_add_timer(uring->ev, uring, tevent_timeval_current_ofs(0, 0),
+            rdirect_uring_flush_timer, uring);
+      if (uring->flushTimer == NULL)
+      {
+         rdirect_uring_flush(uring); //submit right away
+      }
+   }
+   return true;
+}
+
+
+
+static void rdirect_io_landed(struct rdirect_io *io, void *private_data)
+{
+   *(bool *)private_data = true;
+   TALLOC_FREE(io);
+}
+
+
+
+//wait for the completion of `io`, in flight on a ring. `io` is freed afterwards
+static void rdirect_io_uring_wait(struct rdirect_io * const io)
+{
+   struct rdirect_uring *uring = io->uring;
+   bool landed = false;
+   io->done_fn = rdirect_io_landed;
+   io->private_data = &landed;
+   rdirect_uring_flush(uring); //(if queued still)
+   while (!landed)
+   {
+      const int ret = io_uring_submit_and_wait(&uring->ring, 1);
+      if ((ret < 0) && (ret != -EINTR))
+      {
+         DEBUG(0, ("vfs_rdirect:io_uring Failed to wait for completion. Code %d\n", -ret));
+         smb_panic("vfs_rdirect: can't free in-flight read");
+      }
+      rdirect_uring_reap(uring);
+   }
+}
+#endif
+
+
+
+/*
+ * Submit `io` to the engine of the share. The io_uring engine falls back to the threadpool, if the ring is not
+ * available (or the io is read raw). Returns false, if the io couldn't be submitted.
+ */
+static bool rdirect_io_submit(vfs_handle_struct * const handle, struct tevent_context * const ev,
+         const struct rdirect_config * const config, struct rdirect_io * const io)
+{
+   io->stats = config->stats;
+   bool submitted = false;
+#ifdef RDIRECT_URING
+   if ((config->engine == RDIRECT_ENGINE_IO_URING) && (io->raw == NULL))
+   {
+      //(raw reads may span several extents, so they are left to the threadpool)
+      struct rdirect_uring *uring = rdirect_uring_get(handle->conn->sconn->ev_ctx);
+      submitted = (uring != NULL) && rdirect_io_uring_submit(uring, io);
+      //ring not available or exhausted -> use the threadpool
+   }
+#endif
+   if (!submitted)
+   {
+      submitted = rdirect_io_pool_submit(handle, ev, io);
+   }
+   if (submitted)
+   {
+      RDIRECT_PROBE4(submit, io->fd, io->offset, io->len, io->engine);
+   }
+   return submitted;
+}
+
+
+
+/*
+ * Try to stop `io` in flight: a read queued on the threadpool, that hasn't started yet, is dropped. A read on a ring
+ * is dropped, if not submitted yet, and cancelled (IORING_OP_ASYNC_CANCEL) otherwise, which stops it, unless the
+ * device is processing it already (or it is merged with others).
+ * Either way, `io` completes as usual (with ECANCELED, if stopped).
+ */
+static void rdirect_io_cancel(struct rdirect_io * const io)
+{
+   if (!io->inFlight)
+   {
+      return;
+   }
+#ifdef RDIRECT_URING
+   if (io->uring != NULL)
+   {
+      if (io->queued)
+      {
+         io->cancelled = true; //completes on flush
+         return;
+      }
+      if (io->merged)
+      {
+         return; //the read serves the other ios merged as well
+      }
+      struct io_uring_sqe *sqe = rdirect_uring_get_sqe(io->uring);
+      if (sqe != NULL)
+      {
+         io_uring_prep_cancel(sqe, io, 0);
+         io_uring_sqe_set_data(sqe, NULL); //the completion of the cancellation itself is ignored
+         (void)io_uring_submit(&io->uring->ring);
+      }
+      return;
+   }
+#endif
+   if (io->job != NULL)
+   {
+      tevent_req_cancel(io->job);
+   }
+}
+
+
+
+/*
+ * The requester of `io` is going away. If `io` is still in flight, it is cancelled (so it doesn't occupy the
+ * device queue or a worker), and frees itself when it lands. Otherwise it is freed right away.
+ */
+static void rdirect_io_abandon(struct rdirect_io * const io)
+{
+   if (!io->inFlight)
+   {
+      talloc_free(io);
+      return;
+   }
+   rdirect_io_cancel(io);
+#ifdef RDIRECT_URING
+   if ((io->uring != NULL) && !io->ownBuffer)
+   {
+      //the kernel would write into the requester's buffer. so we must wait until it's done
+      rdirect_io_uring_wait(io);
+      return;
+   }
+#endif
+   //the worker threads can't be stopped. like vfs_default, the job is left running
+   io->done_fn = NULL;
+}
+
+
+
+/*
+ * Read-ahead of sequential streams (per file handle).
+ *
+ * Bypassing the page cache bypasses the kernel's read-ahead as well. So the module detects sequential access itself,
+ * and then prefetches the next `rdirect:readahead` chunks of `rdirect:readahead size` bytes asynchronously into
+ * private buffers. Subsequent reads are served from these chunks, or wait for a chunk in flight. Chunks behind the
+ * stream are recycled as the client moves forward. The memory used for read-ahead is capped per process by
+ * `rdirect:readahead memory`. Read-ahead requires an asynchronous engine.
+ */
+#define RDIRECT_RA_MAX_DEPTH  16   //max. number of chunks per file handle
+#define RDIRECT_RA_TRIGGER    2    //number of consecutive sequential reads that make a stream
+
+struct rdirect_pread_state;
+
+struct rdirect_ra_chunk {
+   struct rdirect_readahead *ra;
+   off_t offset; //aligned file offset of the chunk
+   struct rdirect_io *io; //read of the chunk (NULL: slot is unused)
+   bool ready; //read has completed
+   struct rdirect_pread_state *waiters; //requests waiting for the chunk to complete
+   bool stale; //range was written while requests wait -> release the chunk after serving them
+};
+
+struct rdirect_readahead {
+   struct rdirect_readahead *prev, *next;
+   size_t size; //chunk size (multiple of the offset alignment)
+   unsigned int depth; //number of chunks to prefetch
+   off_t nextOffset; //offset a sequential read is expected at
+   unsigned int sequential; //number of consecutive sequential reads
+   off_t eof; //end of file, as seen by a short chunk read (-1: unknown)
+   struct file_id id; //file the chunks are read from
+   struct rdirect_ra_chunk chunks[RDIRECT_RA_MAX_DEPTH];
+};
+
+static size_t rdirect_ra_memory = 0; //bytes in use for read-ahead chunks (per process)
+static struct rdirect_readahead *rdirect_readaheads = NULL; //read-ahead of all file handles (per process)
+
+
+
+
+struct rdirect_pread_state {
+   struct tevent_req *req;
+   ssize_t bytes_read;
+   struct vfs_aio_state vfs_aio_state;
+   struct rdirect_stats *stats; //statistics of the share (NULL: not collected)
+#ifdef RDIRECT_PROBES
+   int fd; //descriptor of the file (for the probes)
+   struct timespec start; //time the request was received
+#endif
+   vfs_handle_struct *handle; //module handle, file handle and context of the request,
+   struct tevent_context *ev; //to start it after waiting for QoS admission
+   files_struct *fsp;
+   const struct rdirect_config *config;
+   void *data; //caller's buffer
+   size_t n; //number of requested bytes
+   off_t offset; //requested offset
+   struct rdirect_span span; //covering range, actually read from the device
+   struct rdirect_io **ios; //direct reads of the covering range (in flight, if not NULL)
+   unsigned int numIos; //number of direct reads the covering range is split into
+   unsigned int pending; //number of direct reads not completed yet
+   int error; //error of the first failed direct read (0: none)
+   off_t covered; //end of the data read from the covering range (less than its end, at end of file)
+   uint8_t *inPlace; //caller's buffer at its first aligned address, the covering range is read into (NULL: not in place)
+   size_t inPlaceLen; //length of the part of the covering range read in place
+   struct rdirect_io *tail; //completed read of the rest of the covering range (kept, until the data is shifted)
+   bool cacheFill; //fill the block cache with the data read
+   struct rdirect_cache_file cacheFile; //key of the file in the block cache
+   uint64_t cacheEpoch; //invalidation epoch of the cache, when the reads were started
+   bool dontneed; //drop the data read from the page cache afterwards (read passed to the next module only)
+   int dontneedFd; //descriptor the data is read from
+   struct rdirect_ra_chunk *chunk; //read-ahead chunk the request is waiting for (NULL, if none)
+   struct rdirect_flight *flight; //read of another request, the request is attached to (NULL, if none)
+   struct rdirect_qos *qos; //QoS, the request is waiting for admission by (NULL, if none)
+   struct rdirect_pread_state *prev, *next; //list of requests waiting for the chunk, the read or the admission
+   struct tevent_timer *hedgeTimer; //deadline of the reads, after which a duplicate is issued (NULL, if none)
+   struct rdirect_io *hedge; //duplicate read of the covering range (NULL, if none)
+   bool cancelled; //the request has been cancelled, and completes with ECANCELED
+};
+
+
+
+//copy the requested bytes of `state` out of the completed read `io` (into a buffer of its own), and complete the request
+static void rdirect_pread_serve_io(struct rdirect_pread_state * const state, const struct rdirect_io * const io)
+{
+   if (io->result < 0)
+   {
+      tevent_req_error(state->req, io->vfs_aio_state.error);
+      return;
+   }
+
+   const size_t head = (size_t)(state->offset - io->offset);
+   state->bytes_read = ((size_t)io->result > head) ? (ssize_t)MIN((size_t)io->result - head, state->n) : 0;
+   if (state->bytes_read > 0)
+   {
+      memcpy(state->data, (const uint8_t *)io->buffer + head, state->bytes_read);
+      rdirect_count(state->stats, RDIRECT_STATS_BOUNCE_COPIES, 1);
+      rdirect_count(state->stats, RDIRECT_STATS_BOUNCE_BYTES, (uint64_t)state->bytes_read);
+   }
+   tevent_req_done(state->req);
+}
+
+
+
+//copy the requested bytes of `state` out of the completed read-ahead chunk, and complete the request
+static void rdirect_pread_serve_chunk(struct rdirect_pread_state * const state,
+         const struct rdirect_ra_chunk * const chunk)
+{
+   rdirect_pread_serve_io(state, chunk->io);
+}
+
+
+
+/*
+ * Coalescing of concurrent reads (`rdirect:coalesce`).
+ *
+ * Reads into a buffer of their own are registered in a table of the process while in flight, keyed by file and
+ * range. A request for a range that is being read already, attaches to that read instead of going to the device,
+ * and gets a copy of the data when it lands. A write to the range removes the read from the table, so later
+ * requests don't see stale data.
+ */
+struct rdirect_flight {
+   struct rdirect_flight *prev, *next;
+   struct file_id id; //file being read
+   struct rdirect_io *io; //read in flight
+   bool listed; //read is in the table (may be joined)
+   struct rdirect_pread_state *waiters; //requests attached to the read
+};
+
+static struct rdirect_flight *rdirect_flights = NULL; //reads in flight, that may be joined (per process)
+
+
+
+static int rdirect_flight_destructor(struct rdirect_flight *flight)
+{
+   struct rdirect_pread_state *state = NULL;
+
+   if (flight->listed)
+   {
+      DLIST_REMOVE(rdirect_flights, flight);
+   }
+   //the read is freed without landing (the engine is shut down)
+   while ((state = flight->waiters) != NULL)
+   {
+      DLIST_REMOVE(flight->waiters, state);
+      state->flight = NULL;
+      tevent_req_error(state->req, EIO);
+   }
+   flight->io->flight = NULL;
+   return 0;
+}
+
+
+
+//make `io` (just submitted) joinable by other requests for the file `id`
+static void rdirect_flight_add(struct rdirect_io * const io, const struct file_id * const id)
+{
+   if (!io->ownBuffer || !io->inFlight)
+   {
+      return; //reads into the requester's buffer can't be shared
+   }
+   struct rdirect_flight *flight = talloc_zero(io, struct rdirect_flight);
+   if (flight == NULL)
+   {
+      return; //out of memory -> just not shared
+   }
+   flight->id = *id;
+   flight->io = io;
+   flight->listed = true;
+   DLIST_ADD(rdirect_flights, flight);
+   talloc_set_destructor(flight, rdirect_flight_destructor);
+   io->flight = flight;
+}
+
+
+
+//the read has landed -> serve the requests attached to it
+static void rdirect_flight_land(struct rdirect_flight *flight)
+{
+   struct rdirect_io *io = flight->io;
+   struct rdirect_pread_state *state = NULL;
+
+   if (flight->listed)
+   {
+      DLIST_REMOVE(rdirect_flights, flight);
+      flight->listed = false;
+   }
+   while ((state = flight->waiters) != NULL)
+   {
+      DLIST_REMOVE(flight->waiters, state);
+      state->flight = NULL;
+      state->vfs_aio_state.duration = io->vfs_aio_state.duration;
+      rdirect_pread_serve_io(state, io);
+   }
+   TALLOC_FREE(io->flight);
+}
+
+
+
+//get the read in flight, that contains the requested range of the file `id` (NULL, if none)
+static struct rdirect_flight *rdirect_flight_find(const struct file_id * const id, const size_t n,
+         const off_t offset)
+{
+   for (struct rdirect_flight *flight = rdirect_flights; flight != NULL; flight = flight->next)
+   {
+      const struct rdirect_io *io = flight->io;
+      if (file_id_equal(&flight->id, id) && (offset >= io->offset)
+            && (offset + (off_t)n <= io->offset + (off_t)io->len))
+      {
+         return flight;
+      }
+   }
+   return NULL;
+}
+
+
+
+//remove the reads overlapping a written range of the file `id` from the table
+static void rdirect_flight_invalidate(const struct file_id * const id, const size_t n, const off_t offset)
+{
+   struct rdirect_flight *flight = rdirect_flights;
+   while (flight != NULL)
+   {
+      struct rdirect_flight *next = flight->next;
+      const struct rdirect_io *io = flight->io;
+      if (file_id_equal(&flight->id, id) && (offset < io->offset + (off_t)io->len)
+            && (offset + (off_t)n > io->offset))
+      {
+         DLIST_REMOVE(rdirect_flights, flight);
+         flight->listed = false;
+      }
+      flight = next;
+   }
+}
+
+
+
+//release the read-ahead chunk. its read is abandoned, if still in flight
+static void rdirect_ra_release(struct rdirect_ra_chunk * const chunk)
+{
+   if (chunk->io == NULL)
+   {
+      return;
+   }
+   rdirect_ra_memory -= chunk->ra->size;
+   rdirect_io_abandon(chunk->io);
+   chunk->io = NULL;
+   chunk->ready = false;
+   chunk->stale = false;
+}
+
+
+
+static void rdirect_ra_free(struct rdirect_readahead *ra)
+{
+   for (unsigned int i = 0; i < RDIRECT_RA_MAX_DEPTH; ++i)
+   {
+      struct rdirect_ra_chunk *chunk = &ra->chunks[i];
+      struct rdirect_pread_state *state = NULL;
+      while ((state = chunk->waiters) != NULL)
+      {
+         DLIST_REMOVE(chunk->waiters, state);
+         state->chunk = NULL;
+         tevent_req_error(state->req, EBADF);
+      }
+      rdirect_ra_release(chunk);
+   }
+   DLIST_REMOVE(rdirect_readaheads, ra);
+   talloc_free(ra);
+}
+
+
+
+static void rdirect_ra_chunk_done(struct rdirect_io *io, void *private_data)
+{
+   struct rdirect_ra_chunk *chunk = (struct rdirect_ra_chunk *)private_data;
+   struct rdirect_readahead *ra = chunk->ra;
+   struct rdirect_pread_state *state = NULL;
+
+   chunk->ready = true;
+   if ((io->result >= 0) && ((size_t)io->result < io->len))
+   {
+      ra->eof = chunk->offset + io->result; //short read -> no need to prefetch beyond
+   }
+   while ((state = chunk->waiters) != NULL)
+   {
+      DLIST_REMOVE(chunk->waiters, state);
+      state->chunk = NULL;
+      state->vfs_aio_state.duration = io->vfs_aio_state.duration;
+      rdirect_pread_serve_chunk(state, chunk);
+   }
+   if (chunk->stale)
+   {
+      rdirect_ra_release(chunk); //holds the data before a write
+   }
+}
+
+
+
+//get the read-ahead of the file handle. It is created on first use. Returns NULL on out of memory
+static struct rdirect_readahead *rdirect_ra_get(const struct rdirect_config * const config,
+         files_struct * const fsp, struct rdirect_fsp * const rfsp)
+{
+   if (rfsp->ra != NULL)
+   {
+      return rfsp->ra;
+   }
+
+   struct rdirect_readahead *ra = talloc_zero(fsp, struct rdirect_readahead);
+   if (ra == NULL)
+   {
+      return NULL;
+   }
+   //chunks must be aligned, for the device can read straight into them
+   const size_t mask = (size_t)rfsp->align.offset - 1;
+   ra->size = MAX((config->raSize + mask) & ~mask, (size_t)rfsp->align.offset);
+   ra->depth = config->raDepth;
+   ra->eof = -1;
+   ra->id = fsp->file_id;
+   for (unsigned int i = 0; i < RDIRECT_RA_MAX_DEPTH; ++i)
+   {
+      ra->chunks[i].ra = ra;
+   }
+   DLIST_ADD(rdirect_readaheads, ra);
+   rfsp->ra = ra;
+   return ra;
+}
+
+
+
+//track the access pattern: reads starting close to the end of the previous one, are considered sequential
+static void rdirect_ra_access(struct rdirect_readahead * const ra, const size_t n, const off_t offset)
+{
+   const off_t window = (off_t)ra->size;
+   if ((offset >= ra->nextOffset - window) && (offset <= ra->nextOffset + window))
+   {
+      if (ra->sequential < RDIRECT_RA_TRIGGER)
+      {
+         ++ra->sequential;
+      }
+      ra->nextOffset = MAX(ra->nextOffset, offset + (off_t)n);
+      return;
+   }
+
+   //random access -> drop the chunks nobody waits for
+   ra->sequential = 0;
+   ra->nextOffset = offset + (off_t)n;
+   for (unsigned int i = 0; i < RDIRECT_RA_MAX_DEPTH; ++i)
+   {
+      if (ra->chunks[i].waiters == NULL)
+      {
+         rdirect_ra_release(&ra->chunks[i]);
+      }
+   }
+}
+
+
+
+//get the chunk containing the requested range (NULL, if none)
+static struct rdirect_ra_chunk *rdirect_ra_find(struct rdirect_readahead * const ra, const size_t n,
+         const off_t offset)
+{
+   for (unsigned int i = 0; i < RDIRECT_RA_MAX_DEPTH; ++i)
+   {
+      struct rdirect_ra_chunk *chunk = &ra->chunks[i];
+      if ((chunk->io == NULL) || chunk->stale || (offset < chunk->offset)
+            || (offset >= chunk->offset + (off_t)ra->size))
+      {
+         continue;
+      }
+      if (chunk->ready && (chunk->io->result < 0))
+      {
+         rdirect_ra_release(chunk); //failed -> let the request read by itself
+         return NULL;
+      }
+      //the range must be inside the chunk, unless the chunk ends at end of file
+      if ((offset + (off_t)n <= chunk->offset + (off_t)ra->size)
+            || (chunk->ready && ((size_t)chunk->io->result < ra->size)))
+      {
+         return chunk;
+      }
+      return NULL;
+   }
+   return NULL;
+}
+
+
+
+//prefetch the chunks following the stream position, and recycle the ones behind it
+static void rdirect_ra_prefetch(vfs_handle_struct * const handle, struct tevent_context * const ev,
+         const struct rdirect_config * const config, const struct rdirect_fsp * const rfsp,
+         struct rdirect_readahead * const ra)
+{
+   if (ra->sequential < RDIRECT_RA_TRIGGER)
+   {
+      return;
+   }
+
+   const off_t size = (off_t)ra->size;
+   const off_t first = (ra->nextOffset / size) * size; //chunk the next sequential read starts in
+   for (unsigned int i = 0; i < RDIRECT_RA_MAX_DEPTH; ++i)
+   {
+      struct rdirect_ra_chunk *chunk = &ra->chunks[i];
+      if ((chunk->io != NULL) && chunk->ready && (chunk->waiters == NULL) && (chunk->offset + size < first))
+      {
+         rdirect_ra_release(chunk);
+      }
+   }
+
+   for (unsigned int k = 0; k < ra->depth; ++k)
+   {
+      const off_t offset = first + (off_t)k * size;
+      if (((ra->eof >= 0) && (offset >= ra->eof)) || ((rfsp->size >= 0) && (offset >= rfsp->size)))
+      {
+         break; //nothing to prefetch beyond end of file
+      }
+
+      struct rdirect_ra_chunk *slot = NULL;
+      bool present = false;
+      for (unsigned int i = 0; i < RDIRECT_RA_MAX_DEPTH; ++i)
+      {
+         struct rdirect_ra_chunk *chunk = &ra->chunks[i];
+         if (chunk->io == NULL)
+         {
+            slot = (slot == NULL) ? chunk : slot;
+         }
+         else if ((chunk->offset == offset) && !chunk->stale)
+         {
+            present = true;
+            break;
+         }
+      }
+      if (present)
+      {
+         continue;
+      }
+      if ((slot == NULL) || (rdirect_ra_memory + ra->size > config->raMemory))
+      {
+         break;
+      }
+
+      struct rdirect_io *io = rdirect_io_new(rdirect_fsp_read_fd(rfsp), rfsp->dfd, rfsp->raw, offset, ra->size,
+            NULL);
+      if (io == NULL)
+      {
+         break;
+      }
+      io->done_fn = rdirect_ra_chunk_done;
+      io->private_data = slot;
+      if (!rdirect_io_submit(handle, ev, config, io))
+      {
+         TALLOC_FREE(io);
+         break;
+      }
+      if (config->coalesce)
+      {
+         rdirect_flight_add(io, &ra->id);
+      }
+      slot->io = io;
+      slot->offset = offset;
+      slot->ready = false;
+      rdirect_ra_memory += ra->size;
+   }
+}
+
+
+
+/*
+ * Move the data of the request `state` read in place (see rdirect_pread_submit) to the start of the caller's
+ * buffer, and append the requested part of the rest of the covering range.
+ */
+static void rdirect_pread_shift(struct rdirect_pread_state * const state)
+{
+   const size_t bytes = (state->bytes_read > 0) ? (size_t)state->bytes_read : 0;
+   const size_t moved = MIN(bytes, state->inPlaceLen - state->span.head);
+   if ((moved > 0) && (state->inPlace + state->span.head != (uint8_t *)state->data))
+   {
+      memmove(state->data, state->inPlace + state->span.head, moved);
+   }
+   if ((state->tail != NULL) && (bytes > moved))
+   {
+      memcpy((uint8_t *)state->data + moved, state->tail->buffer, bytes - moved);
+      rdirect_count(state->stats, RDIRECT_STATS_BOUNCE_COPIES, 1);
+      rdirect_count(state->stats, RDIRECT_STATS_BOUNCE_BYTES, (uint64_t)(bytes - moved));
+   }
+   TALLOC_FREE(state->tail);
+}
+
+
+
+/*
+ * Completion of one of the direct reads of a request.
+ * The request completes, when all of its reads have landed.
+ */
+static void rdirect_pread_io_done(struct rdirect_io *io, void *private_data)
+{
+   struct rdirect_pread_state *state = (struct rdirect_pread_state *)private_data;
+
+   for (unsigned int i = 0; i < state->numIos; ++i)
+   {
+      if (state->ios[i] == io)
+      {
+         state->ios[i] = NULL;
+         break;
+      }
+   }
+   --state->pending;
+   state->vfs_aio_state.duration = MAX(state->vfs_aio_state.duration, io->vfs_aio_state.duration);
+
+   if (io->result < 0)
+   {
+      if (state->error == 0)
+      {
+         state->error = io->vfs_aio_state.error;
+      }
+   }
+   else
+   {
+      const off_t end = io->offset + (off_t)io->result;
+      if ((size_t)io->result < io->len)
+      {
+         state->covered = MIN(state->covered, end); //short read (end of file)
+      }
+      if (state->cacheFill)
+      {
+         rdirect_cache_fill(&state->cacheFile, state->cacheEpoch, io->buffer, io->offset, (size_t)io->result);
+      }
+      //copy the requested part of the data read, unless it was read straight into the caller's buffer
+      const off_t from = MAX(io->offset, state->offset);
+      const off_t to = MIN(end, state->offset + (off_t)state->n);
+      if (io->ownBuffer && (state->inPlace != NULL))
+      {
+         state->tail = io; //copied, after the data read in place has been shifted
+         io = NULL;
+      }
+      else if (io->ownBuffer && (to > from))
+      {
+         memcpy((uint8_t *)state->data + (from - state->offset),
+               (const uint8_t *)io->buffer + (from - io->offset), (size_t)(to - from));
+         rdirect_count(state->stats, RDIRECT_STATS_BOUNCE_COPIES, 1);
+         rdirect_count(state->stats, RDIRECT_STATS_BOUNCE_BYTES, (uint64_t)(to - from));
+      }
+   }
+   TALLOC_FREE(io);
+
+   if (state->pending > 0)
+   {
+      return;
+   }
+   TALLOC_FREE(state->hedgeTimer);
+   if (state->cancelled)
+   {
+      tevent_req_error(state->req, ECANCELED);
+      return;
+   }
+   if (state->error != 0)
+   {
+      if (state->hedge == NULL) //(otherwise the duplicate may still succeed)
+      {
+         tevent_req_error(state->req, state->error);
+      }
+      return;
+   }
+   if (state->hedge != NULL)
+   {
+      rdirect_io_abandon(state->hedge);
+      state->hedge = NULL;
+   }
+   state->bytes_read = rdirect_span_count(&state->span, (ssize_t)(state->covered - state->span.offset), state->n);
+   if (state->inPlace != NULL)
+   {
+      rdirect_pread_shift(state);
+   }
+   tevent_req_done(state->req);
+}
+
+
+
+/*
+ * Hedged reads (`rdirect:hedge after`).
+ *
+ * If the reads of a request haven't completed by the deadline (e.g. a disk of a degraded array is retrying), a
+ * duplicate of the covering range is read via an alternate path: from the mirror device (`rdirect:hedge mirror`)
+ * for files read raw, via page cache otherwise. Whichever completes first serves the request, the other read is
+ * abandoned. A request, whose reads fail, waits for its duplicate. As either read may be abandoned, the reads of
+ * hedged requests go to buffers of their own.
+ */
+static void rdirect_pread_hedge_done(struct rdirect_io *io, void *private_data)
+{
+   struct rdirect_pread_state *state = (struct rdirect_pread_state *)private_data;
+   state->hedge = NULL;
+
+   if (io->result < 0)
+   {
+      TALLOC_FREE(io);
+      if (state->pending == 0)
+      {
+         tevent_req_error(state->req, state->error); //the reads have failed before
+      }
+      return;
+   }
+
+   //the duplicate has won
+   rdirect_count(state->stats, RDIRECT_STATS_HEDGE_WINS, 1);
+   for (unsigned int i = 0; i < state->numIos; ++i)
+   {
+      if (state->ios[i] != NULL)
+      {
+         rdirect_io_abandon(state->ios[i]);
+         state->ios[i] = NULL;
+      }
+   }
+   state->pending = 0;
+   state->vfs_aio_state.duration = io->vfs_aio_state.duration;
+   state->bytes_read = rdirect_span_count(&state->span, io->result, state->n);
+   if (state->bytes_read > 0)
+   {
+      memcpy(state->data, (const uint8_t *)io->buffer + state->span.head, (size_t)state->bytes_read);
+      rdirect_count(state->stats, RDIRECT_STATS_BOUNCE_COPIES, 1);
+      rdirect_count(state->stats, RDIRECT_STATS_BOUNCE_BYTES, (uint64_t)state->bytes_read);
+   }
+   TALLOC_FREE(io);
+   tevent_req_done(state->req);
+}
+
+
+
+//the deadline of the reads of a request has passed: issue the duplicate
+static void rdirect_pread_hedge(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time,
+         void *private_data)
+{
+   struct rdirect_pread_state *state = (struct rdirect_pread_state *)private_data;
+   state->hedgeTimer = NULL; //freed by tevent after the handler
+
+   const struct rdirect_fsp *rfsp = (const struct rdirect_fsp *)VFS_FETCH_FSP_EXTENSION(state->handle, state->fsp);
+   if (rfsp == NULL)
+   {
+      return;
+   }
+   const bool mirror = (rfsp->raw != NULL) && (state->config->hedgeMirror >= 0);
+   //the duplicate may outlive the handle (abandoned): read from a descriptor of its own, not smbd's one
+   struct rdirect_dfd *dfd = mirror ? NULL : rdirect_dfd_new(dup(fsp_get_io_fd(state->fsp)));
+   if (!mirror && (dfd == NULL))
+   {
+      return;
+   }
+   struct rdirect_io *io = rdirect_io_new(mirror ? state->config->hedgeMirror : dfd->fd, dfd,
+         mirror ? rfsp->raw : NULL, state->span.offset, state->span.len, NULL);
+   rdirect_dfd_unref(dfd); //(referenced by the io)
+   if (io == NULL)
+   {
+      return;
+   }
+   io->done_fn = rdirect_pread_hedge_done;
+   io->private_data = state;
+   if (!rdirect_io_submit(state->handle, ev, state->config, io))
+   {
+      TALLOC_FREE(io);
+      return;
+   }
+   RDIRECT_PROBE4(hedge, io->fd, state->offset, state->n, mirror);
+   rdirect_count(state->stats, RDIRECT_STATS_HEDGED_READS, 1);
+   state->hedge = io;
+}
+
+
+
+/*
+ * Split the covering range of `state` into direct reads of (at most) `rdirect:chunk size` bytes each, and
+ * submit them to the engine. They are processed concurrently, which keeps deep device queues (NVMe, striped RAIDs)
+ * busy for a single client stream. A read that can't be submitted, is performed synchronously.
+ * If `id` is not NULL, the reads go to buffers of their own, and may be joined by other requests for the file.
+ *
+ * An unaligned request, whose bounce buffers would exceed `rdirect:bounce memory`, is read in place: the aligned
+ * part of the covering range, that fits the caller's buffer at its first aligned address, is read straight into
+ * it, and only the rest (less than two blocks plus the memory alignment) into a bounce buffer. The data is shifted
+ * into place on completion (see rdirect_pread_shift). So the bounce memory of a process stays bounded, however
+ * large and many the requests are. The engine of io_uring merges both reads into one.
+ * Returns false on out of memory.
+ */
+static bool rdirect_pread_submit(vfs_handle_struct * const handle, struct tevent_context * const ev,
+         const struct rdirect_config * const config, const struct rdirect_fsp * const rfsp,
+         const struct file_id * const id, struct rdirect_pread_state * const state)
+{
+   const size_t mask = (size_t)rfsp->align.offset - 1;
+   const size_t chunkSize = (config->chunkSize > 0) ? MAX((config->chunkSize + mask) & ~mask, mask + 1) : 0;
+   const bool aligned = rdirect_span_is_direct(&state->span, &rfsp->align, state->data, state->n);
+   const bool direct = (id == NULL) && aligned && (config->hedgeAfter == 0);
+   if (!aligned && (id == NULL) && (config->hedgeAfter == 0) && (config->bounceMemory > 0)
+         && (rdirect_bounceMemory + state->span.len > config->bounceMemory))
+   {
+      const uintptr_t memMask = (uintptr_t)rfsp->align.mem - 1;
+      uint8_t *inPlace = (uint8_t *)(((uintptr_t)state->data + memMask) & ~memMask);
+      const size_t skip = (size_t)(inPlace - (uint8_t *)state->data);
+      const size_t inPlaceLen = (state->n > skip) ? ((state->n - skip) & ~mask) : 0;
+      if (inPlaceLen > state->span.head)
+      {
+         rdirect_count(state->stats, RDIRECT_STATS_IN_PLACE_READS, 1);
+         state->inPlace = inPlace;
+         state->inPlaceLen = inPlaceLen;
+      }
+   }
+   if (!aligned)
+   {
+      RDIRECT_PROBE4(bounce, state->fd, state->offset, state->n, rfsp->align.offset);
+   }
+
+   //the reads of the part read in place (or of the whole covering range), and of the rest
+   const size_t mainLen = (state->inPlace != NULL) ? state->inPlaceLen : state->span.len;
+   const unsigned int numMain = ((chunkSize > 0) && (mainLen > chunkSize))
+         ? (unsigned int)((mainLen + chunkSize - 1) / chunkSize) : 1;
+   state->numIos = numMain + ((state->inPlace != NULL) ? 1 : 0);
+   state->ios = talloc_zero_array(state, struct rdirect_io *, state->numIos);
+   if (state->ios == NULL)
+   {
+      return false;
+   }
+   state->covered = state->span.offset + (off_t)state->span.len;
+
+   //create all reads first, for the completions are not counted before everything is submitted
+   const size_t len = (numMain > 1) ? chunkSize : mainLen;
+   for (unsigned int i = 0; i < state->numIos; ++i)
+   {
+      const size_t pos = (i < numMain) ? (size_t)i * len : mainLen;
+      uint8_t *buffer = NULL;
+      if (direct)
+      {
+         buffer = (uint8_t *)state->data + pos;
+      }
+      else if ((state->inPlace != NULL) && (i < numMain))
+      {
+         buffer = state->inPlace + pos;
+      }
+      const size_t ioLen = (i < numMain) ? MIN(len, mainLen - pos) : state->span.len - mainLen;
+      struct rdirect_io *io = rdirect_io_new(rdirect_fsp_read_fd(rfsp), rfsp->dfd, rfsp->raw,
+            state->span.offset + (off_t)pos, ioLen, buffer);
+      if (io == NULL)
+      {
+         for (unsigned int k = 0; k < i; ++k)
+         {
+            TALLOC_FREE(state->ios[k]);
+         }
+         return false;
+      }
+      io->done_fn = rdirect_pread_io_done;
+      io->private_data = state;
+      if (buffer == NULL)
+      {
+         io->charged = ioLen;
+         rdirect_bounceMemory += ioLen;
+      }
+      state->ios[i] = io;
+   }
+
+   state->pending = state->numIos;
+   for (unsigned int i = 0; i < state->numIos; ++i)
+   {
+      struct rdirect_io *io = state->ios[i];
+      if (!rdirect_io_submit(handle, ev, config, io))
+      {
+         rdirect_io_run(io); //completes the read right away
+      }
+      else if (id != NULL)
+      {
+         rdirect_flight_add(io, id);
+      }
+   }
+   if ((config->hedgeAfter > 0) && (state->pending > 0))
+   {
+      state->hedgeTimer = tevent_add_timer(ev, state, tevent_timeval_current_ofs(config->hedgeAfter / 1000,
+            (config->hedgeAfter % 1000) * 1000), rdirect_pread_hedge, state);
+   }
+   return true;
+}
+
+
+
+/*
+ * The request is about to be freed (or received).
+ * Detach it from a read-ahead chunk or a read it waits for, and abandon its reads, if still in flight.
+ * Requests attached to them, are still served when they land.
+ */
+static void rdirect_pread_detach(struct rdirect_pread_state * const state)
+{
+   if (state->qos != NULL)
+   {
+      DLIST_REMOVE(state->qos->queue, state);
+      if (state->qos->queue == NULL)
+      {
+         TALLOC_FREE(state->qos->timer);
+      }
+      state->qos = NULL;
+   }
+   if (state->chunk != NULL)
+   {
+      DLIST_REMOVE(state->chunk->waiters, state);
+      state->chunk = NULL;
+   }
+   if (state->flight != NULL)
+   {
+      DLIST_REMOVE(state->flight->waiters, state);
+      state->flight = NULL;
+   }
+   TALLOC_FREE(state->hedgeTimer);
+   if (state->hedge != NULL)
+   {
+      rdirect_io_abandon(state->hedge);
+      state->hedge = NULL;
+   }
+}
+
+
+
+static void rdirect_pread_cleanup(struct tevent_req *req, enum tevent_req_state req_state)
+{
+   struct rdirect_pread_state *state = tevent_req_data(req, struct rdirect_pread_state);
+
+   rdirect_pread_detach(state);
+   for (unsigned int i = 0; i < state->numIos; ++i)
+   {
+      if (state->ios[i] != NULL)
+      {
+         rdirect_io_abandon(state->ios[i]);
+         state->ios[i] = NULL;
+      }
+   }
+   TALLOC_FREE(state->tail);
+}
+
+
+
+/*
+ * Cancel the request (SMB2 CANCEL, or the client has gone).
+ * A request waiting for QoS admission, a read-ahead chunk or the read of another request, is detached. Its reads
+ * in flight are cancelled, and those into buffers of their own abandoned. So the request completes with ECANCELED,
+ * as soon as no read writes into the caller's buffer anymore (right away, unless it was read direct).
+ */
+static bool rdirect_pread_cancel(struct tevent_req *req)
+{
+   struct rdirect_pread_state *state = tevent_req_data(req, struct rdirect_pread_state);
+   if (state->cancelled)
+   {
+      return true;
+   }
+   state->cancelled = true;
+   rdirect_count(state->stats, RDIRECT_STATS_CANCELLED_READS, 1);
+
+   rdirect_pread_detach(state);
+   for (unsigned int i = 0; i < state->numIos; ++i)
+   {
+      struct rdirect_io *io = state->ios[i];
+      if ((io != NULL) && io->ownBuffer)
+      {
+         rdirect_io_abandon(io);
+         state->ios[i] = NULL;
+         --state->pending;
+      }
+      else if (io != NULL)
+      {
+         rdirect_io_cancel(io); //completes in rdirect_pread_io_done
+      }
+   }
+   if (state->pending == 0)
+   {
+      tevent_req_error(req, ECANCELED);
+   }
+   return true;
+}
+
+
+
+//completion of a read, passed to the next module
+static void rdirect_pread_next_done(struct tevent_req *subreq)
+{
+   struct tevent_req *req = tevent_req_callback_data(
+      subreq, struct tevent_req);
+   struct rdirect_pread_state *state = tevent_req_data(
+      req, struct rdirect_pread_state);
+
+   state->bytes_read = SMB_VFS_PREAD_RECV(subreq, &state->vfs_aio_state);
+   TALLOC_FREE(subreq);
+   if (state->bytes_read == -1) {
+      tevent_req_error(req, state->vfs_aio_state.error);
+      return;
+   }
+   if (state->dontneed && (state->bytes_read > 0))
+   {
+      posix_fadvise(state->dontneedFd, state->offset, state->bytes_read, POSIX_FADV_DONTNEED);
+   }
+   tevent_req_done(req);
+}
+
+
+
+/*
+ * Start the direct read of the request `state` (of the file handle `rfsp`): serve it from the block cache, the
+ * page cache or read-ahead, attach it to a read in flight, or submit it to the engine.
+ * The request may be completed synchronously. Returns false on out of memory (the caller falls back to a
+ * synchronous read then).
+ */
+static bool rdirect_pread_start(vfs_handle_struct * const handle, struct tevent_context * const ev,
+         const struct rdirect_config * const config, files_struct * const fsp, struct rdirect_fsp * const rfsp,
+         struct rdirect_pread_state * const state)
+{
+   struct tevent_req *req = state->req;
+   void * const data = state->data;
+   const size_t n = state->n;
+   const off_t offset = state->offset;
+
+   //serve the request from the block cache, if possible
+   const bool cached = config->cache && ((uint64_t)offset + n <= config->cacheRange);
+   if (cached)
+   {
+      if (rdirect_cache_read(&rfsp->file, data, n, offset, &state->bytes_read))
+      {
+         rdirect_count(config->stats, RDIRECT_STATS_CACHE_HITS, 1);
+         tevent_req_done(req);
+         return true;
+      }
+      rdirect_count(config->stats, RDIRECT_STATS_CACHE_MISSES, 1);
+   }
+   //or from the page cache, if resident already
+   if (config->tryPageCache && rdirect_read_cached(fsp_get_io_fd(fsp), data, n, offset))
+   {
+      rdirect_count(config->stats, RDIRECT_STATS_PAGE_CACHE_HITS, 1);
+      state->bytes_read = (ssize_t)n;
+      tevent_req_done(req);
+      return true;
+   }
+
+   //serve the request from read-ahead, if possible
+   struct rdirect_readahead *ra = (config->raDepth > 0) ? rdirect_ra_get(config, fsp, rfsp) : NULL;
+   if (ra != NULL)
+   {
+      rdirect_ra_access(ra, n, offset);
+      struct rdirect_ra_chunk *chunk = rdirect_ra_find(ra, n, offset);
+      if (chunk != NULL)
+      {
+         rdirect_count(config->stats, RDIRECT_STATS_READAHEAD_HITS, 1);
+         if (chunk->ready)
+         {
+            rdirect_pread_serve_chunk(state, chunk);
+         }
+         else
+         {
+            state->chunk = chunk;
+            DLIST_ADD_END(chunk->waiters, state);
+         }
+         rdirect_ra_prefetch(handle, ev, config, rfsp, ra);
+         return true;
+      }
+   }
+
+   //attach the request to a read of the same range in flight, if any
+   struct rdirect_flight *flight = config->coalesce ? rdirect_flight_find(&fsp->file_id, n, offset) : NULL;
+   if (flight != NULL)
+   {
+      rdirect_count(config->stats, RDIRECT_STATS_COALESCED_READS, 1);
+      state->flight = flight;
+      DLIST_ADD_END(flight->waiters, state);
+      if (ra != NULL)
+      {
+         rdirect_ra_prefetch(handle, ev, config, rfsp, ra);
+      }
+      return true;
+   }
+
+   //read the request by itself
+   rdirect_span_init(&state->span, &rfsp->align, n, offset);
+   if (cached && ((RDIRECT_CACHE_BLOCK % rfsp->align.offset) == 0))
+   {
+      //read whole blocks, to fill the cache with
+      const off_t end = state->span.offset + (off_t)state->span.len;
+      state->span.offset = (offset / RDIRECT_CACHE_BLOCK) * RDIRECT_CACHE_BLOCK;
+      state->span.head = (size_t)(offset - state->span.offset);
+      state->span.len = (size_t)(((end + RDIRECT_CACHE_BLOCK - 1) / RDIRECT_CACHE_BLOCK) * RDIRECT_CACHE_BLOCK
+            - state->span.offset);
+      state->cacheFill = true;
+      state->cacheFile = rfsp->file;
+      state->cacheEpoch = rdirect_cache_epoch();
+   }
+   if (!rdirect_pread_submit(handle, ev, config, rfsp, config->coalesce ? &fsp->file_id : NULL, state))
+   {
+      return false;
+   }
+   if (ra != NULL)
+   {
+      rdirect_ra_prefetch(handle, ev, config, rfsp, ra);
+   }
+   return true;
+}
+
+
+
+//start the direct read of the request `state`, admitted by QoS after waiting
+static void rdirect_pread_resume(struct rdirect_pread_state * const state)
+{
+   struct rdirect_fsp *rfsp = (struct rdirect_fsp *)VFS_FETCH_FSP_EXTENSION(state->handle, state->fsp);
+   if ((rfsp != NULL) && rdirect_pread_start(state->handle, state->ev, state->config, state->fsp, rfsp, state))
+   {
+      return;
+   }
+   //out of memory -> fall back to synchronous read (charged already)
+   const ssize_t ret = rdirect_pread_sync(state->handle, state->config, state->fsp, state->data, state->n,
+         state->offset, false);
+   if (ret < 0)
+   {
+      tevent_req_error(state->req, errno);
+      return;
+   }
+   state->bytes_read = ret;
+   tevent_req_done(state->req);
+}
+
+
+
+static void rdirect_qos_timer(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time,
+         void *private_data);
+
+//arm the timer of `qos`, to admit the queued requests in `wait` [ns]. Returns false on out of memory
+static bool rdirect_qos_schedule(struct rdirect_qos * const qos, struct tevent_context * const ev, const int64_t wait)
+{
+   const int64_t us = (wait + 999) / 1000;
+   qos->timer = tevent_add_timer(ev, qos, tevent_timeval_current_ofs((uint32_t)(us / 1000000), (uint32_t)(us % 1000000)),
+         rdirect_qos_timer, qos);
+   if (qos->timer == NULL)
+   {
+      DEBUG(1, ("vfs_rdirect:qos Failed to arm timer, admitting request.\n"));
+      return false;
+   }
+   return true;
+}
+
+
+
+//admit the queued requests of `qos`, as far as the bucket allows. The timer is armed again for the rest
+static void rdirect_qos_timer(struct tevent_context *ev, struct tevent_timer *te, struct timeval current_time,
+         void *private_data)
+{
+   struct rdirect_qos *qos = (struct rdirect_qos *)private_data;
+   qos->timer = NULL; //freed by tevent after the handler
+
+   while (qos->queue != NULL)
+   {
+      struct rdirect_pread_state *state = qos->queue;
+      const int64_t wait = rdirect_qos_take(qos, state->n, false);
+      if (wait > 0)
+      {
+         if (rdirect_qos_schedule(qos, ev, wait))
+         {
+            return;
+         }
+         rdirect_qos_take(qos, state->n, true); //without a timer, it would be stalled
+      }
+      DLIST_REMOVE(qos->queue, state);
+      state->qos = NULL;
+      rdirect_pread_resume(state); //completions are deferred, so the queue doesn't change meanwhile
+   }
+}
+
+
+
+/*
+ * Admit the direct read request `state` to the engine, if the QoS bucket allows. Otherwise it is queued, behind
+ * the requests waiting already, and started by the timer.
+ * Returns true, if admitted right away.
+ */
+static bool rdirect_qos_admit(struct rdirect_qos * const qos, struct tevent_context * const ev,
+         struct rdirect_pread_state * const state)
+{
+   if (qos->queue == NULL)
+   {
+      const int64_t wait = rdirect_qos_take(qos, state->n, false);
+      if (wait == 0)
+      {
+         return true;
+      }
+      if (!rdirect_qos_schedule(qos, ev, wait))
+      {
+         rdirect_qos_take(qos, state->n, true);
+         return true;
+      }
+   }
+   state->qos = qos;
+   DLIST_ADD_END(qos->queue, state);
+   return false;
+}
+
+
+
+static struct tevent_req *rdirect_pread_send(struct vfs_handle_struct *handle,
+                     TALLOC_CTX *mem_ctx,
+                     struct tevent_context *ev,
+                     struct files_struct *fsp,
+                     void *data,
+                     size_t n, off_t offset)
+{
+   struct tevent_req *req = NULL;
+   struct rdirect_pread_state *state = NULL;
+   struct rdirect_config *config = NULL;
+   ssize_t ret = -1;
+   bool charged = false; //the request has been charged to the QoS
+
+   // DEBUG(10, ("vfs_rdirect:pread_send file %s, data=%p, n=%lu, offset=%ld\n",
+   //        fsp_str_dbg(fsp), data, n, offset));
+
+   SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return NULL);
+
+   req = tevent_req_create(mem_ctx, &state, struct rdirect_pread_state);
+   if (req == NULL) {
+      return NULL;
+   }
+   state->stats = config->stats;
+#ifdef RDIRECT_PROBES
+   state->fd = fsp_get_io_fd(fsp);
+   state->offset = offset;
+   state->n = n;
+   PROFILE_TIMESTAMP(&state->start);
+#endif
+   RDIRECT_PROBE4(pread_entry, fsp_get_io_fd(fsp), offset, n, 1);
+
+   if ((n > 0) && (config->engine != RDIRECT_ENGINE_SYNC))
+   {
+      struct rdirect_fsp *rfsp = rdirect_fsp_prepare(handle, config, fsp);
+      if (rfsp == NULL)
+      {
+         tevent_req_error(req, errno);
+         return tevent_req_post(req, ev);
+      }
+      const enum rdirect_pass pass = rdirect_read_pass(config, rfsp, n, offset, true);
+      if (pass != RDIRECT_PASS_NONE)
+      {
+         //read via page cache -> pass the request to the next module
+         RDIRECT_PROBE4(fallback, fsp_get_io_fd(fsp), offset, n, pass);
+         state->offset = offset;
+         state->dontneed = rfsp->fallback && config->fallbackDontneed;
+         state->dontneedFd = fsp_get_io_fd(fsp);
+         struct tevent_req *subreq = SMB_VFS_NEXT_PREAD_SEND(state, ev, handle, fsp, data, n, offset);
+         if (tevent_req_nomem(subreq, req))
+         {
+            return tevent_req_post(req, ev);
+         }
+         tevent_req_set_callback(subreq, rdirect_pread_next_done, req);
+         return req;
+      }
+      if (!rdirect_fsp_clip(rfsp, &n, offset))
+      {
+         tevent_req_done(req); //at end of file
+         return tevent_req_post(req, ev);
+      }
+
+      state->req = req;
+      state->handle = handle;
+      state->ev = ev;
+      state->fsp = fsp;
+      state->config = config;
+      state->data = data;
+      state->n = n;
+      state->offset = offset;
+      tevent_req_set_cleanup_fn(req, rdirect_pread_cleanup);
+      tevent_req_set_cancel_fn(req, rdirect_pread_cancel);
+
+      //wait for admission, if over the QoS limits
+      if ((config->qos != NULL) && !rdirect_qos_admit(config->qos, ev, state))
+      {
+         tevent_req_defer_callback(req, ev);
+         return req;
+      }
+      charged = (config->qos != NULL);
+      if (rdirect_pread_start(handle, ev, config, fsp, rfsp, state))
+      {
+         if (!tevent_req_is_in_progress(req))
+         {
+            return tevent_req_post(req, ev); //completed synchronously
+         }
+         tevent_req_defer_callback(req, ev);
+         return req;
+      }
+      //out of memory -> fall back to synchronous read
+   }
+
+   /*
+    * Fake up an async read by calling the synchronous API.
+    */
+   ret = rdirect_pread_sync(handle, config, fsp, data, n, offset, !charged);
+   if (ret < 0) {
+      tevent_req_error(req, errno);
+      return tevent_req_post(req, ev);
+   }
 
+   state->bytes_read = ret;
+   tevent_req_done(req);
+   /* Return and schedule the completion of the call. */
+   return tevent_req_post(req, ev);
+}
 
 
-static ssize_t rdirect_pread(vfs_handle_struct *const handle, files_struct * const fsp, void * const data,
-         size_t n, const off_t offset)
+static ssize_t rdirect_pread_recv(struct tevent_req *req,
+               struct vfs_aio_state *vfs_aio_state)
 {
-   DEBUG(10, ("vfs_rdirect:pread file %s, data=%p, n=%lu, offset=%ld\n",
-          fsp_str_dbg(fsp), data, n, offset));
+   struct rdirect_pread_state *state =
+      tevent_req_data(req, struct rdirect_pread_state);
+   ssize_t ret;
 
-   //ATTENTION: This simple implementation doesn't support fragmented read.
-   //Instead, everything must be read at once. Subsequent reads (with an offset > 0) will return immediattly and imply "end of file" to the caller!
-   //Thus, if the file is bigger than the buffer (given by {data, n}) the content will be truncated.
-   if (offset > 0)
-   {
-      return 0; //end of file
-   }
+   // DEBUG(10, ("vfs_rdirect:pread_recv\n"));
 
-   //ensure minimum buffer size
-   if (n < 512)
-   {
+#ifdef RDIRECT_PROBES
+   struct timespec end;
+   PROFILE_TIMESTAMP(&end);
+#endif
+   if (tevent_req_is_unix_error(req, &vfs_aio_state->error)) {
+      rdirect_count_request(state->stats, false, -1);
+      RDIRECT_PROBE5(pread_return, state->fd, state->offset, state->n, -vfs_aio_state->error,
+            nsec_time_diff(&end, &state->start));
+      tevent_req_received(req);
       return -1;
    }
+   *vfs_aio_state = state->vfs_aio_state;
+   ret = state->bytes_read;
+   rdirect_count_request(state->stats, false, ret);
+   RDIRECT_PROBE5(pread_return, state->fd, state->offset, state->n, ret, nsec_time_diff(&end, &state->start));
+   tevent_req_received(req);
+   return ret;
+}
 
-   //do read
-   //get path to the file (from file descriptor)
-   char filePath[256];
-   snprintf(filePath, sizeof(filePath), "/proc/self/fd/%d", fsp_get_io_fd(fsp));
-   // DEBUG(10, ("vfs_rdirect:pread try to get filename of %s\n", filePath));
-   int len = readlink(filePath, filePath, sizeof(filePath) - 1); //You can use readlink on /proc/self/fd/NNN where NNN is the file descriptor. This will give you the name of the file as it was when it was opened
-   if (len <= 0)
+
+
+//drop the read-ahead chunks overlapping a written range of the file `id`, of all its file handles. Chunks with
+//waiters are released once they have been served
+static void rdirect_ra_invalidate(const struct file_id * const id, const size_t n, const off_t offset)
+{
+   for (struct rdirect_readahead *ra = rdirect_readaheads; ra != NULL; ra = ra->next)
    {
-      DEBUG(10, ("vfs_rdirect:pread Failed to read filename.\n"));
-      return -1;
+      if (!file_id_equal(&ra->id, id))
+      {
+         continue;
+      }
+      for (unsigned int i = 0; i < RDIRECT_RA_MAX_DEPTH; ++i)
+      {
+         struct rdirect_ra_chunk *chunk = &ra->chunks[i];
+         if ((chunk->io == NULL) || (offset >= chunk->offset + (off_t)ra->size)
+               || (offset + (off_t)n <= chunk->offset))
+         {
+            continue;
+         }
+         if (chunk->waiters == NULL)
+         {
+            rdirect_ra_release(chunk);
+         }
+         else
+         {
+            chunk->stale = true;
+         }
+      }
+      ra->eof = -1; //the file may have grown
    }
-   filePath[len] = 0;
+}
+
+
+
+/*
+ * Drop a written range of the file `id` from read-ahead, the reads in flight and the block cache. This is done
+ * before the write is issued, and again once it has landed (or failed), for reads started in the meantime may
+ * have read the data before it.
+ */
+static void rdirect_write_invalidate(const struct file_id * const id, const struct rdirect_cache_file * const file,
+         const size_t n, const off_t offset)
+{
+   rdirect_ra_invalidate(id, n, offset);
+   rdirect_flight_invalidate(id, n, offset);
+   rdirect_cache_invalidate(file, offset, offset + (off_t)n);
+}
 
 
-   //open file (for direct read)
-   int fd = open(filePath, O_RDONLY | O_DIRECT); //here we open the file for read with O_DIRECT flag set!!!
-   if (fd <= 0)
+
+//write synchronously (the request is counted by the caller)
+static ssize_t rdirect_pwrite_sync(vfs_handle_struct *const handle, const struct rdirect_config * const config,
+         files_struct * const fsp, const void * const data, size_t n, const off_t offset)
+{
+   struct rdirect_fsp *rfsp = rdirect_fsp_prepare(handle, config, fsp);
+   if (rfsp == NULL)
    {
-      DEBUG(10, ("vfs_rdirect:pread Failed to open file %s. Code %d\n",
-            filePath, fd));
       return -1;
    }
-
-   //direct read requires the destination buffer to be 512bytes aligned!
-   //round up to next 512byte boundary
-   uintptr_t buffer = (uintptr_t)data;
-   buffer = buffer + (512 - 1);
-   buffer = buffer & ~((uintptr_t)(512 - 1));
-   //get the number of bytes, i have rounded up
-   const size_t rndup = (size_t)(buffer - (uintptr_t)data);
-   //reduce buffer size by the up-rounded bytes
-   n = n - rndup;
-   n = n & ~((size_t)(512 - 1)); //round down to multiple of 512
-
-   //read file
-   ssize_t count = read(fd, (void *)buffer, n);
-   close(fd); //close file
-   if (rndup != 0)
+   rdirect_write_invalidate(&fsp->file_id, &rfsp->file, n, offset);
+   ssize_t count;
+   if (!rfsp->direct || !rfsp->writable || !rdirect_write_is_direct(&rfsp->align, n, offset) || (n == 0))
    {
-      //move the read bytes by the number of bytes I rounded up - back to the position the have to be!
-      for (size_t i = 0; i < (size_t)count; ++i)
+      count = SMB_VFS_NEXT_PWRITE(handle, fsp, data, n, offset);
+   }
+   else
+   {
+      rdirect_count(config->stats, RDIRECT_STATS_DIRECT_WRITES, 1);
+      count = rdirect_write_direct(rfsp->fd, &rfsp->align, data, n, offset);
+      if (count < 0)
       {
-         ((uint8_t *)data)[i] = ((const uint8_t *)buffer)[i];
+         const int err = errno;
+         DEBUG(10, ("vfs_rdirect:pwrite Failed to write file %s. Code %d\n",
+               fsp_str_dbg(fsp), err));
+         errno = err;
       }
    }
-   ((uint8_t *)data)[count] = 0; //add zero termination
+   rdirect_write_invalidate(&fsp->file_id, &rfsp->file, n, offset);
+   if (count > 0)
+   {
+      rdirect_fsp_extend(rfsp, offset + (off_t)count);
+   }
    return count;
 }
 
 
 
-struct rdirect_pread_state {
-   ssize_t bytes_read;
+static ssize_t rdirect_pwrite(vfs_handle_struct *const handle, files_struct * const fsp, const void * const data,
+         size_t n, const off_t offset)
+{
+   DEBUG(10, ("vfs_rdirect:pwrite file %s, data=%p, n=%lu, offset=%ld\n",
+          fsp_str_dbg(fsp), data, n, offset));
+
+   struct rdirect_config *config = NULL;
+   SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return -1);
+
+   const ssize_t count = rdirect_pwrite_sync(handle, config, fsp, data, n, offset);
+   rdirect_count_request(config->stats, true, count);
+   return count;
+}
+
+
+
+struct rdirect_pwrite_state {
+   struct tevent_req *req; //NULL, when the request was freed while the write was still in flight
+   ssize_t bytes_written;
    struct vfs_aio_state vfs_aio_state;
+   struct rdirect_stats *stats; //statistics of the share (NULL: not collected)
+   vfs_handle_struct *handle; //module handle and file handle, to update the file size by on completion
+   files_struct *fsp;
+   struct file_id id; //file written, to invalidate the range by on completion
+   struct rdirect_cache_file cacheFile; //key of the file in the block cache
+   int fd; //O_DIRECT descriptor to write to
+   struct rdirect_dfd *dfd; //reference to fd, while the write is in flight
+   struct rdirect_align align; //O_DIRECT alignment of fd
+   const void *data; //caller's buffer
+   size_t n; //number of bytes to write
+   off_t offset; //file offset to write to
 };
 
+
+
 /*
- * Fake up an async read by calling the synchronous API.
+ * Asynchronous writes are performed by smbd's worker threadpool (the same way as vfs_default does it),
+ * for both asynchronous engines: they are rare next to the reads the engines are built for.
  */
-static struct tevent_req *rdirect_pread_send(struct vfs_handle_struct *handle,
+static void rdirect_pwrite_do(void *private_data)
+{
+   struct rdirect_pwrite_state *state = talloc_get_type_abort(
+      private_data, struct rdirect_pwrite_state);
+   struct timespec start_time;
+   struct timespec end_time;
+
+   PROFILE_TIMESTAMP(&start_time);
+
+   state->bytes_written = rdirect_write_direct(state->fd, &state->align, state->data, state->n, state->offset);
+   if (state->bytes_written == -1) {
+      state->vfs_aio_state.error = errno;
+   }
+
+   PROFILE_TIMESTAMP(&end_time);
+
+   state->vfs_aio_state.duration = nsec_time_diff(&end_time, &start_time);
+}
+
+
+
+static int rdirect_pwrite_state_destructor(struct rdirect_pwrite_state *state)
+{
+   /*
+    * This destructor only gets called if the request is still
+    * in flight, which is why we deny it by returning -1. We
+    * also set the req pointer to NULL so the _done function
+    * can detect the caller doesn't want the result anymore.
+    */
+   state->req = NULL;
+   return -1;
+}
+
+
+
+//the write of `state` has landed (or failed): drop the written range again (the file handle may be gone)
+static void rdirect_pwrite_invalidate(const struct rdirect_pwrite_state * const state)
+{
+   rdirect_write_invalidate(&state->id, &state->cacheFile, state->n, state->offset);
+}
+
+
+
+//the write of `state` has completed: the file has grown, if written beyond its end
+static void rdirect_pwrite_extend(const struct rdirect_pwrite_state * const state)
+{
+   struct rdirect_fsp *rfsp = (struct rdirect_fsp *)VFS_FETCH_FSP_EXTENSION(state->handle, state->fsp);
+   if ((rfsp != NULL) && (state->bytes_written > 0))
+   {
+      rdirect_fsp_extend(rfsp, state->offset + (off_t)state->bytes_written);
+   }
+}
+
+
+
+static void rdirect_pwrite_done(struct tevent_req *subreq)
+{
+   struct rdirect_pwrite_state *state = tevent_req_callback_data(
+      subreq, struct rdirect_pwrite_state);
+   struct tevent_req *req = state->req;
+   int ret;
+
+   ret = pthreadpool_tevent_job_recv(subreq);
+   TALLOC_FREE(subreq);
+   talloc_set_destructor(state, NULL);
+   if (req == NULL) {
+      /*
+       * We were shutdown closed in flight. No one
+       * wants the result, and state has been reparented
+       * to the NULL context, so just free it so we
+       * don't leak memory.
+       */
+      DBG_NOTICE("vfs_rdirect:pwrite request abandoned in flight\n");
+      rdirect_pwrite_invalidate(state);
+      rdirect_dfd_unref(state->dfd);
+      TALLOC_FREE(state);
+      return;
+   }
+   if (ret != 0) {
+      if (ret != EAGAIN) {
+         rdirect_pwrite_invalidate(state);
+         rdirect_dfd_unref(state->dfd);
+         state->dfd = NULL;
+         tevent_req_error(req, ret);
+         return;
+      }
+      /*
+       * If we get EAGAIN from pthreadpool_tevent_job_recv() this
+       * means the lower level pthreadpool failed to create a new
+       * thread. Fallback to sync processing in that case to allow
+       * some progress for the client.
+       */
+      rdirect_pwrite_do(state);
+   }
+   rdirect_pwrite_invalidate(state);
+   rdirect_dfd_unref(state->dfd);
+   state->dfd = NULL;
+   if (state->bytes_written == -1) {
+      tevent_req_error(req, state->vfs_aio_state.error);
+      return;
+   }
+   rdirect_pwrite_extend(state);
+
+   tevent_req_done(req);
+}
+
+
+
+//completion of a write, passed to the next module
+static void rdirect_pwrite_next_done(struct tevent_req *subreq)
+{
+   struct tevent_req *req = tevent_req_callback_data(
+      subreq, struct tevent_req);
+   struct rdirect_pwrite_state *state = tevent_req_data(
+      req, struct rdirect_pwrite_state);
+
+   state->bytes_written = SMB_VFS_PWRITE_RECV(subreq, &state->vfs_aio_state);
+   TALLOC_FREE(subreq);
+   rdirect_pwrite_invalidate(state);
+   if (state->bytes_written == -1) {
+      tevent_req_error(req, state->vfs_aio_state.error);
+      return;
+   }
+   rdirect_pwrite_extend(state);
+   tevent_req_done(req);
+}
+
+
+
+static struct tevent_req *rdirect_pwrite_send(struct vfs_handle_struct *handle,
                      TALLOC_CTX *mem_ctx,
                      struct tevent_context *ev,
                      struct files_struct *fsp,
-                     void *data,
+                     const void *data,
                      size_t n, off_t offset)
 {
    struct tevent_req *req = NULL;
-   struct rdirect_pread_state *state = NULL;
-   int ret = -1;
+   struct rdirect_pwrite_state *state = NULL;
+   struct rdirect_config *config = NULL;
+   ssize_t ret = -1;
 
-   // DEBUG(10, ("vfs_rdirect:pread_send file %s, data=%p, n=%lu, offset=%ld\n",
-   //        fsp_str_dbg(fsp), data, n, offset));
+   SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return NULL);
 
-   req = tevent_req_create(mem_ctx, &state, struct rdirect_pread_state);
+   req = tevent_req_create(mem_ctx, &state, struct rdirect_pwrite_state);
    if (req == NULL) {
       return NULL;
    }
+   state->stats = config->stats;
+   state->handle = handle;
+   state->fsp = fsp;
+   state->id = fsp->file_id;
+   state->n = n;
+   state->offset = offset;
+
+   struct rdirect_fsp *rfsp = rdirect_fsp_prepare(handle, config, fsp);
+   if (rfsp == NULL)
+   {
+      tevent_req_error(req, errno);
+      return tevent_req_post(req, ev);
+   }
+   state->cacheFile = rfsp->file;
+   rdirect_write_invalidate(&fsp->file_id, &rfsp->file, n, offset);
+   if (!rfsp->direct || !rfsp->writable || !rdirect_write_is_direct(&rfsp->align, n, offset) || (n == 0))
+   {
+      //write via page cache -> pass the request to the next module
+      struct tevent_req *subreq = SMB_VFS_NEXT_PWRITE_SEND(state, ev, handle, fsp, data, n, offset);
+      if (tevent_req_nomem(subreq, req))
+      {
+         return tevent_req_post(req, ev);
+      }
+      tevent_req_set_callback(subreq, rdirect_pwrite_next_done, req);
+      return req;
+   }
 
-   ret = rdirect_pread(handle, fsp, data, n, offset);
+   if (config->engine != RDIRECT_ENGINE_SYNC)
+   {
+      state->req = req;
+      state->fd = rfsp->fd;
+      state->align = rfsp->align;
+      state->data = data;
+
+      struct tevent_req *subreq = pthreadpool_tevent_job_send(
+         state, ev, handle->conn->sconn->pool, rdirect_pwrite_do, state);
+      if (subreq != NULL)
+      {
+         tevent_req_set_callback(subreq, rdirect_pwrite_done, state);
+         talloc_set_destructor(state, rdirect_pwrite_state_destructor);
+         state->dfd = rdirect_dfd_ref(rfsp->dfd);
+         rdirect_count(config->stats, RDIRECT_STATS_DIRECT_WRITES, 1);
+         return req;
+      }
+      //no job -> fall back to synchronous write
+   }
+
+   ret = rdirect_pwrite_sync(handle, config, fsp, data, n, offset);
    if (ret < 0) {
-      tevent_req_error(req, ret);
+      tevent_req_error(req, errno);
       return tevent_req_post(req, ev);
    }
 
-   state->bytes_read = ret;
+   state->bytes_written = ret;
    tevent_req_done(req);
-   /* Return and schedule the completion of the call. */
    return tevent_req_post(req, ev);
 }
 
 
-static ssize_t rdirect_pread_recv(struct tevent_req *req,
+static ssize_t rdirect_pwrite_recv(struct tevent_req *req,
                struct vfs_aio_state *vfs_aio_state)
 {
-   struct rdirect_pread_state *state =
-      tevent_req_data(req, struct rdirect_pread_state);
-
-   // DEBUG(10, ("vfs_rdirect:pread_recv\n"));
+   struct rdirect_pwrite_state *state =
+      tevent_req_data(req, struct rdirect_pwrite_state);
+   ssize_t ret;
 
    if (tevent_req_is_unix_error(req, &vfs_aio_state->error)) {
+      rdirect_count_request(state->stats, true, -1);
+      tevent_req_received(req);
       return -1;
    }
    *vfs_aio_state = state->vfs_aio_state;
-   return state->bytes_read;
+   ret = state->bytes_written;
+   rdirect_count_request(state->stats, true, ret);
+   tevent_req_received(req);
+   return ret;
+}
+
+
+
+//get a size parameter (like `4M`). Returns `def`, if not set or invalid
+static uint64_t rdirect_parm_size(const int snum, const char * const option, const uint64_t def)
+{
+   const char *value = lp_parm_const_string(snum, MODULE, option, NULL);
+   uint64_t size = def;
+   if ((value != NULL) && !conv_str_size_error(value, &size))
+   {
+      DEBUG(1, ("vfs_rdirect:connect Invalid value for %s: %s\n", option, value));
+      return def;
+   }
+   return size;
+}
+
+
+
+static int rdirect_connect(vfs_handle_struct *handle, const char *service, const char *user)
+{
+   int ret = SMB_VFS_NEXT_CONNECT(handle, service, user);
+   if (ret < 0)
+   {
+      return ret;
+   }
+
+   struct rdirect_config *config = talloc_zero(handle->conn, struct rdirect_config);
+   if (config == NULL)
+   {
+      SMB_VFS_NEXT_DISCONNECT(handle);
+      errno = ENOMEM;
+      return -1;
+   }
+
+   config->engine = (enum rdirect_engine)lp_parm_enum(SNUM(handle->conn), MODULE, "engine",
+         rdirect_engines, RDIRECT_ENGINE_DEFAULT);
+#ifndef RDIRECT_URING
+   if (config->engine == RDIRECT_ENGINE_IO_URING)
+   {
+      DEBUG(1, ("vfs_rdirect:connect io_uring engine not available, using threadpool.\n"));
+      config->engine = RDIRECT_ENGINE_THREADPOOL;
+   }
+#endif
+
+   config->minSize = rdirect_parm_size(SNUM(handle->conn), "min size", 0);
+   config->rules = rdirect_rules_compile(config, lp_parm_string_list(SNUM(handle->conn), MODULE, "include", NULL),
+         lp_parm_string_list(SNUM(handle->conn), MODULE, "exclude", NULL));
+   const char * const ioHint = lp_parm_const_string(SNUM(handle->conn), MODULE, "io hint", NULL);
+   config->ioHint = RDIRECT_IO_HINT_AUTO;
+   if ((ioHint != NULL) && strequal(ioHint, "none"))
+   {
+      config->ioHint = 0;
+   }
+   else if ((ioHint != NULL) && !strequal(ioHint, "auto"))
+   {
+      uint64_t size = 0;
+      if (!conv_str_size_error(ioHint, &size) || (size == 0) || (size > RDIRECT_IO_HINT_MAX))
+      {
+         DEBUG(1, ("vfs_rdirect:connect Invalid value for io hint: %s\n", ioHint));
+      }
+      else
+      {
+         config->ioHint = (uint32_t)size;
+      }
+   }
+
+   const int raDepth = lp_parm_int(SNUM(handle->conn), MODULE, "readahead", 0);
+   config->raDepth = (unsigned int)MIN(MAX(raDepth, 0), RDIRECT_RA_MAX_DEPTH);
+   config->raSize = rdirect_parm_size(SNUM(handle->conn), "readahead size", 1024 * 1024);
+   config->raMemory = rdirect_parm_size(SNUM(handle->conn), "readahead memory", 64 * 1024 * 1024);
+   config->chunkSize = rdirect_parm_size(SNUM(handle->conn), "chunk size", 0);
+   config->bounceMemory = rdirect_parm_size(SNUM(handle->conn), "bounce memory", 0);
+   config->coalesce = lp_parm_bool(SNUM(handle->conn), MODULE, "coalesce", false);
+   const uint64_t cacheSize = rdirect_parm_size(SNUM(handle->conn), "cache size", 0);
+   config->cacheRange = rdirect_parm_size(SNUM(handle->conn), "cache range", 1024 * 1024);
+   config->tryPageCache = lp_parm_bool(SNUM(handle->conn), MODULE, "try page cache", false);
+   config->fallbackDontneed = lp_parm_bool(SNUM(handle->conn), MODULE, "fallback dontneed", false);
+   config->sendfile = lp_parm_bool(SNUM(handle->conn), MODULE, "sendfile", true);
+   config->raw = lp_parm_bool(SNUM(handle->conn), MODULE, "raw device", false);
+   if (config->raw && !handle->conn->read_only)
+   {
+      DEBUG(1, ("vfs_rdirect:connect raw device requires a read only share, disabled.\n"));
+      config->raw = false;
+   }
+   const int hedgeAfter = lp_parm_int(SNUM(handle->conn), MODULE, "hedge after", 0);
+   config->hedgeAfter = (unsigned int)MAX(hedgeAfter, 0);
+   config->hedgeMirror = -1;
+   const char * const hedgeMirror = lp_parm_const_string(SNUM(handle->conn), MODULE, "hedge mirror", NULL);
+   if ((hedgeMirror != NULL) && (hedgeMirror[0] != '\0'))
+   {
+      if (config->raw)
+      {
+         config->hedgeMirror = rdirect_raw_mirror(hedgeMirror);
+      }
+      else
+      {
+         DEBUG(1, ("vfs_rdirect:connect hedge mirror requires raw device, duplicates are read via page cache.\n"));
+      }
+   }
+   if ((config->hedgeAfter > 0) && (config->engine == RDIRECT_ENGINE_SYNC))
+   {
+      DEBUG(1, ("vfs_rdirect:connect hedge after requires an asynchronous engine, disabled.\n"));
+      config->hedgeAfter = 0;
+   }
+   config->adaptive = lp_parm_bool(SNUM(handle->conn), MODULE, "adaptive", false);
+   config->adaptiveSize = rdirect_parm_size(SNUM(handle->conn), "adaptive size", 64 * 1024);
+   const char * const numaNode = lp_parm_const_string(SNUM(handle->conn), MODULE, "numa node", NULL);
+   int node = -1;
+   if ((numaNode != NULL) && strequal(numaNode, "auto"))
+   {
+      node = RDIRECT_MEM_NODE_AUTO;
+   }
+   else if ((numaNode != NULL) && (!strequal(numaNode, "none")))
+   {
+      char *end = NULL;
+      const long value = strtol(numaNode, &end, 10);
+      if ((end == numaNode) || (*end != '\0') || (value < 0))
+      {
+         DEBUG(1, ("vfs_rdirect:connect Invalid value for numa node: %s\n", numaNode));
+      }
+      else
+      {
+         node = (int)MIN(value, INT_MAX);
+      }
+   }
+   rdirect_mem_configure(lp_parm_bool(SNUM(handle->conn), MODULE, "hugepages", false), node);
+   if (lp_parm_bool(SNUM(handle->conn), MODULE, "stats", false))
+   {
+      config->stats = rdirect_stats_get(lp_const_servicename(SNUM(handle->conn)));
+   }
+   const uint64_t qosBandwidth = rdirect_parm_size(SNUM(handle->conn), "qos bandwidth", 0);
+   const int qosIops = lp_parm_int(SNUM(handle->conn), MODULE, "qos iops", 0);
+   const enum rdirect_qos_scope qosScope = (enum rdirect_qos_scope)lp_parm_enum(SNUM(handle->conn), MODULE,
+         "qos scope", rdirect_qos_scopes, RDIRECT_QOS_SCOPE_CONNECTION);
+   config->qos = rdirect_qos_new(config, qosBandwidth, (uint64_t)MAX(qosIops, 0), qosScope,
+         lp_const_servicename(SNUM(handle->conn)), user);
+   if ((config->qos != NULL) && (config->engine == RDIRECT_ENGINE_SYNC))
+   {
+      DEBUG(1, ("vfs_rdirect:connect qos requires an asynchronous engine to delay reads, reads are only counted.\n"));
+   }
+   if ((cacheSize > 0) && (config->engine == RDIRECT_ENGINE_SYNC))
+   {
+      DEBUG(1, ("vfs_rdirect:connect cache requires an asynchronous engine, disabled.\n"));
+   }
+   else if (cacheSize > 0)
+   {
+      config->cache = rdirect_cache_attach((size_t)cacheSize);
+   }
+   if ((config->raDepth > 0) && ((config->engine == RDIRECT_ENGINE_SYNC) || (config->raSize == 0)))
+   {
+      DEBUG(1, ("vfs_rdirect:connect readahead requires an asynchronous engine, disabled.\n"));
+      config->raDepth = 0;
+   }
+
+   SMB_VFS_HANDLE_SET_DATA(handle, config, NULL, struct rdirect_config, return -1);
+   return 0;
+}
+
+
+
+static int rdirect_ftruncate(vfs_handle_struct *handle, files_struct *fsp, off_t len)
+{
+   //cached blocks of the file are dropped (blocks at the old end of file are stale, if the file grows)
+   struct rdirect_fsp *rfsp = (struct rdirect_fsp *)VFS_FETCH_FSP_EXTENSION(handle, fsp);
+   if (rfsp != NULL)
+   {
+      rdirect_cache_invalidate(&rfsp->file, 0, -1);
+      rfsp->size = -1; //refreshed on next read
+   }
+   return SMB_VFS_NEXT_FTRUNCATE(handle, fsp, len);
+}
+
+
+
+/*
+ * Report the preferred size of direct reads (rdirect:io hint) as the I/O size (st_blksize) of a file read direct.
+ * Clients and modules, that size their reads by it, issue reads that are aligned, and large enough for the device.
+ * Whether the file is read direct, is known from its handle `rfsp` (if decided), or else by its `path`.
+ * Devices are known once a file there has been opened direct; files on others are reported as they are.
+ */
+static void rdirect_stat_hint(const struct rdirect_config * const config, const struct rdirect_fsp * const rfsp,
+         const char * const path, SMB_STRUCT_STAT * const st)
+{
+   if ((config->ioHint == 0) || !S_ISREG(st->st_ex_mode))
+   {
+      return;
+   }
+   const struct rdirect_dev * const entry = rdirect_dev_find(st->st_ex_dev);
+   if ((entry == NULL) || entry->unsupported)
+   {
+      return;
+   }
+   if ((rfsp != NULL) && rfsp->decided)
+   {
+      if (!rfsp->direct)
+      {
+         return;
+      }
+   }
+   else
+   {
+      const uint8_t rules = rdirect_rules_match(config->rules, path);
+      if ((rules & RDIRECT_RULE_EXCLUDE)
+            || (!(rules & RDIRECT_RULE_INCLUDE) && ((uint64_t)st->st_ex_size < config->minSize)))
+      {
+         return;
+      }
+   }
+   if (config->ioHint == RDIRECT_IO_HINT_AUTO)
+   {
+      st->st_ex_blksize = MAX(st->st_ex_blksize, (blksize_t)entry->ioSize); //(never less than the filesystem's)
+      return;
+   }
+   const uint32_t mask = entry->align.offset - 1;
+   st->st_ex_blksize = (blksize_t)((config->ioHint + mask) & ~mask);
+}
+
+
+
+static int rdirect_stat(vfs_handle_struct *handle, struct smb_filename *smb_fname)
+{
+   const int ret = SMB_VFS_NEXT_STAT(handle, smb_fname);
+   if (ret == 0)
+   {
+      struct rdirect_config *config = NULL;
+      SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return ret);
+      rdirect_stat_hint(config, NULL, smb_fname->base_name, &smb_fname->st);
+   }
+   return ret;
+}
+
+
+
+static int rdirect_lstat(vfs_handle_struct *handle, struct smb_filename *smb_fname)
+{
+   const int ret = SMB_VFS_NEXT_LSTAT(handle, smb_fname);
+   if (ret == 0)
+   {
+      struct rdirect_config *config = NULL;
+      SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return ret);
+      rdirect_stat_hint(config, NULL, smb_fname->base_name, &smb_fname->st);
+   }
+   return ret;
+}
+
+
+
+static int rdirect_fstat(vfs_handle_struct *handle, files_struct *fsp, SMB_STRUCT_STAT *sbuf)
+{
+   const int ret = SMB_VFS_NEXT_FSTAT(handle, fsp, sbuf);
+   if (ret == 0)
+   {
+      struct rdirect_config *config = NULL;
+      SMB_VFS_HANDLE_GET_DATA(handle, config, struct rdirect_config, return ret);
+      const struct rdirect_fsp * const rfsp = (struct rdirect_fsp *)VFS_FETCH_FSP_EXTENSION(handle, fsp);
+      rdirect_stat_hint(config, rfsp, fsp->fsp_name->base_name, sbuf);
+   }
+   return ret;
+}
+
+
+
+static int rdirect_close(vfs_handle_struct *handle, files_struct *fsp)
+{
+   //close the O_DIRECT descriptor (if any) together with the handle
+   VFS_REMOVE_FSP_EXTENSION(handle, fsp);
+   return SMB_VFS_NEXT_CLOSE(handle, fsp);
 }
 
 
 
 /* VFS operations structure */
 static struct vfs_fn_pointers vfs_rdirect_fns = {
+   /* Disk operations */
+   .connect_fn = rdirect_connect,
+
    /* File operations */
+   .openat_fn = rdirect_openat,
+   .close_fn = rdirect_close,
+   .stat_fn = rdirect_stat,
+   .lstat_fn = rdirect_lstat,
+   .fstat_fn = rdirect_fstat,
    .pread_fn = rdirect_pread,
    .pread_send_fn = rdirect_pread_send,
-   .pread_recv_fn = rdirect_pread_recv
+   .pread_recv_fn = rdirect_pread_recv,
+   .sendfile_fn = rdirect_sendfile,
+   .pwrite_fn = rdirect_pwrite,
+   .pwrite_send_fn = rdirect_pwrite_send,
+   .pwrite_recv_fn = rdirect_pwrite_recv,
+   .ftruncate_fn = rdirect_ftruncate
 };
 
 
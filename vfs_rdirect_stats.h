@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) Manuel Heiss 2021
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * I/O statistics of vfs_rdirect (`rdirect:stats`).
+ *
+ * The statistics reside in a POSIX shared memory segment, with one slot per share. All smbd processes serving
+ * a share add to the counters of its slot (atomically), so the counters are totals since the segment has been
+ * created. This header describes the layout of the segment. It is shared by the module and the rdirect_stats tool.
+ */
+#ifndef _VFS_RDIRECT_STATS_H
+#define _VFS_RDIRECT_STATS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define RDIRECT_STATS_NAME          "/vfs_rdirect.stats"   //name of the shared memory segment
+#define RDIRECT_STATS_MAGIC         0x52445337             //"RDS7"
+#define RDIRECT_STATS_SHARES        64                     //number of slots
+#define RDIRECT_STATS_SHARE_NAME    64                     //max. length of a share name (including termination)
+#define RDIRECT_STATS_BUCKETS       24                     //number of buckets of a latency histogram
+
+/*
+ * Counters (id, name).
+ */
+#define RDIRECT_STATS_COUNTERS(X) \
+   X(READS,             "reads")             /* read requests */ \
+   X(READ_BYTES,        "read_bytes")        /* bytes returned by read requests */ \
+   X(READ_ERRORS,       "read_errors")       /* failed read requests */ \
+   X(DIRECT_READS,      "direct_reads")      /* requests served direct (including cache hits) */ \
+   X(BUFFERED_READS,    "buffered_reads")    /* requests passed to the next module (rdirect:min size, rdirect:exclude) */ \
+   X(FALLBACK_READS,    "fallback_reads")    /* requests passed to the next module (O_DIRECT not available) */ \
+   X(ADAPTIVE_READS,    "adaptive_reads")    /* requests passed to the next module (access pattern, rdirect:adaptive) */ \
+   X(ADAPTIVE_SWITCHES, "adaptive_switches") /* switches of file handles between direct and buffered mode */ \
+   X(BOUNCE_COPIES,     "bounce_copies")     /* copies out of a bounce buffer */ \
+   X(BOUNCE_BYTES,      "bounce_bytes")      /* bytes copied out of a bounce buffer */ \
+   X(COALESCED_READS,   "coalesced_reads")   /* requests attached to a read in flight */ \
+   X(READAHEAD_HITS,    "readahead_hits")    /* requests served from read-ahead */ \
+   X(CACHE_HITS,        "cache_hits")        /* requests served from the block cache */ \
+   X(CACHE_MISSES,      "cache_misses")      /* requests in the cache range, not served from the block cache */ \
+   X(PAGE_CACHE_HITS,   "page_cache_hits")   /* requests served from the page cache (rdirect:try page cache) */ \
+   X(SENDFILE_READS,    "sendfile_reads")    /* requests sent to the client via splice (rdirect:sendfile) */ \
+   X(RAW_READS,         "raw_reads")         /* direct requests read from the block device (rdirect:raw device) */ \
+   X(CANCELLED_READS,   "cancelled_reads")   /* requests cancelled (SMB2 CANCEL, client gone) */ \
+   X(HEDGED_READS,      "hedged_reads")      /* duplicate reads issued after rdirect:hedge after */ \
+   X(HEDGE_WINS,        "hedge_wins")        /* requests served by their duplicate read */ \
+   X(MERGED_READS,      "merged_reads")      /* device reads merged with adjacent ones into one read (io_uring) */ \
+   X(IN_PLACE_READS,    "in_place_reads")    /* unaligned requests read into the caller's buffer (rdirect:bounce memory) */ \
+   X(WRITES,            "writes")            /* write requests */ \
+   X(WRITE_BYTES,       "write_bytes")       /* bytes written by write requests */ \
+   X(WRITE_ERRORS,      "write_errors")      /* failed write requests */ \
+   X(DIRECT_WRITES,     "direct_writes")     /* requests written direct */
+
+enum rdirect_stats_counter {
+#define RDIRECT_STATS_ENUM(id, name) RDIRECT_STATS_##id,
+   RDIRECT_STATS_COUNTERS(RDIRECT_STATS_ENUM)
+#undef RDIRECT_STATS_ENUM
+   RDIRECT_STATS_NUM_COUNTERS
+};
+
+/*
+ * Latency histograms of the device reads, per engine (in the order of enum rdirect_engine).
+ * Bucket i counts the reads, that took [2^i, 2^(i+1)) microseconds. The first bucket also counts faster reads,
+ * the last one slower reads.
+ */
+#define RDIRECT_STATS_ENGINES       3
+#define RDIRECT_STATS_ENGINE_NAMES  { "sync", "threadpool", "io_uring" }
+
+struct rdirect_stats {
+   char share[RDIRECT_STATS_SHARE_NAME]; //name of the share (empty: slot is unused)
+   uint64_t counters[RDIRECT_STATS_NUM_COUNTERS];
+   uint64_t latency[RDIRECT_STATS_ENGINES][RDIRECT_STATS_BUCKETS];
+};
+
+struct rdirect_stats_segment {
+   uint32_t magic; //set, when the segment is initialized
+   uint32_t numShares; //number of slots
+   pthread_mutex_t mutex; //serializes the allocation of slots (process shared, robust)
+   struct rdirect_stats shares[RDIRECT_STATS_SHARES];
+};
+
+#endif /* _VFS_RDIRECT_STATS_H */